@@ -0,0 +1,2370 @@
+/* Benchmarks for the sensor server. The server is kept in a single translation
+ * unit, so we pull the whole thing in here and leave its main() out. */
+#define KJC_SENSOR_SERVER_NO_MAIN
+#include "server_sensor_data.cpp"
+
+#include <pthread.h>
+#include <random>
+
+constexpr std::size_t constexpr_strlen(const char *s)
+{
+  return std::char_traits<char>::length(s);
+}
+
+/* FormatSensorValue as it was before the encoder was introduced, kept as the baseline */
+static size_t LegacyFormatSensorValue(char *sensor_value_message,
+                                      size_t sensor_value_message_buffer_size,
+                                      std::pair<int32_t, int32_t> value,
+                                      clk::time_point current,
+                                      clk::time_point start)
+{
+  constexpr const char *first_constant_segment = "STATUS;TIME=";
+  constexpr const char *second_constant_segment = ";MV=";
+  constexpr const char *third_constant_segment = ";MA=";
+  constexpr const char *fourth_constant_segment = ";";
+  constexpr int first_constant_segment_size = constexpr_strlen(
+      first_constant_segment);
+  constexpr int second_constant_segment_size = constexpr_strlen(
+      second_constant_segment);
+  constexpr int third_constant_segment_size = constexpr_strlen(
+      third_constant_segment);
+  constexpr int fourth_constant_segment_size = constexpr_strlen(
+      fourth_constant_segment);
+  uint64_t millis = (std::chrono::time_point_cast < std::chrono::milliseconds
+      > (current) - std::chrono::time_point_cast < std::chrono::milliseconds
+      > (start)).count();
+  constexpr int sensor_value_buffer_size = 100;
+  char sensor_value_millivolts[sensor_value_buffer_size];
+  char sensor_value_milliamps[sensor_value_buffer_size];
+
+  int32_t characters_written_millivolts = snprintf(sensor_value_millivolts,
+                                          sensor_value_buffer_size, "%d",
+                                          value.first);
+  int32_t characters_written_milliamps = snprintf(sensor_value_milliamps,
+                                          sensor_value_buffer_size, "%d",
+                                          value.second);
+  if (characters_written_millivolts < 1
+      || characters_written_millivolts >= sensor_value_buffer_size)
+  {
+    fprintf(stderr, "snprintf() failed on millivolts.\n");
+  }
+  if (characters_written_milliamps < 1
+      || characters_written_milliamps >= sensor_value_buffer_size)
+  {
+    fprintf(stderr, "snprintf() failed on milliamps.\n");
+  }
+  constexpr int milliseconds_time_buffer_size = 100;
+  char milliseconds_time[milliseconds_time_buffer_size];
+  /* Use cross platform macro PRIu64 for uint64_t format specifier in snprintf */
+  int characters_written_time = snprintf(milliseconds_time,
+                                         milliseconds_time_buffer_size,
+                                         "%" PRIu64, millis);
+  if (characters_written_time < 1
+      || characters_written_time >= sensor_value_buffer_size)
+  {
+    fprintf(stderr, "snprintf() failed on parse of millisecond field.\n");
+  }
+
+  size_t total_message_length = first_constant_segment_size
+      + characters_written_time + second_constant_segment_size
+      + characters_written_millivolts + third_constant_segment_size
+      + characters_written_milliamps + fourth_constant_segment_size
+      + 1 /* For null terminator if we printf */;
+  /* Check message is not too long */
+  if (total_message_length > sensor_value_message_buffer_size)
+  {
+    fprintf(stderr, "Can send sensor value message, too long.\n");
+    exit(1);
+  }
+  size_t current_index = 0;
+  /* "STATUS;TIME=" segment */
+  memcpy(&sensor_value_message[current_index], first_constant_segment,
+         first_constant_segment_size);
+  current_index += first_constant_segment_size;
+  /* ms field */
+  // TODO KJC could snprintf directly into buffer
+  memcpy(&sensor_value_message[current_index], milliseconds_time,
+         characters_written_time);
+  current_index += characters_written_time;
+  /* ";MV=" segment */
+  memcpy(&sensor_value_message[current_index], second_constant_segment,
+         second_constant_segment_size);
+  current_index += second_constant_segment_size;
+  /* mv field */
+  // TODO KJC could snprintf directly into buffer
+  memcpy(&sensor_value_message[current_index], sensor_value_millivolts,
+         characters_written_millivolts);
+  current_index += characters_written_millivolts;
+  /* ";MA=" */
+  memcpy(&sensor_value_message[current_index], third_constant_segment,
+         third_constant_segment_size);
+  current_index += third_constant_segment_size;
+  /* ma field */
+  // TODO KJC could snprintf directly into buffer
+  memcpy(&sensor_value_message[current_index], sensor_value_milliamps,
+         characters_written_milliamps);
+  current_index += characters_written_milliamps;
+  /* ";" segment */
+  memcpy(&sensor_value_message[current_index], fourth_constant_segment,
+         fourth_constant_segment_size);
+  current_index += fourth_constant_segment_size;
+  /* We set the index after this last one to zero, which isn't included in the
+     UDP message we send out but is useful if we add a debug printf */
+  sensor_value_message[current_index + 1] = '\0';
+  /* This doesn't include the null terminator character */
+  return current_index /* + 1*/;
+}
+
+/* Dependency-free benchmark harness. Micro benchmarks run their body a few
+ * times as warmup and then for a number of repetitions, keeping the time per
+ * operation of each repetition so percentiles can be computed. Scenario
+ * benchmarks (real sockets and threads) run once and record named metrics.
+ * Everything can be written out as JSON to track regressions between releases. */
+class KJCBenchHarness
+{
+public:
+  struct Result
+  {
+    std::string name;
+    /* ns per operation of each measured repetition; empty for scenarios */
+    std::vector<double> repetitions;
+    std::vector<std::pair<std::string, double>> metrics;
+  };
+
+  size_t warmup { 3 };
+  size_t repetitions { 20 };
+  /* Only benchmarks whose name contains this run */
+  std::string filter;
+
+  bool Selected(const std::string &name) const
+  {
+    return name.find(filter) != std::string::npos;
+  }
+
+  /* body() must perform `operations` operations and return something that
+     depends on them, so the compiler can't drop the work */
+  template<typename Body>
+  void Measure(const std::string &name, size_t operations, Body body)
+  {
+    if (!Selected(name))
+    {
+      return;
+    }
+    Result &result = Find(name);
+    for (size_t i = 0; i < warmup + repetitions; ++i)
+    {
+      clk::time_point begin = clk::now();
+      auto value = body();
+      clk::time_point end = clk::now();
+      asm volatile("" : : "g"(&value) : "memory");
+      if (i >= warmup)
+      {
+        result.repetitions.push_back(
+            std::chrono::duration<double, std::nano> { end - begin }.count()
+                / double(operations));
+      }
+    }
+  }
+
+  void Metric(const std::string &name, const std::string &key, double value)
+  {
+    Find(name).metrics.emplace_back(key, value);
+  }
+
+  static double Percentile(std::vector<double> values, double percentile)
+  {
+    if (values.empty())
+    {
+      return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    /* Nearest rank */
+    size_t rank = size_t(ceil(percentile / 100.0 * double(values.size())));
+    return values[rank == 0 ? 0 : rank - 1];
+  }
+
+  void PrintSummary(FILE *out) const;
+  bool WriteJson(const char *path) const;
+
+private:
+  Result& Find(const std::string &name)
+  {
+    for (Result &result : results)
+    {
+      if (result.name == name)
+      {
+        return result;
+      }
+    }
+    results.push_back(Result { name, { }, { } });
+    return results.back();
+  }
+
+  std::vector<Result> results;
+};
+
+void KJCBenchHarness::PrintSummary(FILE *out) const
+{
+  for (const Result &result : results)
+  {
+    fprintf(out, "%-36s", result.name.c_str());
+    if (!result.repetitions.empty())
+    {
+      fprintf(out, " ns/op p50 %.1f p90 %.1f p99 %.1f min %.1f max %.1f",
+              Percentile(result.repetitions, 50),
+              Percentile(result.repetitions, 90),
+              Percentile(result.repetitions, 99),
+              Percentile(result.repetitions, 0),
+              Percentile(result.repetitions, 100));
+    }
+    for (const auto &metric : result.metrics)
+    {
+      fprintf(out, " %s %.6g", metric.first.c_str(), metric.second);
+    }
+    fprintf(out, "\n");
+  }
+}
+
+static void WriteJsonString(FILE *out, const std::string &text)
+{
+  fputc('"', out);
+  for (char character : text)
+  {
+    if (character == '"' || character == '\\')
+    {
+      fputc('\\', out);
+    }
+    fputc(character, out);
+  }
+  fputc('"', out);
+}
+
+bool KJCBenchHarness::WriteJson(const char *path) const
+{
+  FILE *out = fopen(path, "w");
+  if (out == nullptr)
+  {
+    fprintf(stderr, "Can't open %s for writing. (%d)\n", path, errno);
+    return false;
+  }
+  char host[256] = "unknown";
+  gethostname(host, sizeof(host) - 1);
+  fprintf(out, "{\n  \"host\": ");
+  WriteJsonString(out, host);
+  fprintf(out, ",\n  \"compiler\": ");
+  WriteJsonString(out, __VERSION__);
+  fprintf(out, ",\n  \"cpus\": %u,\n  \"timestamp\": %lld,\n", std::thread::hardware_concurrency(),
+          (long long) time(nullptr));
+  fprintf(out, "  \"warmup\": %zu,\n  \"repetitions\": %zu,\n  \"benchmarks\": [", warmup,
+          repetitions);
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const Result &result = results[i];
+    fprintf(out, "%s\n    { \"name\": ", i == 0 ? "" : ",");
+    WriteJsonString(out, result.name);
+    if (!result.repetitions.empty())
+    {
+      double total = 0;
+      for (double value : result.repetitions)
+      {
+        total += value;
+      }
+      fprintf(out,
+              ", \"unit\": \"ns/op\", \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+              "\"p99\": %.3f, \"min\": %.3f, \"max\": %.3f",
+              total / double(result.repetitions.size()),
+              Percentile(result.repetitions, 50),
+              Percentile(result.repetitions, 90),
+              Percentile(result.repetitions, 99),
+              Percentile(result.repetitions, 0),
+              Percentile(result.repetitions, 100));
+    }
+    if (!result.metrics.empty())
+    {
+      fprintf(out, ", \"metrics\": {");
+      for (size_t j = 0; j < result.metrics.size(); ++j)
+      {
+        fprintf(out, "%s", j == 0 ? " " : ", ");
+        WriteJsonString(out, result.metrics[j].first);
+        fprintf(out, ": %.6g", result.metrics[j].second);
+      }
+      fprintf(out, " }");
+    }
+    fprintf(out, " }");
+  }
+  fprintf(out, "\n  ]\n}\n");
+  fclose(out);
+  return true;
+}
+
+class KJCSensorBench
+{
+public:
+  int Main(int argc, char **argv);
+
+private:
+  /***** Micro benchmarks ******/
+  void CommandParsing();
+  /* The to_chars encoder against the snprintf code it replaced, and binary records */
+  void SampleFormatting();
+  /* Value() per sample vs. the block generator, for the default device and 64
+     channels; also checks they agree within 1 LSB */
+  void Waveform();
+  /* Cost of recording one latency in a histogram */
+  void HistogramRecording();
+  /* Min/max/sum reductions over a window, and whole WINDOW= aggregates per
+     sample they stand for, with the bytes they save */
+  void Aggregation();
+  /* FORMAT=FRAME encoding and decoding per sample, for the default device's
+     waveform, the same with noise and plain white noise, with the bytes per
+     sample against BIN and ASCII; also checks the round trip and the gap count */
+  void Framing();
+
+  /***** Scenarios ******/
+  /* Sustained packets/sec of the scheduler as the number of concurrent sessions grows */
+  void SessionScaling();
+  /* Wakeup lateness and CPU cost of each pacing mode for one 1 ms stream */
+  void PacingModes();
+  /* Achieved samples/sec of one fast stream with and without BATCH */
+  void BatchedSend();
+  /* ASCII vs. binary samples: loopback bytes/sec and sender CPU per sample */
+  void WireFormats();
+  /* A real server on a local port driven by an in-process client */
+  void Loopback();
+  /* ID polls/sec a real server answers, as from a monitoring system */
+  void CommandRate();
+  /* Time from sending STOP to receiving RESULT=STOPPED while other sessions stream */
+  void StopLatency();
+  /* Samples/sec as SO_REUSEPORT workers are added, many peers streaming at once */
+  void WorkerScaling();
+  /* Sender CPU per sample replaying a memory mapped trace vs. generating the same channels */
+  void TraceReplay();
+  /* Pacer lateness of one 10 kHz stream with and without the recorder */
+  void RecorderOverhead();
+  /* Send lateness of costly 64 channel ASCII streams, encoded inline vs. ahead
+     through --pipeline rings of a few depths, with the ring counters */
+  void Pipeline();
+  /* Pacer lateness of one 1 ms stream as an ordinary task and under the
+     --rt profile (SCHED_FIFO, stack prefaulted; memory isn't locked here) */
+  void RealTimeProfile();
+  /* Send time of one 100 us stream with and without --tx-timestamps, and
+     with them, how long after its deadline each sample left the stack */
+  void TxTimestamps();
+  /* A 100 us FORMAT=FRAME stream losing one frame in 20 at the client,
+     without and with a RESEND for each; how many come back and how soon, and
+     the lateness of the scheduled samples meanwhile */
+  void Resend();
+  /* Server CPU and samples encoded for N clients of one 1 ms stream, each
+     with a session of its own vs. subscribed to --publish=local */
+  void Publish();
+  /* A 100 us FORMAT=FRAME stream whose loop stalls for 20 ms every 100 ms,
+     under each OVERRUN policy; what reaches the client right after a stall,
+     and the policy's counters */
+  void Overrun();
+  /* --generate into a file on the unlimited virtual clock: 10 minutes of a
+     1 ms stream per format, how much faster than real time, and whether
+     every TIME is the slot's */
+  void Generate();
+  /* A 100 us FORMAT=FRAME stream alone, then with another client asking for
+     RANGEs of a million samples back to back, per format; the ranges'
+     samples/s and how many arrived, and the stream's lateness meanwhile */
+  void Range();
+
+  /* Socket bound to an ephemeral loopback port, with its address */
+  int LocalSocket(struct sockaddr_storage &address, socklen_t &address_len,
+                  const char *name = "127.0.0.1");
+
+  KJCBenchHarness harness;
+  clk::duration measure_time { std::chrono::seconds { 2 } };
+};
+
+static double ThreadCpuSeconds(std::thread &thread)
+{
+  clockid_t clock;
+  struct timespec cpu;
+  pthread_getcpuclockid(thread.native_handle(), &clock);
+  clock_gettime(clock, &cpu);
+  return double(cpu.tv_sec) + double(cpu.tv_nsec) / 1e9;
+}
+
+static double ClockSeconds(clockid_t clock)
+{
+  struct timespec cpu;
+  clock_gettime(clock, &cpu);
+  return double(cpu.tv_sec) + double(cpu.tv_nsec) / 1e9;
+}
+
+int KJCSensorBench::LocalSocket(struct sockaddr_storage &address,
+                                socklen_t &address_len, const char *name)
+{
+  int socket_bound;
+  KJCSensorServer setup { };
+  setup.SetupSocket(&socket_bound, name, "0");
+  address_len = sizeof(address);
+  getsockname(socket_bound, (struct sockaddr*) &address, &address_len);
+  return socket_bound;
+}
+
+void KJCSensorBench::CommandParsing()
+{
+  constexpr size_t operations = 100000;
+  static const std::pair<const char*, std::string_view> commands[] = {
+      { "parse/start", "TEST;CMD=START;DURATION=3600;RATE=0.5;" },
+      { "parse/start_options", "TEST;CMD=START;DURATION=3600;RATE=0.5;BATCH=100;FORMAT=BIN;" },
+      { "parse/stop", "TEST;CMD=STOP;" },
+      { "parse/id", "ID;" },
+      { "parse/unknown", "TEST;CMD=RESTART;" } };
+
+  for (const auto &[name, command] : commands)
+  {
+    harness.Measure(name, operations, [&]
+    {
+      size_t recognised = 0;
+      for (size_t i = 0; i < operations; ++i)
+      {
+        /* Keeps the compiler from hoisting the parse out of the loop */
+        std::string_view message = command;
+        asm volatile("" : "+r" (message));
+        recognised += KJCCommandParser::Parse(message.data(), message.size()).index() != 0;
+      }
+      return recognised;
+    });
+  }
+
+  /* What the control port sees from monitoring: mostly ID polls */
+  harness.Measure("parse/mixed", operations, [&]
+  {
+    size_t recognised = 0;
+    for (size_t i = 0; i < operations; ++i)
+    {
+      std::string_view message = commands[i % 8 == 0 ? i / 8 % 3 : 3].second;
+      asm volatile("" : "+r" (message));
+      recognised += KJCCommandParser::Parse(message.data(), message.size()).index() != 0;
+    }
+    return recognised;
+  });
+}
+
+void KJCSensorBench::SampleFormatting()
+{
+  constexpr size_t operations = 100000;
+  KJCSensorServer server { };
+  KJCChannelSelection both = KJCChannelSelection::FromMask(server.model.AllChannels());
+  clk::time_point start = clk::now();
+  char legacy_buffer[1024];
+  alignas(64) char buffer[KJCMessageBuffer::capacity];
+
+  if (harness.Selected("format/"))
+  {
+    /* The encoder must produce exactly the bytes the old code did */
+    size_t mismatches = 0;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+      int32_t values[2] { int32_t(i * 7919) - 400000, -int32_t(i) };
+      clk::time_point current = start + std::chrono::microseconds { 997 * i };
+      size_t legacy_size = LegacyFormatSensorValue(legacy_buffer,
+                                                   sizeof(legacy_buffer),
+                                                   { values[0], values[1] },
+                                                   current, start);
+      KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+      server.FormatSensorValue(encoder, server.model.labels, both, values, 1, current,
+                               start);
+      mismatches += legacy_size != encoder.Size()
+          || memcmp(legacy_buffer, buffer, legacy_size) != 0;
+    }
+    harness.Metric("format/ascii", "mismatches_vs_snprintf", double(mismatches));
+  }
+
+  harness.Measure("format/ascii_snprintf", operations, [&]
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < operations; ++i)
+    {
+      std::pair<int32_t, int32_t> value { int32_t(i), -int32_t(i) };
+      clk::time_point current = start + std::chrono::microseconds { 997 * i };
+      bytes += LegacyFormatSensorValue(legacy_buffer, sizeof(legacy_buffer),
+                                       value, current, start);
+    }
+    return bytes;
+  });
+  harness.Measure("format/ascii", operations, [&]
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < operations; ++i)
+    {
+      int32_t values[2] { int32_t(i), -int32_t(i) };
+      clk::time_point current = start + std::chrono::microseconds { 997 * i };
+      KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+      server.FormatSensorValue(encoder, server.model.labels, both, values, 1, current,
+                               start);
+      bytes += encoder.Size();
+    }
+    return bytes;
+  });
+  harness.Measure("format/binary", operations, [&]
+  {
+    size_t bytes = 0;
+    for (size_t i = 0; i < operations; ++i)
+    {
+      int32_t values[2] { int32_t(i), -int32_t(i) };
+      clk::time_point current = start + std::chrono::microseconds { 997 * i };
+      KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+      server.FormatSensorValueBinary(encoder, both, values, 1, current, start);
+      bytes += encoder.Size();
+    }
+    return bytes;
+  });
+
+  /* A 64 channel device; values are read a row per channel, as batches hold them */
+  constexpr size_t wide_operations = 10000;
+  KJCServerOptions wide_options { };
+  wide_options.model = KJCSensorModel::Uniform(KJCSensorModel::max_channels);
+  KJCSensorServer wide_server { wide_options };
+  KJCChannelSelection all = KJCChannelSelection::FromMask(wide_server.model.AllChannels());
+  std::vector<int32_t> rows(KJCSensorModel::max_channels * KJCSendBatch::max_messages);
+  for (size_t i = 0; i < rows.size(); ++i)
+  {
+    rows[i] = int32_t(i * 7919 % 2001) - 1000;
+  }
+  for (auto [name, format] : { std::pair { "format/ascii_channels=64", KJCWireFormat::Ascii },
+      std::pair { "format/binary_channels=64", KJCWireFormat::Binary } })
+  {
+    harness.Measure(name, wide_operations, [&]
+    {
+      size_t bytes = 0;
+      for (size_t i = 0; i < wide_operations; ++i)
+      {
+        const int32_t *values = &rows[i % KJCSendBatch::max_messages];
+        clk::time_point current = start + std::chrono::microseconds { 997 * i };
+        KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+        if (format == KJCWireFormat::Binary)
+        {
+          wide_server.FormatSensorValueBinary(encoder, all, values,
+                                              KJCSendBatch::max_messages, current,
+                                              start);
+        }
+        else
+        {
+          wide_server.FormatSensorValue(encoder, wide_server.model.labels, all, values,
+                                        KJCSendBatch::max_messages, current, start);
+        }
+        bytes += encoder.Size();
+      }
+      return bytes;
+    });
+  }
+}
+
+/* Largest difference between the generator and KJCSensorModel::Value() over
+   sample_count samples step apart, for every channel of the model */
+static int64_t GeneratorDifference(const KJCSensorModel &model,
+                                   clk::duration step, size_t sample_count)
+{
+  KJCChannelSelection all = KJCChannelSelection::FromMask(model.AllChannels());
+  KJCSensorBlockGenerator generator;
+  generator.Configure(model, all, step);
+  std::vector<int32_t> values(all.count * sample_count);
+  generator.Generate(clk::duration { 0 }, sample_count, values.data(),
+                     sample_count);
+  int64_t max_difference = 0;
+  for (size_t i = 0; i < sample_count; ++i)
+  {
+    double time_seconds = std::chrono::duration<double, std::ratio<1,1>> { step
+        * i }.count();
+    for (size_t k = 0; k < all.count; ++k)
+    {
+      max_difference = std::max<int64_t>(max_difference, std::abs(
+          int64_t(values[k * sample_count + i]) - model.Value(k, time_seconds)));
+    }
+  }
+  return max_difference;
+}
+
+void KJCSensorBench::Waveform()
+{
+  constexpr size_t operations = 65536;
+  constexpr auto step = std::chrono::milliseconds { 1 };
+  KJCSensorModel model { };
+  KJCChannelSelection both = KJCChannelSelection::FromMask(model.AllChannels());
+  std::vector<int32_t> values(both.count * operations);
+  KJCSensorBlockGenerator generator;
+  generator.Configure(model, both, step);
+
+  harness.Measure("waveform/sensor_value", operations, [&]
+  {
+    int64_t total = 0;
+    for (size_t i = 0; i < operations; ++i)
+    {
+      double time_seconds = std::chrono::duration<double, std::ratio<1,1>> { step
+          * i }.count();
+      total += model.Value(0, time_seconds) + model.Value(1, time_seconds);
+    }
+    return total;
+  });
+  for (size_t call_size : { size_t(64), size_t(4096) })
+  {
+    harness.Measure("waveform/block_" + std::to_string(call_size), operations, [&]
+    {
+      for (size_t first = 0; first < operations; first += call_size)
+      {
+        generator.Generate(step * first, call_size, &values[first], operations);
+      }
+      return values[operations - 1];
+    });
+  }
+
+  /* 64 channels, all sharing one frequency like a real rig's inputs; per sample */
+  constexpr size_t wide_operations = 4096;
+  KJCSensorModel wide = KJCSensorModel::Uniform(KJCSensorModel::max_channels);
+  KJCChannelSelection all = KJCChannelSelection::FromMask(wide.AllChannels());
+  std::vector<int32_t> wide_values(all.count * wide_operations);
+  KJCSensorBlockGenerator wide_generator;
+  wide_generator.Configure(wide, all, step);
+  harness.Measure("waveform/channels=64_value", wide_operations, [&]
+  {
+    int64_t total = 0;
+    for (size_t i = 0; i < wide_operations; ++i)
+    {
+      double time_seconds = std::chrono::duration<double, std::ratio<1,1>> { step
+          * i }.count();
+      for (size_t channel = 0; channel < all.count; ++channel)
+      {
+        total += wide.Value(channel, time_seconds);
+      }
+    }
+    return total;
+  });
+  harness.Measure("waveform/channels=64_block_64", wide_operations, [&]
+  {
+    for (size_t first = 0; first < wide_operations; first += 64)
+    {
+      wide_generator.Generate(step * first, 64, &wide_values[first],
+                              wide_operations);
+    }
+    return wide_values[wide_operations - 1];
+  });
+
+  if (harness.Selected("waveform/"))
+  {
+    /* One hour at 1 ms, so late samples with large phase arguments are covered */
+    harness.Metric("waveform/block_4096", "max_difference_lsb",
+                   double(GeneratorDifference(model, step, 3600000)));
+    /* Every waveform, assorted frequencies, phases and amplitudes */
+    KJCSensorModel mixed = KJCSensorModel::Uniform(KJCSensorModel::max_channels);
+    static const char *const specifications[] = { "1,square,1,0,500",
+        "2,triangle,2.5,30,1000", "3,sawtooth,0.7,90,100000", "4,sine,13,45,2000000",
+        "5,sine,0.001,10,1000", "6,square,50,180,1", "7,triangle,0,0,7" };
+    for (const char *specification : specifications)
+    {
+      mixed.ConfigureChannel(specification);
+    }
+    harness.Metric("waveform/channels=64_block_64", "max_difference_lsb",
+                   double(GeneratorDifference(mixed, step, 100000)));
+  }
+}
+
+/* Every session streams to its own address in 127.0.0.0/8; a single sink socket
+   bound to the wildcard address on one port receives for all of them. */
+void KJCSensorBench::HistogramRecording()
+{
+  constexpr size_t operations = 100000;
+  KJCLatencyHistogram histogram;
+  /* Spread over the buckets like real lateness, from tens of ns to ms */
+  std::vector<clk::duration> latencies(1024);
+  uint64_t state = 1;
+  for (clk::duration &latency : latencies)
+  {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    latency = std::chrono::nanoseconds { (state >> 33) >> (state >> 59) };
+  }
+  harness.Measure("stats/histogram_record", operations, [&]
+  {
+    for (size_t i = 0; i < operations; ++i)
+    {
+      histogram.Record(latencies[i % latencies.size()]);
+    }
+    /* The buckets are never read, so make them look used */
+    asm volatile("" : : "g"(&histogram) : "memory");
+    return histogram.count;
+  });
+}
+
+void KJCSensorBench::Aggregation()
+{
+  constexpr size_t channel_count = 8;
+  constexpr size_t window = 1000;
+  constexpr auto step = std::chrono::microseconds { 100 };
+  KJCServerOptions options { };
+  options.model = KJCSensorModel::Uniform(channel_count);
+  KJCSensorServer server { options };
+  KJCWindowAggregate &aggregate = server.window_aggregate;
+  for (size_t k = 0; k < channel_count; ++k)
+  {
+    for (size_t i = 0; i < KJCWindowAggregate::chunk; ++i)
+    {
+      aggregate.rows[k][i] = int32_t((i * 7919 + k * 104729) % 2000001) - 1000000;
+    }
+  }
+  harness.Measure("aggregate/reduce_channels=8",
+                  channel_count * KJCWindowAggregate::chunk, [&]
+  {
+    aggregate.Reset(channel_count);
+    aggregate.Add(channel_count, KJCWindowAggregate::chunk);
+    return aggregate.sum[channel_count - 1];
+  });
+
+  KJCSession session;
+  session.start_timepoint = clk::now();
+  session.rate = step;
+  session.window = window;
+  session.labels = &server.model.labels;
+  session.channels = KJCChannelSelection::FromMask(server.model.AllChannels());
+  session.generator.Configure(server.model, session.channels, step);
+  alignas(64) char buffer[KJCMessageBuffer::capacity];
+  for (KJCWireFormat format : { KJCWireFormat::Ascii, KJCWireFormat::Binary })
+  {
+    session.format = format;
+    std::string name = std::string { "aggregate/window=1000_channels=8_" }
+        + (format == KJCWireFormat::Binary ? "bin" : "ascii");
+    size_t windows = 16;
+    size_t size = 0;
+    harness.Measure(name, windows * window, [&]
+    {
+      clk::time_point deadline = session.start_timepoint + (window - 1) * step;
+      for (size_t i = 0; i < windows; ++i)
+      {
+        KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+        server.FormatAggregate(encoder, session, deadline);
+        size = encoder.Size();
+        deadline += window * step;
+      }
+      return size;
+    });
+    if (harness.Selected(name))
+    {
+      /* What the window's samples would have taken one by one */
+      int32_t values[channel_count] { };
+      KJCMessageEncoder encoder { buffer, sizeof(buffer) };
+      if (format == KJCWireFormat::Binary)
+      {
+        server.FormatSensorValueBinary(encoder, session.channels, values, 1,
+                                       session.start_timepoint, session.start_timepoint);
+      }
+      else
+      {
+        server.FormatSensorValue(encoder, server.model.labels, session.channels, values, 1,
+                                 session.start_timepoint, session.start_timepoint);
+      }
+      harness.Metric(name, "aggregate_bytes", double(size));
+      harness.Metric(name, "sample_bytes_per_window", double(encoder.Size() * window));
+    }
+  }
+}
+
+void KJCSensorBench::Framing()
+{
+  constexpr size_t frame_count = 64;
+  constexpr size_t samples_per_frame = KJCSendBatch::max_messages;
+  constexpr size_t samples = frame_count * samples_per_frame;
+  constexpr auto step = std::chrono::milliseconds { 1 };
+  KJCSensorServer server { };
+  KJCSession session;
+  session.start_timepoint = clk::now();
+  session.rate = step;
+  session.format = KJCWireFormat::Frame;
+  session.labels = &server.model.labels;
+  session.channels = KJCChannelSelection::FromMask(server.model.AllChannels());
+  session.generator.Configure(server.model, session.channels, step);
+  size_t channels = session.channels.count;
+  static_assert(frame_header_size + samples_per_frame * FrameSampleSizeBound(2)
+                    <= max_frame_size);
+
+  /* A frame's values a row per channel, as SendBatchedSamples() has them */
+  std::vector<int32_t> waveform(samples * channels);
+  for (size_t f = 0; f < frame_count; ++f)
+  {
+    session.generator.Generate(int64_t(f * samples_per_frame) * step,
+                               samples_per_frame,
+                               &waveform[f * channels * samples_per_frame],
+                               samples_per_frame);
+  }
+  /* A few percent of full scale of white noise on top, as from a real front end */
+  std::vector<int32_t> noisy = waveform;
+  std::mt19937 random { 1 };
+  std::uniform_int_distribution<int32_t> noise { -50, 50 };
+  for (int32_t &value : noisy)
+  {
+    value += noise(random);
+  }
+  /* The worst case for deltas: white noise over the whole range */
+  std::vector<int32_t> white(samples * channels);
+  std::uniform_int_distribution<int32_t> full_scale { -1000, 1000 };
+  for (int32_t &value : white)
+  {
+    value = full_scale(random);
+  }
+
+  alignas(64) char buffer[KJCMessageBuffer::capacity];
+  for (auto [data_name, values] : { std::pair { "waveform", &waveform },
+      std::pair { "noisy", &noisy }, std::pair { "white_noise", &white } })
+  {
+    std::string encode_name = std::string { "frame/encode_" } + data_name;
+    std::string decode_name = std::string { "frame/decode_" } + data_name;
+    if (!harness.Selected(encode_name) && !harness.Selected(decode_name))
+    {
+      continue;
+    }
+    auto encode_frame = [&](size_t f)
+    {
+      session.samples_sent = f * samples_per_frame;
+      KJCMessageEncoder encoder { buffer, max_frame_size };
+      KJCSensorServer::FormatFrame(encoder, session,
+                                   &(*values)[f * channels * samples_per_frame],
+                                   samples_per_frame, samples_per_frame,
+                                   session.start_timepoint
+                                       + int64_t(f * samples_per_frame) * step);
+      return encoder;
+    };
+    harness.Measure(encode_name, samples, [&]
+    {
+      size_t bytes = 0;
+      for (size_t f = 0; f < frame_count; ++f)
+      {
+        bytes += encode_frame(f).Size();
+      }
+      return bytes;
+    });
+    /* Kept for decoding */
+    std::vector<std::string> frames(frame_count);
+    size_t frame_bytes = 0;
+    for (size_t f = 0; f < frame_count; ++f)
+    {
+      KJCMessageEncoder encoder = encode_frame(f);
+      frames[f].assign(encoder.Data(), encoder.Size());
+      frame_bytes += encoder.Size();
+    }
+
+    KJCFrameDecoder decoder;
+    harness.Measure(decode_name, samples, [&]
+    {
+      int64_t sum = 0;
+      for (const std::string &frame : frames)
+      {
+        decoder.Decode(frame.data(), frame.size());
+        sum += decoder.values[decoder.count - 1][channels - 1];
+      }
+      return sum;
+    });
+    if (!harness.Selected(encode_name))
+    {
+      continue;
+    }
+
+    /* Every value back as it was, and with every third frame lost, exactly
+       the samples in those frames missing */
+    size_t mismatches = 0;
+    KJCFrameDecoder lossy;
+    size_t dropped = 0;
+    for (size_t f = 0; f < frame_count; ++f)
+    {
+      if (f % 3 == 1)
+      {
+        dropped += samples_per_frame;
+        continue;
+      }
+      bool whole = lossy.Decode(frames[f].data(), frames[f].size());
+      mismatches += !whole || lossy.count != samples_per_frame;
+      for (size_t i = 0; whole && i < lossy.count; ++i)
+      {
+        for (size_t k = 0; k < channels; ++k)
+        {
+          mismatches += lossy.values[i][k]
+              != (*values)[f * channels * samples_per_frame + k * samples_per_frame + i];
+        }
+        /* TIME is in ms, a sample every ms */
+        mismatches += lossy.times[i] != f * samples_per_frame + i;
+      }
+    }
+    harness.Metric(encode_name, "round_trip_mismatches", double(mismatches));
+    harness.Metric(encode_name, "gap_count_error", double(lossy.missing) - double(dropped));
+
+    /* The same samples one per datagram */
+    size_t binary_bytes = 0;
+    size_t ascii_bytes = 0;
+    for (size_t j = 0; j < samples; ++j)
+    {
+      size_t f = j / samples_per_frame;
+      size_t i = j % samples_per_frame;
+      const int32_t *sample = &(*values)[f * channels * samples_per_frame + i];
+      clk::time_point current = session.start_timepoint + int64_t(j) * step;
+      KJCMessageEncoder binary { buffer, sizeof(buffer) };
+      server.FormatSensorValueBinary(binary, session.channels, sample, samples_per_frame,
+                                     current, session.start_timepoint);
+      binary_bytes += binary.Size();
+      KJCMessageEncoder ascii { buffer, sizeof(buffer) };
+      server.FormatSensorValue(ascii, server.model.labels, session.channels, sample,
+                               samples_per_frame, current, session.start_timepoint);
+      ascii_bytes += ascii.Size();
+    }
+    harness.Metric(encode_name, "frame_bytes_per_sample", double(frame_bytes) / samples);
+    harness.Metric(encode_name, "bin_bytes_per_sample", double(binary_bytes) / samples);
+    harness.Metric(encode_name, "ascii_bytes_per_sample", double(ascii_bytes) / samples);
+    harness.Metric(encode_name, "ratio_vs_bin", double(binary_bytes) / frame_bytes);
+    harness.Metric(encode_name, "ratio_vs_ascii", double(ascii_bytes) / frame_bytes);
+  }
+}
+
+void KJCSensorBench::SessionScaling()
+{
+  constexpr size_t session_counts[] = { 1, 10, 100, 1000, 10000 };
+  constexpr auto session_rate = std::chrono::milliseconds { 1 };
+  if (!harness.Selected("session_scaling/"))
+  {
+    return;
+  }
+
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len, nullptr);
+
+  for (size_t session_count : session_counts)
+  {
+    KJCSensorServer server { };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+
+    for (size_t i = 0; i < session_count; ++i)
+    {
+      struct sockaddr_storage peer_address;
+      memset(&peer_address, 0, sizeof(peer_address));
+      struct sockaddr_in *peer = (struct sockaddr_in*) &peer_address;
+      peer->sin_family = AF_INET;
+      peer->sin_port = ((struct sockaddr_in*) &sink_address)->sin_port;
+      peer->sin_addr.s_addr = htonl(
+          (127u << 24) | ((i / 250) << 8) | ((i % 250) + 1));
+      server.StartSession(socket_send, peer_address, sizeof(sockaddr_in),
+                          std::chrono::hours { 1 }, session_rate);
+    }
+
+    uint64_t samples_before = server.total_samples_sent;
+    clk::time_point begin = clk::now();
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    uint64_t samples = server.total_samples_sent - samples_before;
+    double offered = double(session_count)
+        / std::chrono::duration<double> { session_rate }.count();
+    std::string name = "session_scaling/sessions=" + std::to_string(session_count);
+    harness.Metric(name, "offered_pps", offered);
+    harness.Metric(name, "achieved_pps", double(samples) / elapsed);
+    harness.Metric(name, "mean_lateness_us", samples == 0 ? 0.0 :
+        std::chrono::duration<double, std::micro> { server.total_lateness }.count()
+            / double(samples));
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::PacingModes()
+{
+  if (!harness.Selected("pacing/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+
+  for (KJCPacingMode mode : { KJCPacingMode::Hybrid, KJCPacingMode::Nanosleep,
+      KJCPacingMode::Timerfd })
+  {
+    KJCServerOptions options { };
+    options.pacing_mode = mode;
+    KJCSensorServer server { options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, std::chrono::milliseconds { 1 });
+    clk::time_point begin = clk::now();
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    double cpu_seconds = ThreadCpuSeconds(serving);
+    server.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    const KJCLatencyHistogram &lateness = server.pacer.lateness;
+    std::string name = std::string { "pacing/" } + KJCPacer::ModeName(mode);
+    harness.Metric(name, "lateness_mean_us", lateness.MeanNanoseconds() / 1e3);
+    harness.Metric(name, "lateness_p50_us",
+                   double(lateness.PercentileNanoseconds(50)) / 1e3);
+    harness.Metric(name, "lateness_p99_us",
+                   double(lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "lateness_max_us", double(lateness.max_nanoseconds) / 1e3);
+    harness.Metric(name, "cpu_percent", 100.0 * cpu_seconds / elapsed);
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::BatchedSend()
+{
+  constexpr auto rate = std::chrono::microseconds { 2 };
+  if (!harness.Selected("batched_send/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+
+  for (int batch_microseconds : { 0, 100, 1000 })
+  {
+    KJCSensorServer server { };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    KJCStartOptions options { };
+    options.batch_window = std::chrono::microseconds { batch_microseconds };
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, rate, options);
+    clk::time_point begin = clk::now();
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    const KJCSession &session = server.sessions.begin()->second;
+    std::string name = "batched_send/batch_us=" + std::to_string(batch_microseconds);
+    harness.Metric(name, "offered_sps", 1.0 / std::chrono::duration<double> { rate }.count());
+    harness.Metric(name, "achieved_sps", double(session.samples_sent) / elapsed);
+    harness.Metric(name, "samples_per_send",
+                   double(session.samples_sent) / double(session.sends));
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::WireFormats()
+{
+  constexpr auto rate = std::chrono::microseconds { 2 };
+  if (!harness.Selected("wire_format/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+  int receive_buffer = 8 << 20;
+  setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+  struct timeval receive_timeout = { 0, 100000 };
+  setsockopt(sink, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+  for (KJCWireFormat format : { KJCWireFormat::Ascii, KJCWireFormat::Binary })
+  {
+    /* Spinning would dominate the CPU figure, so pace in the kernel */
+    KJCServerOptions server_options { };
+    server_options.pacing_mode = KJCPacingMode::Timerfd;
+    KJCSensorServer server { server_options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    KJCStartOptions options { };
+    options.batch_window = std::chrono::microseconds { 1000 };
+    options.format = format;
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, rate, options);
+
+    std::atomic<bool> receiving { true };
+    uint64_t bytes_received = 0;
+    uint64_t messages_received = 0;
+    auto receiver = std::thread([&]
+    {
+      char read[2048];
+      while (receiving)
+      {
+        ssize_t bytes = recv(sink, read, sizeof(read), 0);
+        if (bytes > 0)
+        {
+          bytes_received += bytes;
+          messages_received++;
+        }
+      }
+    });
+    clk::time_point begin = clk::now();
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    double cpu_seconds = ThreadCpuSeconds(serving);
+    server.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+    receiving = false;
+    receiver.join();
+
+    const KJCSession &session = server.sessions.begin()->second;
+    std::string name = std::string { "wire_format/" }
+        + (format == KJCWireFormat::Binary ? "binary" : "ascii");
+    harness.Metric(name, "received_bytes_per_s", double(bytes_received) / elapsed);
+    harness.Metric(name, "received_samples_per_s", double(messages_received) / elapsed);
+    harness.Metric(name, "bytes_per_sample", messages_received == 0 ? 0.0 :
+        double(bytes_received) / double(messages_received));
+    harness.Metric(name, "cpu_ns_per_sample",
+                   1e9 * cpu_seconds / double(session.samples_sent));
+    close(socket_send);
+  }
+  close(sink);
+}
+
+/* START at several rates, over the real command path, with the client in this process */
+void KJCSensorBench::Loopback()
+{
+  if (!harness.Selected("loopback/"))
+  {
+    return;
+  }
+  for (const char *rate : { "10", "1", "0.1" })
+  {
+    struct sockaddr_storage server_address;
+    socklen_t server_len;
+    KJCSensorServer server { };
+    int socket_server = LocalSocket(server_address, server_len);
+    auto serving = std::thread([&server, socket_server]
+                               { server.Serve(socket_server); });
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    int client = LocalSocket(client_address, client_len);
+    int receive_buffer = 4 << 20;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    struct timeval receive_timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+    char start_command[128];
+    int start_length = snprintf(start_command, sizeof(start_command),
+                                "TEST;CMD=START;DURATION=%.3f;RATE=%s;",
+                                std::chrono::duration<double> { measure_time }.count(),
+                                rate);
+    double process_cpu_before = ClockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    double client_cpu_before = ClockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    clk::time_point begin = clk::now();
+    sendto(client, start_command, start_length, 0,
+           (struct sockaddr*) &server_address, server_len);
+
+    std::vector<clk::time_point> arrivals;
+    size_t invalid = 0;
+    char read[2048];
+    while (1)
+    {
+      ssize_t bytes = recv(client, read, sizeof(read), 0);
+      if (bytes < 0)
+      {
+        break;
+      }
+      std::string_view message { read, size_t(bytes) };
+      if (message.starts_with("STATUS;TIME="))
+      {
+        arrivals.push_back(clk::now());
+      }
+      else if (message == "STATUS;STATE=IDLE;")
+      {
+        break;
+      }
+      else if (message != "TEST;RESULT=STARTED;")
+      {
+        invalid++;
+      }
+    }
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+    double client_cpu = ClockSeconds(CLOCK_THREAD_CPUTIME_ID) - client_cpu_before;
+    double server_cpu = ClockSeconds(CLOCK_PROCESS_CPUTIME_ID)
+        - process_cpu_before - client_cpu;
+
+    server.Shutdown();
+    serving.join();
+    close(socket_server);
+    close(client);
+
+    double period_us = atof(rate) * 1e3;
+    std::vector<double> jitter_us;
+    for (size_t i = 1; i < arrivals.size(); ++i)
+    {
+      double interarrival_us = std::chrono::duration<double, std::micro> {
+          arrivals[i] - arrivals[i - 1] }.count();
+      jitter_us.push_back(fabs(interarrival_us - period_us));
+    }
+    double span = arrivals.size() < 2 ? 0.0 :
+        std::chrono::duration<double> { arrivals.back() - arrivals.front() }.count();
+    std::string name = std::string { "loopback/rate_ms=" } + rate;
+    harness.Metric(name, "samples", double(arrivals.size()));
+    harness.Metric(name, "requested_sps", 1e6 / period_us);
+    harness.Metric(name, "achieved_sps", span > 0 ? double(arrivals.size() - 1) / span : 0.0);
+    harness.Metric(name, "jitter_p50_us", KJCBenchHarness::Percentile(jitter_us, 50));
+    harness.Metric(name, "jitter_p99_us", KJCBenchHarness::Percentile(jitter_us, 99));
+    harness.Metric(name, "jitter_max_us", KJCBenchHarness::Percentile(jitter_us, 100));
+    harness.Metric(name, "server_cpu_percent", 100.0 * server_cpu / elapsed);
+    harness.Metric(name, "unexpected_messages", double(invalid));
+  }
+}
+
+void KJCSensorBench::CommandRate()
+{
+  if (!harness.Selected("command_rate/"))
+  {
+    return;
+  }
+  /* Polls kept in flight; enough to keep the server busy, few enough not to
+     overflow socket buffers */
+  for (size_t window : { size_t(1), size_t(16) })
+  {
+    struct sockaddr_storage server_address;
+    socklen_t server_len;
+    KJCSensorServer server { };
+    int socket_server = LocalSocket(server_address, server_len);
+    auto serving = std::thread([&server, socket_server]
+                               { server.Serve(socket_server); });
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    int client = LocalSocket(client_address, client_len);
+    struct timeval receive_timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+    const char id_command[] = "ID;";
+    size_t replies = 0, lost = 0;
+    char read[256];
+    clk::time_point begin = clk::now();
+    clk::time_point end = begin + measure_time;
+    for (size_t i = 0; i < window; ++i)
+    {
+      sendto(client, id_command, sizeof(id_command) - 1, 0,
+             (struct sockaddr*) &server_address, server_len);
+    }
+    while (clk::now() < end)
+    {
+      if (recv(client, read, sizeof(read), 0) < 0)
+      {
+        lost++;
+      }
+      else
+      {
+        replies++;
+      }
+      sendto(client, id_command, sizeof(id_command) - 1, 0,
+             (struct sockaddr*) &server_address, server_len);
+    }
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    server.Shutdown();
+    serving.join();
+    close(socket_server);
+    close(client);
+
+    std::string name = "command_rate/id_window=" + std::to_string(window);
+    harness.Metric(name, "commands_per_s", double(replies) / elapsed);
+    harness.Metric(name, "lost", double(lost));
+  }
+}
+
+void KJCSensorBench::StopLatency()
+{
+  constexpr size_t load_counts[] = { 0, 100, 1000 };
+  constexpr auto load_rate = std::chrono::milliseconds { 1 };
+  if (!harness.Selected("stop_latency/"))
+  {
+    return;
+  }
+
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len, nullptr);
+
+  for (size_t load_count : load_counts)
+  {
+    struct sockaddr_storage server_address;
+    socklen_t server_len;
+    KJCSensorServer server { };
+    int socket_server = LocalSocket(server_address, server_len);
+    /* Background sessions to other peers, started before the server runs */
+    for (size_t i = 0; i < load_count; ++i)
+    {
+      struct sockaddr_storage peer_address;
+      memset(&peer_address, 0, sizeof(peer_address));
+      struct sockaddr_in *peer = (struct sockaddr_in*) &peer_address;
+      peer->sin_family = AF_INET;
+      peer->sin_port = ((struct sockaddr_in*) &sink_address)->sin_port;
+      peer->sin_addr.s_addr = htonl(
+          (127u << 24) | ((i / 250) << 8) | ((i % 250) + 1));
+      server.StartSession(socket_server, peer_address, sizeof(sockaddr_in),
+                          std::chrono::hours { 1 }, load_rate);
+    }
+    auto serving = std::thread([&server, socket_server]
+                               { server.Serve(socket_server); });
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    int client = LocalSocket(client_address, client_len);
+    struct timeval receive_timeout = { 1, 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+    const char start_command[] = "TEST;CMD=START;DURATION=60;RATE=1;";
+    const char stop_command[] = "TEST;CMD=STOP;";
+    std::vector<double> latency_us;
+    size_t lost = 0;
+    char read[2048];
+    clk::time_point end = clk::now() + measure_time;
+    while (clk::now() < end)
+    {
+      sendto(client, start_command, sizeof(start_command) - 1, 0,
+             (struct sockaddr*) &server_address, server_len);
+      /* Let a few samples through so the STOP lands mid-stream, and drop
+         them so only the replies to STOP are left to read */
+      std::this_thread::sleep_for(std::chrono::milliseconds { 5 });
+      while (recv(client, read, sizeof(read), MSG_DONTWAIT) >= 0)
+      {
+      }
+      clk::time_point sent = clk::now();
+      sendto(client, stop_command, sizeof(stop_command) - 1, 0,
+             (struct sockaddr*) &server_address, server_len);
+      bool stopped = false;
+      while (1)
+      {
+        ssize_t bytes = recv(client, read, sizeof(read), 0);
+        if (bytes < 0)
+        {
+          break;
+        }
+        std::string_view message { read, size_t(bytes) };
+        if (message == "TEST;RESULT=STOPPED;")
+        {
+          latency_us.push_back(std::chrono::duration<double, std::micro> {
+              clk::now() - sent }.count());
+          stopped = true;
+        }
+        else if (message == "STATUS;STATE=IDLE;")
+        {
+          break;
+        }
+      }
+      lost += !stopped;
+    }
+
+    server.Shutdown();
+    serving.join();
+    close(socket_server);
+    close(client);
+
+    std::string name = "stop_latency/load_sessions=" + std::to_string(load_count);
+    harness.Metric(name, "stops", double(latency_us.size()));
+    harness.Metric(name, "latency_p50_us", KJCBenchHarness::Percentile(latency_us, 50));
+    harness.Metric(name, "latency_p99_us", KJCBenchHarness::Percentile(latency_us, 99));
+    harness.Metric(name, "latency_max_us", KJCBenchHarness::Percentile(latency_us, 100));
+    harness.Metric(name, "lost", double(lost));
+  }
+  close(sink);
+}
+
+void KJCSensorBench::WorkerScaling()
+{
+  constexpr size_t client_count = 256;
+  const char start_command[] = "TEST;CMD=START;DURATION=3600;RATE=0.1;";
+  if (!harness.Selected("worker_scaling/"))
+  {
+    return;
+  }
+
+  /* Powers of two up to the CPUs we may run on, and at least 2 */
+  cpu_set_t allowed;
+  unsigned cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ?
+      CPU_COUNT(&allowed) : 1;
+  std::vector<unsigned> worker_counts;
+  for (unsigned count = 1; count <= std::max(cpus, 2u); count *= 2)
+  {
+    worker_counts.push_back(count);
+  }
+
+  for (unsigned worker_count : worker_counts)
+  {
+    KJCServerOptions options { };
+    options.bind_address = "127.0.0.1";
+    options.port = "0";
+    options.workers = worker_count;
+    KJCWorkerGroup group { options };
+    group.Bind();
+    auto serving = std::thread([&group]
+                               { group.Run(); });
+
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(group.Port());
+    server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* Each client has its own source port, so the kernel spreads them over
+       the workers; nobody reads, the samples are dropped at the client */
+    std::vector<int> clients;
+    int receive_buffer = 4096;
+    clk::time_point start = clk::now();
+    for (size_t i = 0; i < client_count; ++i)
+    {
+      struct sockaddr_storage client_address;
+      socklen_t client_len;
+      int client = LocalSocket(client_address, client_len);
+      setsockopt(client, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+      sendto(client, start_command, sizeof(start_command) - 1, 0,
+             (struct sockaddr*) &server_address, sizeof(server_address));
+      clients.push_back(client);
+    }
+    std::this_thread::sleep_until(start + measure_time);
+    group.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - start }.count();
+
+    uint64_t samples = 0;
+    size_t fewest_sessions = SIZE_MAX;
+    size_t most_sessions = 0;
+    for (std::unique_ptr<KJCSensorServer> &worker : group.workers)
+    {
+      samples += worker->total_samples_sent;
+      fewest_sessions = std::min(fewest_sessions, worker->sessions.size());
+      most_sessions = std::max(most_sessions, worker->sessions.size());
+    }
+    for (int client : clients)
+    {
+      close(client);
+    }
+    for (int socket : group.sockets)
+    {
+      close(socket);
+    }
+
+    std::string name = "worker_scaling/workers=" + std::to_string(worker_count);
+    harness.Metric(name, "offered_pps", double(client_count) * 1e4);
+    harness.Metric(name, "achieved_pps", double(samples) / elapsed);
+    harness.Metric(name, "fewest_sessions_per_worker", double(fewest_sessions));
+    harness.Metric(name, "most_sessions_per_worker", double(most_sessions));
+  }
+}
+
+/* A trace of channel_count channels where sample i, channel c is i * 64 + c */
+static bool WriteTrace(const char *path, size_t channel_count,
+                       clk::duration period, uint64_t sample_count)
+{
+  FILE *out = fopen(path, "wb");
+  if (out == nullptr)
+  {
+    fprintf(stderr, "Can't write %s\n", path);
+    return false;
+  }
+  char header[KJCTrace::header_size];
+  uint64_t period_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+  memcpy(header, "KJCTRACE", 8);
+  for (size_t i = 0; i < 4; ++i)
+  {
+    header[8 + i] = char(KJCTrace::version >> (8 * i));
+    header[12 + i] = char(channel_count >> (8 * i));
+  }
+  for (size_t i = 0; i < 8; ++i)
+  {
+    header[16 + i] = char(period_ns >> (8 * i));
+    header[24 + i] = char(sample_count >> (8 * i));
+  }
+  fwrite(header, sizeof(header), 1, out);
+  for (size_t channel = 0; channel < channel_count; ++channel)
+  {
+    char name[KJCTrace::name_size] { };
+    snprintf(name, sizeof(name), "T%zu", channel);
+    fwrite(name, sizeof(name), 1, out);
+  }
+  std::vector<int32_t> row(channel_count);
+  for (uint64_t sample = 0; sample < sample_count; ++sample)
+  {
+    for (size_t channel = 0; channel < channel_count; ++channel)
+    {
+      row[channel] = int32_t(sample * 64 + channel);
+    }
+    fwrite(row.data(), sizeof(int32_t), channel_count, out);
+  }
+  return fclose(out) == 0;
+}
+
+void KJCSensorBench::TraceReplay()
+{
+  constexpr size_t channel_count = 8;
+  constexpr uint64_t trace_samples = 1 << 20;
+  /* 250k samples/s in all however many sessions share it */
+  constexpr auto total_rate = std::chrono::microseconds { 4 };
+  if (!harness.Selected("trace_replay/"))
+  {
+    return;
+  }
+  char path[] = "/tmp/kjc_bench_trace_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Can't create a trace file. (%d)\n", errno);
+    return;
+  }
+  close(fd);
+  if (!WriteTrace(path, channel_count, total_rate, trace_samples))
+  {
+    unlink(path);
+    return;
+  }
+  std::shared_ptr<const KJCTrace> trace = KJCTrace::Open("bench", path);
+  unlink(path);
+  if (trace == nullptr)
+  {
+    return;
+  }
+
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len, nullptr);
+  for (bool replay : { false, true })
+  {
+    for (size_t session_count : { size_t(1), size_t(16) })
+    {
+      KJCServerOptions server_options { };
+      server_options.pacing_mode = KJCPacingMode::Timerfd;
+      server_options.model = KJCSensorModel::Uniform(channel_count);
+      server_options.traces.push_back(trace);
+      KJCSensorServer server { server_options };
+      int socket_send;
+      server.SetupSocket(&socket_send, "127.0.0.1", "0");
+      KJCStartOptions options { };
+      options.batch_window = std::chrono::microseconds { 1000 };
+      options.format = KJCWireFormat::Binary;
+      options.trace = replay ? "bench" : "";
+      for (size_t i = 0; i < session_count; ++i)
+      {
+        struct sockaddr_storage peer_address = sink_address;
+        ((struct sockaddr_in*) &peer_address)->sin_addr.s_addr = htonl(
+            (127u << 24) | (i + 1));
+        server.StartSession(socket_send, peer_address, sizeof(sockaddr_in),
+                            std::chrono::hours { 1 }, total_rate * session_count,
+                            options);
+      }
+      clk::time_point begin = clk::now();
+      auto serving = std::thread([&server, socket_send]
+                                 { server.Serve(socket_send); });
+      std::this_thread::sleep_for(measure_time);
+      double cpu_seconds = ThreadCpuSeconds(serving);
+      server.Shutdown();
+      serving.join();
+      double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+      std::string name = std::string { "trace_replay/source=" }
+          + (replay ? "trace" : "model") + ",sessions=" + std::to_string(session_count);
+      harness.Metric(name, "offered_sps", 1.0 / std::chrono::duration<double> { total_rate }.count());
+      harness.Metric(name, "achieved_sps", double(server.total_samples_sent) / elapsed);
+      harness.Metric(name, "cpu_ns_per_sample", server.total_samples_sent == 0 ? 0.0 :
+          1e9 * cpu_seconds / double(server.total_samples_sent));
+      close(socket_send);
+    }
+  }
+  close(sink);
+}
+
+void KJCSensorBench::RecorderOverhead()
+{
+  if (!harness.Selected("recorder/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+
+  for (bool record : { false, true })
+  {
+    char path[] = "/tmp/kjc_bench_record_XXXXXX";
+    KJCServerOptions options { };
+    options.pacing_mode = KJCPacingMode::Hybrid;
+    if (record)
+    {
+      int fd = mkstemp(path);
+      if (fd < 0)
+      {
+        fprintf(stderr, "Can't create a recording file. (%d)\n", errno);
+        break;
+      }
+      close(fd);
+      options.recorder = KJCRecorder::Open(path);
+      if (options.recorder == nullptr)
+      {
+        unlink(path);
+        break;
+      }
+    }
+    KJCSensorServer server { options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, std::chrono::microseconds { 100 });
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+
+    const KJCLatencyHistogram &lateness = server.pacer.lateness;
+    std::string name = std::string { "recorder/record=" } + (record ? "on" : "off");
+    harness.Metric(name, "lateness_mean_us", lateness.MeanNanoseconds() / 1e3);
+    harness.Metric(name, "lateness_p50_us",
+                   double(lateness.PercentileNanoseconds(50)) / 1e3);
+    harness.Metric(name, "lateness_p99_us",
+                   double(lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "lateness_max_us", double(lateness.max_nanoseconds) / 1e3);
+    harness.Metric(name, "samples_sent", double(server.total_samples_sent));
+    if (record)
+    {
+      /* Every sample sent must be in the file, or counted as dropped */
+      options.recorder->Close();
+      uint64_t recorded = options.recorder->samples_written;
+      uint64_t dropped = options.recorder->Dropped();
+      harness.Metric(name, "samples_recorded", double(recorded));
+      harness.Metric(name, "samples_dropped", double(dropped));
+      harness.Metric(name, "unaccounted_samples",
+                     double(server.total_samples_sent - recorded - dropped));
+      harness.Metric(name, "file_bytes_per_sample", recorded == 0 ? 0.0 :
+          double(options.recorder->bytes_written) / double(recorded));
+      unlink(path);
+    }
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::Pipeline()
+{
+  constexpr size_t session_count = 16;
+  constexpr auto session_rate = std::chrono::microseconds { 500 };
+  if (!harness.Selected("pipeline/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len, nullptr);
+
+  for (size_t depth : { size_t(0), size_t(16), size_t(256), size_t(4096) })
+  {
+    KJCServerOptions server_options { };
+    server_options.model = KJCSensorModel::Uniform(KJCSensorModel::max_channels);
+    server_options.pipeline_depth = depth;
+    KJCSensorServer server { server_options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    for (size_t i = 0; i < session_count; ++i)
+    {
+      struct sockaddr_storage peer_address = sink_address;
+      ((struct sockaddr_in*) &peer_address)->sin_addr.s_addr = htonl(
+          (127u << 24) | (i + 1));
+      server.StartSession(socket_send, peer_address, sizeof(sockaddr_in),
+                          std::chrono::hours { 1 }, session_rate);
+    }
+    clk::time_point begin = clk::now();
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    uint64_t samples = server.total_samples_sent;
+    std::string name = "pipeline/depth=" + std::to_string(depth);
+    harness.Metric(name, "offered_sps", double(session_count)
+        / std::chrono::duration<double> { session_rate }.count());
+    harness.Metric(name, "achieved_sps", double(samples) / elapsed);
+    harness.Metric(name, "send_lateness_mean_us", samples == 0 ? 0.0 :
+        std::chrono::duration<double, std::micro> { server.total_lateness }.count()
+            / double(samples));
+#if KJC_ENABLE_STATS
+    /* All sessions' lateness in one histogram */
+    KJCLatencyHistogram lateness;
+    for (const auto &[key, session] : server.sessions)
+    {
+      lateness.Add(session.stats.lateness);
+    }
+    harness.Metric(name, "send_lateness_p99_us",
+                   double(lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "send_lateness_max_us", double(lateness.max_nanoseconds) / 1e3);
+#endif
+    if (server.pipeline != nullptr)
+    {
+      harness.Metric(name, "ring_full", double(server.pipeline->ring_full));
+      harness.Metric(name, "ring_empty", double(server.pipeline->ring_empty));
+    }
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::RealTimeProfile()
+{
+  if (!harness.Selected("rt_profile/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+
+  for (bool realtime : { false, true })
+  {
+    KJCServerOptions options { };
+    options.realtime.enabled = realtime;
+    KJCSensorServer server { options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, std::chrono::milliseconds { 1 });
+    /* The profile applies to the thread running the loop, which ends with it */
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+
+    const KJCLatencyHistogram &lateness = server.pacer.run_lateness;
+    std::string name = std::string { "rt_profile/profile=" } + (realtime ? "rt" : "normal");
+    harness.Metric(name, "lateness_mean_us", lateness.MeanNanoseconds() / 1e3);
+    harness.Metric(name, "lateness_p50_us",
+                   double(lateness.PercentileNanoseconds(50)) / 1e3);
+    harness.Metric(name, "lateness_p99_us",
+                   double(lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "lateness_p999_us",
+                   double(lateness.PercentileNanoseconds(99.9)) / 1e3);
+    harness.Metric(name, "lateness_max_us", double(lateness.max_nanoseconds) / 1e3);
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::TxTimestamps()
+{
+  if (!harness.Selected("tx_timestamps/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+
+  for (bool timestamps : { false, true })
+  {
+    KJCServerOptions options { };
+    options.tx_timestamps = timestamps;
+    KJCSensorServer server { options };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, std::chrono::microseconds { 100 });
+    auto serving = std::thread([&server, socket_send]
+                               { server.Serve(socket_send); });
+    std::this_thread::sleep_for(measure_time);
+    server.Shutdown();
+    serving.join();
+
+    std::string name = std::string { "tx_timestamps/timestamps=" }
+        + (timestamps ? "on" : "off");
+    harness.Metric(name, "samples_sent", double(server.total_samples_sent));
+#if KJC_ENABLE_STATS
+    const KJCSessionStats &stats = server.sessions.begin()->second.stats;
+    harness.Metric(name, "send_mean_us", stats.send_time.MeanNanoseconds() / 1e3);
+    harness.Metric(name, "send_p99_us",
+                   double(stats.send_time.PercentileNanoseconds(99)) / 1e3);
+#endif
+    if (server.tx_timestamps != nullptr)
+    {
+      const KJCLatencyHistogram &departure = server.tx_timestamps->departure;
+      harness.Metric(name, "departure_p50_us",
+                     double(departure.PercentileNanoseconds(50)) / 1e3);
+      harness.Metric(name, "departure_p99_us",
+                     double(departure.PercentileNanoseconds(99)) / 1e3);
+      harness.Metric(name, "departure_max_us", double(departure.max_nanoseconds) / 1e3);
+      harness.Metric(name, "timestamps_missing", double(server.total_samples_sent
+          - std::min(server.total_samples_sent, departure.count)));
+    }
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::Resend()
+{
+  if (!harness.Selected("resend/"))
+  {
+    return;
+  }
+  for (bool requests : { false, true })
+  {
+    KJCServerOptions options { };
+    options.resend_buffer = 1 << 20;
+    KJCSensorServer server { options };
+    struct sockaddr_storage server_address;
+    socklen_t server_len;
+    int socket_server = LocalSocket(server_address, server_len);
+    auto serving = std::thread([&server, socket_server]
+                               { server.Serve(socket_server); });
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    int client = LocalSocket(client_address, client_len);
+    int receive_buffer = 4 << 20;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    struct timeval receive_timeout = { 0, 200000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
+    char command[128];
+    int length = snprintf(command, sizeof(command),
+                          "TEST;CMD=START;DURATION=%.3f;RATE=0.1;FORMAT=FRAME;",
+                          std::chrono::duration<double> { measure_time }.count());
+    sendto(client, command, length, 0, (struct sockaddr*) &server_address, server_len);
+
+    /* Sequence of each frame dropped and not back yet, with when it was asked for */
+    std::unordered_map<uint64_t, clk::time_point> lost;
+    KJCLatencyHistogram recovery;
+    KJCFrameDecoder decoder;
+    uint64_t fresh = 0;
+    uint64_t dropped = 0;
+    uint64_t duplicates = 0;
+    char read[2048];
+    bool ended = false;
+    while (1)
+    {
+      ssize_t bytes = recv(client, read, sizeof(read), 0);
+      if (bytes < 0)
+      {
+        /* The stream has ended and the resends have stopped coming */
+        break;
+      }
+      std::string_view message { read, size_t(bytes) };
+      if (message == "STATUS;STATE=IDLE;")
+      {
+        ended = true;
+        continue;
+      }
+      uint64_t expected = decoder.expected;
+      if (!decoder.Decode(read, bytes))
+      {
+        continue;
+      }
+      if (decoder.sequence < expected)
+      {
+        /* Older than the newest frame: one sent again */
+        auto found = lost.find(decoder.sequence);
+        if (found == lost.end())
+        {
+          duplicates++;
+          continue;
+        }
+        recovery.Record(clk::now() - found->second);
+        lost.erase(found);
+        continue;
+      }
+      if (ended || ++fresh % 20 != 0)
+      {
+        continue;
+      }
+      /* Treated as lost on the way */
+      dropped++;
+      lost.emplace(decoder.sequence, clk::now());
+      if (requests)
+      {
+        length = snprintf(command, sizeof(command), "TEST;CMD=RESEND;FROM=%" PRIu64
+                          ";TO=%" PRIu64 ";", decoder.sequence,
+                          decoder.sequence + decoder.count - 1);
+        sendto(client, command, length, 0, (struct sockaddr*) &server_address,
+               server_len);
+      }
+    }
+
+    server.Shutdown();
+    serving.join();
+    close(socket_server);
+    close(client);
+
+    std::string name = std::string { "resend/requests=" } + (requests ? "on" : "off");
+    harness.Metric(name, "frames_dropped", double(dropped));
+    harness.Metric(name, "frames_recovered", double(dropped - lost.size()));
+    harness.Metric(name, "unexpected_frames", double(duplicates));
+    harness.Metric(name, "recovery_p50_us", double(recovery.PercentileNanoseconds(50)) / 1e3);
+    harness.Metric(name, "recovery_p99_us", double(recovery.PercentileNanoseconds(99)) / 1e3);
+#if KJC_ENABLE_STATS
+    const KJCSessionStats &stats = server.sessions.begin()->second.stats;
+    harness.Metric(name, "resend_hits", double(stats.resend_hits));
+    harness.Metric(name, "resend_misses", double(stats.resend_misses));
+    harness.Metric(name, "late_p99_us", double(stats.lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "overrun", double(stats.overrun));
+#endif
+  }
+}
+
+static void PrintBenchUsage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [--json=FILE] [--filter=NAME] [--repetitions=N] [--warmup=N] [--measure-ms=N]\n",
+          program);
+}
+
+void KJCSensorBench::Publish()
+{
+  if (!harness.Selected("publish/"))
+  {
+    return;
+  }
+  for (size_t clients : { size_t(1), size_t(16), size_t(256) })
+  {
+    for (bool shared : { false, true })
+    {
+      /* Timer wakeups, so the CPU is the work and not the spinning */
+      KJCServerOptions options { };
+      options.pacing_mode = KJCPacingMode::Timerfd;
+      if (shared)
+      {
+        std::shared_ptr<KJCPublishOptions> publish = std::make_shared<KJCPublishOptions>();
+        publish->mode = KJCPublishMode::Local;
+        publish->name = "local";
+        publish->fields = "RATE=1;";
+        publish->rate = std::chrono::milliseconds { 1 };
+        publish->epoch = clk::now();
+        options.publish = publish;
+      }
+      KJCSensorServer server { options };
+      struct sockaddr_storage server_address;
+      socklen_t server_len;
+      int socket_server = LocalSocket(server_address, server_len);
+      auto serving = std::thread([&server, socket_server]
+                                 { server.Serve(socket_server); });
+
+      /* Nobody reads; the samples are dropped at the clients */
+      const char start_command[] = "TEST;CMD=START;DURATION=3600;RATE=1;";
+      const char subscribe_command[] = "TEST;CMD=SUBSCRIBE;";
+      std::vector<int> sockets;
+      int receive_buffer = 4096;
+      for (size_t i = 0; i < clients; ++i)
+      {
+        struct sockaddr_storage client_address;
+        socklen_t client_len;
+        int client = LocalSocket(client_address, client_len);
+        setsockopt(client, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+        if (shared)
+        {
+          sendto(client, subscribe_command, sizeof(subscribe_command) - 1, 0,
+                 (struct sockaddr*) &server_address, server_len);
+        }
+        else
+        {
+          sendto(client, start_command, sizeof(start_command) - 1, 0,
+                 (struct sockaddr*) &server_address, server_len);
+        }
+        sockets.push_back(client);
+      }
+      double cpu_before = ThreadCpuSeconds(serving);
+      clk::time_point begin = clk::now();
+      std::this_thread::sleep_for(measure_time);
+      double cpu_seconds = ThreadCpuSeconds(serving) - cpu_before;
+      /* Only the loop's thread touches the counter, so read it after */
+      server.Shutdown();
+      serving.join();
+      double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+      close(socket_server);
+      for (int client : sockets)
+      {
+        close(client);
+      }
+
+      /* The published stream is encoded once for all its subscribers */
+      double encoded = double(server.total_samples_sent);
+      double delivered = shared ? encoded * double(clients) : encoded;
+      std::string name = std::string { shared ? "publish/subscribers=" : "publish/sessions=" }
+          + std::to_string(clients);
+      harness.Metric(name, "encoded_per_s", encoded / elapsed);
+      harness.Metric(name, "delivered_per_s", delivered / elapsed);
+      harness.Metric(name, "cpu_percent", 100.0 * cpu_seconds / elapsed);
+      harness.Metric(name, "cpu_ns_per_delivered", delivered > 0 ? 1e9 * cpu_seconds / delivered : 0.0);
+    }
+  }
+}
+
+void KJCSensorBench::Overrun()
+{
+  constexpr auto rate = std::chrono::microseconds { 100 };
+  constexpr auto stall = std::chrono::milliseconds { 20 };
+  constexpr auto stall_every = std::chrono::milliseconds { 100 };
+  /* What arrives this soon after a stall counts as its catch-up */
+  constexpr auto catch_up = std::chrono::milliseconds { 1 };
+  if (!harness.Selected("overrun/"))
+  {
+    return;
+  }
+  struct sockaddr_storage sink_address;
+  socklen_t sink_len;
+  int sink = LocalSocket(sink_address, sink_len);
+  int receive_buffer = 1 << 22;
+  setsockopt(sink, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+
+  static const std::pair<KJCOverrunPolicy, const char*> policies[] = {
+      { KJCOverrunPolicy::Burst, "burst" }, { KJCOverrunPolicy::Skip, "skip" },
+      { KJCOverrunPolicy::Coalesce, "coalesce" } };
+  for (const auto &[policy, policy_name] : policies)
+  {
+    KJCSensorServer server { };
+    int socket_send;
+    server.SetupSocket(&socket_send, "127.0.0.1", "0");
+    KJCStartOptions options { };
+    options.format = KJCWireFormat::Frame;
+    options.overrun = policy;
+    server.StartSession(socket_send, sink_address, sink_len,
+                        std::chrono::hours { 1 }, rate, options);
+
+    /* The loop is driven here, so the stalls land between two turns of it */
+    char datagram[max_frame_size];
+    uint64_t stalls = 0;
+    uint64_t catch_up_datagrams = 0;
+    uint64_t catch_up_samples = 0;
+    clk::time_point begin = clk::now();
+    clk::time_point next_stall = begin + stall_every;
+    clk::time_point resumed = begin - catch_up;
+    for (clk::time_point now = begin; now - begin < measure_time; now = clk::now())
+    {
+      if (now >= next_stall)
+      {
+        std::this_thread::sleep_for(stall);
+        stalls++;
+        next_stall += stall_every;
+        resumed = clk::now();
+      }
+      server.ServeDueSessions(socket_send);
+      ssize_t size;
+      while ((size = recv(sink, datagram, sizeof(datagram), MSG_DONTWAIT)) > 0)
+      {
+        if (clk::now() - resumed < catch_up && size >= ssize_t(frame_header_size))
+        {
+          uint16_t count;
+          memcpy(&count, datagram + 2, sizeof(count));
+          catch_up_datagrams++;
+          catch_up_samples += count;
+        }
+      }
+      server.DropStaleEntries();
+      std::this_thread::sleep_until(std::min(server.schedule.top().deadline, next_stall));
+    }
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    const KJCSession &session = server.sessions.begin()->second;
+    std::string name = std::string { "overrun/policy=" } + policy_name;
+    harness.Metric(name, "samples_per_s", double(session.samples_sent) / elapsed);
+    harness.Metric(name, "sends_per_s", double(session.sends) / elapsed);
+    harness.Metric(name, "catch_up_datagrams",
+                   stalls > 0 ? double(catch_up_datagrams) / double(stalls) : 0.0);
+    harness.Metric(name, "catch_up_samples",
+                   stalls > 0 ? double(catch_up_samples) / double(stalls) : 0.0);
+#if KJC_ENABLE_STATS
+    harness.Metric(name, "skipped_per_stall",
+                   stalls > 0 ? double(session.stats.skipped) / double(stalls) : 0.0);
+    harness.Metric(name, "burst_per_stall",
+                   stalls > 0 ? double(session.stats.burst) / double(stalls) : 0.0);
+    harness.Metric(name, "coalesced_per_stall",
+                   stalls > 0 ? double(session.stats.coalesced) / double(stalls) : 0.0);
+#endif
+    close(socket_send);
+  }
+  close(sink);
+}
+
+void KJCSensorBench::Generate()
+{
+  constexpr uint64_t samples = 600000;
+  if (!harness.Selected("generate/"))
+  {
+    return;
+  }
+  static const std::pair<const char*, const char*> formats[] = {
+      { "ASCII", "DURATION=600;RATE=1;" },
+      { "BIN", "DURATION=600;RATE=1;FORMAT=BIN;" },
+      { "FRAME", "DURATION=600;RATE=1;FORMAT=FRAME;BATCH=64000;" } };
+  for (const auto &[format_name, fields] : formats)
+  {
+    char path[] = "/tmp/kjc_bench_generate_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+      fprintf(stderr, "Can't create an output file. (%d)\n", errno);
+      return;
+    }
+    close(fd);
+    std::shared_ptr<KJCGenerateOptions> generate = std::make_shared<KJCGenerateOptions>();
+    generate->command = std::string { "TEST;CMD=START;" } + fields;
+    KJCCommand command = KJCCommandParser::Parse(generate->command.data(),
+                                                 generate->command.size());
+    const KJCStartCommand &start = std::get<KJCStartCommand>(command);
+    generate->duration = start.duration;
+    generate->rate = start.rate;
+    generate->stream = start.options;
+    generate->file = KJCStreamFile::Open(path);
+    KJCServerOptions options { };
+    options.speed = 0.0;
+    options.generate = generate;
+
+    clk::time_point begin = clk::now();
+    {
+      KJCSensorServer server { options };
+      struct sockaddr_storage server_address;
+      socklen_t server_len;
+      int socket_server = LocalSocket(server_address, server_len);
+      /* Returns by itself once the stream has ended */
+      server.Serve(socket_server);
+      close(socket_server);
+    }
+    generate->file->Close();
+    double elapsed = std::chrono::duration<double> { clk::now() - begin }.count();
+
+    /* Every sample's TIME in ms must be its slot, as in a real-time run */
+    std::vector<char> output;
+    FILE *in = fopen(path, "rb");
+    char buffer[1 << 16];
+    size_t read;
+    while (in != nullptr && (read = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+      output.insert(output.end(), buffer, buffer + read);
+    }
+    if (in != nullptr)
+    {
+      fclose(in);
+    }
+    unlink(path);
+    uint64_t checked = 0;
+    uint64_t mismatches = 0;
+    for (size_t at = 0; at < output.size();)
+    {
+      uint64_t time;
+      uint64_t count = 1;
+      if (generate->stream.format == KJCWireFormat::Ascii)
+      {
+        const char *line_end = (const char*) memchr(&output[at], '\n', output.size() - at);
+        size_t line_size = line_end != nullptr ? line_end - &output[at] : output.size() - at;
+        time = strtoull(&output[at] + strlen("STATUS;TIME="), nullptr, 10);
+        at += line_size + 1;
+      }
+      else
+      {
+        uint32_t size;
+        memcpy(&size, &output[at], sizeof(size));
+        const char *message = &output[at + sizeof(size)];
+        if (generate->stream.format == KJCWireFormat::Frame)
+        {
+          uint16_t frame_count;
+          memcpy(&frame_count, message + 2, sizeof(frame_count));
+          memcpy(&time, message + 12, sizeof(time));
+          count = frame_count;
+        }
+        else
+        {
+          memcpy(&time, message + 2, sizeof(time));
+        }
+        at += sizeof(size) + size;
+      }
+      mismatches += time != checked;
+      checked += count;
+    }
+
+    std::string name = std::string { "generate/format=" } + format_name;
+    harness.Metric(name, "samples_per_s", double(checked) / elapsed);
+    harness.Metric(name, "times_real_time", 600.0 / elapsed);
+    harness.Metric(name, "bytes_per_sample", double(output.size()) / double(samples));
+    harness.Metric(name, "samples_missing", double(samples - std::min(samples, checked)));
+    harness.Metric(name, "time_mismatches", double(mismatches));
+  }
+}
+
+void KJCSensorBench::Range()
+{
+  if (!harness.Selected("range/"))
+  {
+    return;
+  }
+  for (const char *format_name : { "none", "ASCII", "BIN", "FRAME" })
+  {
+    KJCSensorServer server { };
+    struct sockaddr_storage server_address;
+    socklen_t server_len;
+    int socket_server = LocalSocket(server_address, server_len);
+    auto serving = std::thread([&server, socket_server]
+                               { server.Serve(socket_server); });
+
+    /* The live stream's client never reads; only the sending side counts */
+    struct sockaddr_storage live_address;
+    socklen_t live_len;
+    int live = LocalSocket(live_address, live_len);
+    char command[128];
+    int length = snprintf(command, sizeof(command),
+                          "TEST;CMD=START;DURATION=%.3f;RATE=0.1;FORMAT=FRAME;",
+                          std::chrono::duration<double> { measure_time }.count());
+    sendto(live, command, length, 0, (struct sockaddr*) &server_address, server_len);
+    clk::time_point end = clk::now() + measure_time;
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len;
+    int client = LocalSocket(client_address, client_len);
+    int receive_buffer = 4 << 20;
+    setsockopt(client, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    struct timeval receive_timeout = { 0, 200000 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+    std::string format = format_name;
+    length = snprintf(command, sizeof(command),
+                      "TEST;CMD=RANGE;FROM=0;TO=1000;RATE=0.001;FORMAT=%s;",
+                      format.c_str());
+    uint64_t ranges = 0;
+    uint64_t requested = 0;
+    uint64_t received = 0;
+    uint64_t datagrams = 0;
+    uint64_t bytes_received = 0;
+    clk::duration ranging { 0 };
+    char read[2048];
+    while (format != "none" && clk::now() < end)
+    {
+      clk::time_point begin = clk::now();
+      sendto(client, command, length, 0, (struct sockaddr*) &server_address, server_len);
+      KJCFrameDecoder decoder;
+      ssize_t bytes;
+      while ((bytes = recv(client, read, sizeof(read), 0)) >= 0)
+      {
+        std::string_view message { read, size_t(bytes) };
+        if (message.starts_with("TEST;RESULT=RANGE;SAMPLES="))
+        {
+          requested += strtoull(read + strlen("TEST;RESULT=RANGE;SAMPLES="), nullptr, 10);
+          continue;
+        }
+        if (message.starts_with("TEST;RESULT=RANGE_DONE;"))
+        {
+          break;
+        }
+        datagrams++;
+        bytes_received += bytes;
+        if (format == "FRAME")
+        {
+          received += decoder.Decode(read, bytes) ? decoder.count : 0;
+        }
+        else if (format == "BIN")
+        {
+          received += bytes / (binary_record_header_size + 2 * sizeof(int32_t));
+        }
+        else
+        {
+          received += std::count(read, read + bytes, '\n');
+        }
+      }
+      ranging += clk::now() - begin;
+      ranges++;
+    }
+    /* Until the stream has ended */
+    std::this_thread::sleep_until(end + std::chrono::milliseconds { 100 });
+
+    server.Shutdown();
+    serving.join();
+    close(socket_server);
+    close(live);
+    close(client);
+
+    std::string name = std::string { "range/format=" } + format_name;
+    double seconds = std::chrono::duration<double> { ranging }.count();
+    harness.Metric(name, "ranges", double(ranges));
+    harness.Metric(name, "samples_per_s", seconds > 0 ? double(received) / seconds : 0.0);
+    harness.Metric(name, "samples_received_pct",
+                   requested > 0 ? 100.0 * double(received) / double(requested) : 0.0);
+    harness.Metric(name, "bytes_per_datagram",
+                   datagrams > 0 ? double(bytes_received) / double(datagrams) : 0.0);
+#if KJC_ENABLE_STATS
+    const KJCSessionStats &stats = server.sessions.begin()->second.stats;
+    harness.Metric(name, "live_late_p99_us", double(stats.lateness.PercentileNanoseconds(99)) / 1e3);
+    harness.Metric(name, "live_late_max_us", double(stats.lateness.max_nanoseconds) / 1e3);
+    harness.Metric(name, "live_overrun", double(stats.overrun));
+    harness.Metric(name, "live_failed", double(stats.failed));
+#endif
+  }
+}
+
+int KJCSensorBench::Main(int argc, char **argv)
+{
+  const char *json_path = nullptr;
+  static const struct option long_options[] = {
+      { "json", required_argument, nullptr, 'j' },
+      { "filter", required_argument, nullptr, 'f' },
+      { "repetitions", required_argument, nullptr, 'r' },
+      { "warmup", required_argument, nullptr, 'w' },
+      { "measure-ms", required_argument, nullptr, 'm' },
+      { "help", no_argument, nullptr, 'h' },
+      { nullptr, 0, nullptr, 0 } };
+  int option;
+  while ((option = getopt_long(argc, argv, "h", long_options, nullptr)) != -1)
+  {
+    switch (option)
+    {
+    case 'j':
+      json_path = optarg;
+      break;
+    case 'f':
+      harness.filter = optarg;
+      break;
+    case 'r':
+      harness.repetitions = std::max(1, atoi(optarg));
+      break;
+    case 'w':
+      harness.warmup = std::max(0, atoi(optarg));
+      break;
+    case 'm':
+      measure_time = std::chrono::milliseconds { std::max(1, atoi(optarg)) };
+      break;
+    default:
+      PrintBenchUsage(argv[0]);
+      return option == 'h' ? 0 : 1;
+    }
+  }
+
+  CommandParsing();
+  SampleFormatting();
+  Waveform();
+  HistogramRecording();
+  Aggregation();
+  Framing();
+  SessionScaling();
+  PacingModes();
+  BatchedSend();
+  WireFormats();
+  Loopback();
+  CommandRate();
+  StopLatency();
+  WorkerScaling();
+  TraceReplay();
+  RecorderOverhead();
+  Pipeline();
+  RealTimeProfile();
+  TxTimestamps();
+  Resend();
+  Publish();
+  Overrun();
+  Generate();
+  Range();
+
+  printf("\n");
+  harness.PrintSummary(stdout);
+  if (json_path != nullptr && !harness.WriteJson(json_path))
+  {
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  KJCSensorBench bench { };
+  return bench.Main(argc, argv);
+}
@@ -0,0 +1,331 @@
+/* Fuzz harness for the command parser. Built as is, it is a standalone driver
+ * that mutates well formed commands at random; built with clang and
+ * -fsanitize=fuzzer -DKJC_LIBFUZZER, the same entry point runs under libFuzzer. */
+#define KJC_SENSOR_SERVER_NO_MAIN
+#include "server_sensor_data.cpp"
+
+#include <memory>
+#include <random>
+
+static void Check(bool condition, const char *what, const uint8_t *data,
+                  size_t size)
+{
+  if (condition)
+  {
+    return;
+  }
+  fprintf(stderr, "Check failed: %s\nInput (%zu bytes): ", what, size);
+  for (size_t i = 0; i < size; ++i)
+  {
+    fprintf(stderr, isprint(data[i]) ? "%c" : "\\x%02x", data[i]);
+  }
+  fprintf(stderr, "\n");
+  abort();
+}
+
+/* A start command written back out in canonical form must parse to the same thing */
+static void CheckStartRoundTrip(const KJCStartCommand &start,
+                                const uint8_t *data, size_t size)
+{
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  int64_t duration_us = duration_cast<microseconds>(start.duration).count();
+  int64_t rate_us = duration_cast<microseconds>(start.rate).count();
+  Check(duration_us >= 0 && rate_us >= 0, "negative duration or rate", data,
+        size);
+
+  char canonical[512];
+  int length = snprintf(canonical, sizeof(canonical),
+                        "TEST;CMD=START;DURATION=%" PRId64 ".%06" PRId64
+                        ";RATE=%" PRId64 ".%03" PRId64 ";BATCH=%" PRId64
+                        ";FORMAT=%s;TSRES=%s;OVERRUN=%s;", duration_us / 1000000,
+                        duration_us % 1000000, rate_us / 1000, rate_us % 1000,
+                        int64_t(start.options.batch_window.count()),
+                        start.options.format == KJCWireFormat::Frame ? "FRAME" :
+                        start.options.format == KJCWireFormat::Binary ?
+                            "BIN" : "ASCII",
+                        start.options.resolution == KJCTimeResolution::Nanoseconds ? "NS" :
+                        start.options.resolution == KJCTimeResolution::Microseconds ?
+                            "US" : "MS",
+                        start.options.overrun == KJCOverrunPolicy::Coalesce ? "COALESCE" :
+                        start.options.overrun == KJCOverrunPolicy::Skip ?
+                            "SKIP" : "BURST");
+  if (start.options.channel_mask != 0)
+  {
+    /* One index per channel; a list of single channels is canonical */
+    length += snprintf(canonical + length, sizeof(canonical) - length, "CHANNELS=");
+    for (uint64_t mask = start.options.channel_mask; mask != 0; mask &= mask - 1)
+    {
+      length += snprintf(canonical + length, sizeof(canonical) - length, "%d%c",
+                         __builtin_ctzll(mask), (mask & (mask - 1)) != 0 ? ',' : ';');
+    }
+  }
+  if (start.options.window != 0)
+  {
+    length += snprintf(canonical + length, sizeof(canonical) - length, "WINDOW=%" PRIu32 ";",
+                       start.options.window);
+  }
+  if (!start.options.trace.empty())
+  {
+    length += snprintf(canonical + length, sizeof(canonical) - length, "TRACE=%.*s;",
+                       int(start.options.trace.size()), start.options.trace.data());
+  }
+  Check(size_t(length) < sizeof(canonical), "canonical start command too long",
+        data, size);
+  KJCCommand again = KJCCommandParser::Parse(canonical, length);
+  const KJCStartCommand *reparsed = std::get_if<KJCStartCommand>(&again);
+  Check(reparsed != nullptr, "canonical start command not recognised", data,
+        size);
+  Check(reparsed->duration == start.duration && reparsed->rate == start.rate
+            && reparsed->options.batch_window == start.options.batch_window
+            && reparsed->options.format == start.options.format
+            && reparsed->options.resolution == start.options.resolution
+            && reparsed->options.window == start.options.window
+            && reparsed->options.overrun == start.options.overrun
+            && reparsed->options.channel_mask == start.options.channel_mask
+            && reparsed->options.trace == start.options.trace,
+        "canonical start command parsed differently", data, size);
+
+  /* --publish-stream takes the same fields from RATE on */
+  const char *stream = strstr(canonical, "RATE=");
+  clk::duration rate;
+  KJCStartOptions options;
+  Check(KJCCommandParser::ParseStream(stream, canonical + length, rate, options)
+            && rate == start.rate && options.format == start.options.format
+            && options.batch_window == start.options.batch_window
+            && options.channel_mask == start.options.channel_mask
+            && options.overrun == start.options.overrun
+            && options.trace == start.options.trace,
+        "stream fields parsed differently from the start command", data, size);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  KJCCommand command = KJCCommandParser::Parse((const char*) data, size);
+  if (command.index() != 0)
+  {
+    /* Every command we accept is terminated */
+    Check(size > 0 && data[size - 1] == ';', "accepted unterminated command",
+          data, size);
+  }
+  if (const KJCStartCommand *start = std::get_if<KJCStartCommand>(&command))
+  {
+    CheckStartRoundTrip(*start, data, size);
+  }
+  if (const KJCResendCommand *resend = std::get_if<KJCResendCommand>(&command))
+  {
+    Check(resend->from <= resend->to, "resend range backwards", data, size);
+    char canonical[96];
+    int length = snprintf(canonical, sizeof(canonical),
+                          "TEST;CMD=RESEND;FROM=%" PRIu64 ";TO=%" PRIu64 ";",
+                          resend->from, resend->to);
+    KJCCommand again = KJCCommandParser::Parse(canonical, length);
+    const KJCResendCommand *reparsed = std::get_if<KJCResendCommand>(&again);
+    Check(reparsed != nullptr && reparsed->from == resend->from
+              && reparsed->to == resend->to,
+          "canonical resend command parsed differently", data, size);
+  }
+  if (const KJCRangeCommand *range = std::get_if<KJCRangeCommand>(&command))
+  {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    Check(range->rate > clk::duration { 0 } && range->from <= range->to,
+          "range backwards or without a rate", data, size);
+    Check(range->options.batch_window.count() == 0 && range->options.window == 0
+              && range->options.overrun == KJCOverrunPolicy::Burst
+              && range->options.trace.empty(),
+          "range with fields only a session has", data, size);
+    int64_t from_us = duration_cast<microseconds>(range->from).count();
+    int64_t to_us = duration_cast<microseconds>(range->to).count();
+    int64_t rate_us = duration_cast<microseconds>(range->rate).count();
+    char canonical[512];
+    int length = snprintf(canonical, sizeof(canonical),
+                          "TEST;CMD=RANGE;FROM=%" PRId64 ".%03" PRId64 ";TO=%" PRId64
+                          ".%03" PRId64 ";RATE=%" PRId64 ".%03" PRId64
+                          ";FORMAT=%s;TSRES=%s;", from_us / 1000, from_us % 1000,
+                          to_us / 1000, to_us % 1000, rate_us / 1000, rate_us % 1000,
+                          range->options.format == KJCWireFormat::Frame ? "FRAME" :
+                          range->options.format == KJCWireFormat::Binary ?
+                              "BIN" : "ASCII",
+                          range->options.resolution == KJCTimeResolution::Nanoseconds ? "NS" :
+                          range->options.resolution == KJCTimeResolution::Microseconds ?
+                              "US" : "MS");
+    for (uint64_t mask = range->options.channel_mask; mask != 0; mask &= mask - 1)
+    {
+      length += snprintf(canonical + length, sizeof(canonical) - length, "%s%d%c",
+                         mask == range->options.channel_mask ? "CHANNELS=" : "",
+                         __builtin_ctzll(mask), (mask & (mask - 1)) != 0 ? ',' : ';');
+    }
+    Check(size_t(length) < sizeof(canonical), "canonical range command too long",
+          data, size);
+    KJCCommand again = KJCCommandParser::Parse(canonical, length);
+    const KJCRangeCommand *reparsed = std::get_if<KJCRangeCommand>(&again);
+    Check(reparsed != nullptr && reparsed->from == range->from
+              && reparsed->to == range->to && reparsed->rate == range->rate
+              && reparsed->options.format == range->options.format
+              && reparsed->options.resolution == range->options.resolution
+              && reparsed->options.channel_mask == range->options.channel_mask,
+          "canonical range command parsed differently", data, size);
+  }
+  return 0;
+}
+
+#ifndef KJC_LIBFUZZER
+/* Inputs the mutations start from */
+static const char *const seed_commands[] = {
+    "ID;",
+    "STATS;",
+    "TEST;CMD=STOP;",
+    "TEST;CMD=START;DURATION=60;RATE=10;",
+    "TEST;CMD=START;DURATION=1.5;RATE=0.25;",
+    "TEST;CMD=START;DURATION=.5;RATE=1.;BATCH=100;FORMAT=BIN;",
+    "TEST;CMD=START;DURATION=3600;RATE=0.001;FORMAT=ASCII;BATCH=0;",
+    "TEST;CMD=START;DURATION=1;RATE=1;CHANNELS=0,2-5,63;",
+    "TEST;CMD=START;DURATION=1;RATE=1;FORMAT=BIN;CHANNELS=0-63;BATCH=50;",
+    "TEST;CMD=START;DURATION=1;RATE=0.01;TSRES=US;FORMAT=BIN;",
+    "TEST;CMD=START;DURATION=2;RATE=1;TSRES=NS;TSRES=MS;",
+    "TEST;CMD=START;DURATION=60;RATE=0.1;WINDOW=1000;FORMAT=BIN;",
+    "TEST;CMD=START;DURATION=10;RATE=0.1;BATCH=5000;FORMAT=FRAME;TSRES=US;",
+    "TEST;CMD=START;DURATION=60;RATE=0;TRACE=bench_01.run-2;CHANNELS=1;",
+    "TEST;CMD=START;DURATION=5;RATE=1;OVERRUN=SKIP;",
+    "TEST;CMD=START;DURATION=5;RATE=0.5;FORMAT=FRAME;OVERRUN=COALESCE;OVERRUN=BURST;",
+    "TEST;CMD=RESEND;FROM=120;TO=183;",
+    "TEST;CMD=RESEND;FROM=18446744073709551615;TO=18446744073709551615;",
+    "TEST;CMD=RANGE;FROM=0;TO=60000;RATE=1;",
+    "TEST;CMD=RANGE;FROM=1234.5;TO=1234.5;RATE=0.001;FORMAT=FRAME;TSRES=US;",
+    "TEST;CMD=RANGE;FROM=.5;TO=1000000000;RATE=10.;FORMAT=BIN;CHANNELS=0,2-5;",
+    "TEST;CMD=SUBSCRIBE;",
+    "TEST;CMD=UNSUBSCRIBE;" };
+
+/* Characters that matter to the grammar, so mutations hit interesting cases
+   more often than uniformly random bytes would */
+static const char interesting_bytes[] = "0123456789.;=-+ \0\xff"
+    "BATCHFORMATBINASCIIFRAMEDURATIONRATECHANNELS,-TRACE_./TSRESMSUSNSWINDOW"
+    "RESENDFROMTOSUBSCRIBEUNOVERRUNSKIPCOALESCEBURSTRANGE";
+
+static void Mutate(std::vector<uint8_t> &input, std::mt19937_64 &random)
+{
+  size_t mutations = 1 + random() % 4;
+  for (size_t m = 0; m < mutations; ++m)
+  {
+    size_t position = input.empty() ? 0 : random() % (input.size() + 1);
+    uint8_t byte = random() % 2 ?
+        uint8_t(interesting_bytes[random() % (sizeof(interesting_bytes) - 1)]) :
+        uint8_t(random());
+    switch (random() % 6)
+    {
+    case 0:
+      input.insert(input.begin() + position, byte);
+      break;
+    case 1:
+      if (position < input.size())
+      {
+        input.erase(input.begin() + position);
+      }
+      break;
+    case 2:
+      if (position < input.size())
+      {
+        input[position] = byte;
+      }
+      break;
+    case 3:
+      input.resize(position);
+      break;
+    case 4:
+      /* Long digit runs, to reach the overflow checks */
+      input.insert(input.begin() + position, 1 + random() % 24,
+                   uint8_t('0' + random() % 10));
+      break;
+    default:
+      {
+        /* Splice in a piece of another command */
+        const char *other = seed_commands[random() % std::size(seed_commands)];
+        size_t other_length = strlen(other);
+        size_t from = random() % other_length;
+        input.insert(input.begin() + position, other + from,
+                     other + other_length);
+      }
+      break;
+    }
+  }
+}
+
+/* A command whose fate is known must parse as Kind */
+template <typename Kind>
+static void CheckKnownCommand(const char *text)
+{
+  KJCCommand command = KJCCommandParser::Parse(text, strlen(text));
+  Check(std::holds_alternative<Kind>(command),
+        "known command parsed as the wrong kind", (const uint8_t*) text,
+        strlen(text));
+}
+
+/* Checked before any mutation */
+static void CheckKnownCommands()
+{
+  CheckKnownCommand<KJCStartCommand>("TEST;CMD=START;DURATION=1;RATE=1;");
+  /* RATE=0 streams back to back until DURATION, as it always has */
+  CheckKnownCommand<KJCStartCommand>("TEST;CMD=START;DURATION=1;RATE=0;");
+  CheckKnownCommand<KJCStartCommand>("TEST;CMD=START;DURATION=1;RATE=0.001;");
+  CheckKnownCommand<KJCStartCommand>(
+      "TEST;CMD=START;DURATION=60;RATE=0;TRACE=bench_01.run-2;");
+  CheckKnownCommand<KJCUnknownCommand>("TEST;CMD=START;DURATION=1;RATE=-1;");
+  CheckKnownCommand<KJCUnknownCommand>("TEST;CMD=RANGE;FROM=0;TO=1;RATE=0;");
+  CheckKnownCommand<KJCRangeCommand>("TEST;CMD=RANGE;FROM=0;TO=1;RATE=1;");
+}
+
+static void PrintFuzzUsage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [--iterations=N] [--seed=N]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t iterations = 2000000;
+  uint64_t seed = 1;
+  static const struct option long_options[] = {
+      { "iterations", required_argument, nullptr, 'i' },
+      { "seed", required_argument, nullptr, 's' },
+      { "help", no_argument, nullptr, 'h' },
+      { nullptr, 0, nullptr, 0 } };
+  int option;
+  while ((option = getopt_long(argc, argv, "h", long_options, nullptr)) != -1)
+  {
+    switch (option)
+    {
+    case 'i':
+      iterations = strtoull(optarg, nullptr, 10);
+      break;
+    case 's':
+      seed = strtoull(optarg, nullptr, 10);
+      break;
+    default:
+      PrintFuzzUsage(argv[0]);
+      return option == 'h' ? 0 : 1;
+    }
+  }
+
+  CheckKnownCommands();
+  std::mt19937_64 random { seed };
+  uint64_t recognised[std::variant_size_v<KJCCommand>] { };
+  for (uint64_t i = 0; i < iterations; ++i)
+  {
+    const char *seed_command = seed_commands[random() % std::size(seed_commands)];
+    std::vector<uint8_t> input { seed_command, seed_command + strlen(seed_command) };
+    Mutate(input, random);
+    /* Exactly sized heap copy, so the sanitizers catch reads past the end */
+    std::unique_ptr<uint8_t[]> exact { new uint8_t[input.size()] };
+    std::copy(input.begin(), input.end(), exact.get());
+    LLVMFuzzerTestOneInput(exact.get(), input.size());
+    recognised[KJCCommandParser::Parse((const char*) exact.get(),
+                                       input.size()).index()]++;
+  }
+  printf("%" PRIu64 " inputs: unknown %" PRIu64 ", start %" PRIu64
+         ", stop %" PRIu64 ", id %" PRIu64 ", stats %" PRIu64 ", resend %" PRIu64
+         ", subscribe %" PRIu64 ", unsubscribe %" PRIu64 ", range %" PRIu64 "\n",
+         iterations, recognised[0], recognised[1], recognised[2], recognised[3],
+         recognised[4], recognised[5], recognised[6], recognised[7], recognised[8]);
+  return 0;
+}
+#endif
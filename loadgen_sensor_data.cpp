@@ -0,0 +1,757 @@
+/* Load generator for the sensor server. A single process and a single thread
+ * play thousands of virtual clients, each with a UDP socket of its own so the
+ * server sees a separate peer per client; one epoll set watches them all and
+ * each ready socket is drained with recvmmsg(). Every client sends ID and
+ * START, checks every message that comes back, and sends STOP once its run is
+ * over. It measures each client's rate, loss and reordering from the TIME of
+ * the samples, the jitter of their arrival and how long STOP takes to be
+ * acknowledged. With --local the server runs in the same process, so the
+ * whole test stays on loopback. */
+#define KJC_SENSOR_SERVER_NO_MAIN
+#include "server_sensor_data.cpp"
+
+struct KJCLoadOptions
+{
+  const char *server { "127.0.0.1" };
+  const char *port { "8080" };
+  size_t clients { 1000 };
+  /* RATE of every client's stream, in whole microseconds as START takes it */
+  int64_t rate_us { 10000 };
+  /* How long each client streams before it sends STOP */
+  std::chrono::milliseconds duration { 5000 };
+  /* The clients start one after the other, spread evenly over this */
+  std::chrono::milliseconds ramp { 1000 };
+  KJCWireFormat format { KJCWireFormat::Ascii };
+  int64_t batch_us { 0 };
+  /* Workers of a server run in this process on an ephemeral loopback port;
+     0 uses --server and --port instead */
+  unsigned local_workers { 0 };
+};
+
+/* One virtual client. Times are CLOCK_REALTIME in ns, which is what the
+   kernel stamps received datagrams with; 0 means it hasn't happened yet */
+struct KJCLoadClient
+{
+  int socket { -1 };
+  int64_t start_sent { 0 };
+  int64_t started { 0 };
+  int64_t stop_sent { 0 };
+  int64_t stopped { 0 };
+  bool identified { false };
+  /* The server ended the session before we stopped it */
+  bool idle { false };
+  uint32_t errors { 0 };
+  /* Channels of the first sample; every later one must match */
+  size_t channels { 0 };
+
+  uint64_t received { 0 };
+  uint64_t invalid { 0 };
+  /* Index of the sample we expect next, one past the newest seen */
+  uint64_t expected { 0 };
+  /* Samples skipped over and not seen since */
+  uint64_t missing { 0 };
+  /* Samples older than the newest seen before them */
+  uint64_t reordered { 0 };
+  /* First sample of the newest datagram, the reference for jitter */
+  uint64_t last_index { 0 };
+  int64_t last_arrival { 0 };
+};
+
+class KJCLoadGenerator
+{
+public:
+  explicit KJCLoadGenerator(const KJCLoadOptions &options);
+  ~KJCLoadGenerator();
+
+  /* Runs the test and writes the report; returns the exit status */
+  int Main(FILE *out);
+
+private:
+  static constexpr size_t receive_batch = 64;
+  static constexpr size_t max_datagram = 2048;
+  static constexpr size_t max_events = 256;
+  /* How long we wait for the last STOP to be acknowledged */
+  static constexpr int64_t drain_ns = 2000000000;
+
+  static int64_t Now();
+  void OpenClients(const struct sockaddr_storage &server_address,
+                   socklen_t server_len);
+  void Send(KJCLoadClient &client, const char *command, size_t size);
+  void Receive(KJCLoadClient &client);
+  void HandleMessage(KJCLoadClient &client, const char *data, size_t size,
+                     int64_t arrival);
+  /* Accounts for the sample at TIME=time; false if no sample can be there.
+     Jitter is measured between the first samples of datagrams, as samples
+     batched together arrive together. */
+  bool HandleSample(KJCLoadClient &client, uint64_t time, size_t channels,
+                    int64_t arrival, bool first_in_datagram);
+  static bool ParseAscii(const char *data, size_t size, uint64_t &time,
+                         size_t &channels);
+  void Report(FILE *out, int64_t elapsed) const;
+
+  KJCLoadOptions options;
+  std::vector<KJCLoadClient> clients;
+  int epoll_fd { -1 };
+  /* Shared by all clients, as only one datagram is looked at at a time */
+  KJCFrameDecoder frame_decoder;
+  char start_command[128];
+  size_t start_command_size { 0 };
+
+  /* Over all clients: deviation of each gap between two datagrams from what
+     the samples' TIMEs say it should be, and the latency of the replies */
+  KJCLatencyHistogram jitter;
+  KJCLatencyHistogram start_latency;
+  KJCLatencyHistogram stop_latency;
+
+  /* recvmmsg() buffers, reused for every socket */
+  char buffers[receive_batch][max_datagram];
+  char controls[receive_batch][CMSG_SPACE(sizeof(struct timespec))];
+  struct iovec iovecs[receive_batch];
+  struct mmsghdr messages[receive_batch];
+};
+
+KJCLoadGenerator::KJCLoadGenerator(const KJCLoadOptions &options) :
+    options(options)
+{
+  memset(messages, 0, sizeof(messages));
+  for (size_t i = 0; i < receive_batch; ++i)
+  {
+    iovecs[i].iov_base = buffers[i];
+    iovecs[i].iov_len = max_datagram;
+    messages[i].msg_hdr.msg_iov = &iovecs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+  /* The server ends the session itself only if STOP never gets through */
+  int64_t duration_ms = options.duration.count() + options.ramp.count() + 10000;
+  start_command_size = snprintf(start_command, sizeof(start_command),
+                                "TEST;CMD=START;DURATION=%" PRId64 ".%03" PRId64
+                                ";RATE=%" PRId64 ".%03" PRId64
+                                ";TSRES=NS;FORMAT=%s;BATCH=%" PRId64 ";",
+                                duration_ms / 1000, duration_ms % 1000,
+                                options.rate_us / 1000, options.rate_us % 1000,
+                                options.format == KJCWireFormat::Frame ? "FRAME" :
+                                options.format == KJCWireFormat::Binary ?
+                                    "BIN" : "ASCII",
+                                options.batch_us);
+}
+
+KJCLoadGenerator::~KJCLoadGenerator()
+{
+  for (KJCLoadClient &client : clients)
+  {
+    close(client.socket);
+  }
+  if (epoll_fd >= 0)
+  {
+    close(epoll_fd);
+  }
+}
+
+int64_t KJCLoadGenerator::Now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+void KJCLoadGenerator::OpenClients(const struct sockaddr_storage &server_address,
+                                   socklen_t server_len)
+{
+  /* A socket per client, and a few to spare */
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+  {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY
+      && options.clients + 32 > files.rlim_cur)
+  {
+    fprintf(stderr, "Too many clients for the open file limit of %llu\n",
+            (unsigned long long) files.rlim_cur);
+    exit(1);
+  }
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0)
+  {
+    fprintf(stderr, "Error calling epoll_create1 (%d)\n", errno);
+    exit(1);
+  }
+  clients.resize(options.clients);
+  int timestamps = 1;
+  for (size_t i = 0; i < clients.size(); ++i)
+  {
+    /* Connected, so each socket only hears from the server; the kernel picks
+       the source port on the first send */
+    int client = socket(server_address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (client < 0)
+    {
+      fprintf(stderr, "Error creating client socket (%d)\n", errno);
+      exit(1);
+    }
+    setsockopt(client, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+    if (connect(client, (const struct sockaddr*) &server_address, server_len) < 0)
+    {
+      fprintf(stderr, "Error connecting client socket (%d)\n", errno);
+      exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = i;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event) < 0)
+    {
+      fprintf(stderr, "Error calling epoll_ctl (%d)\n", errno);
+      exit(1);
+    }
+    clients[i].socket = client;
+  }
+}
+
+void KJCLoadGenerator::Send(KJCLoadClient &client, const char *command,
+                            size_t size)
+{
+  if (send(client.socket, command, size, 0) < 0)
+  {
+    fprintf(stderr, "Error sending a command (%d)\n", errno);
+  }
+}
+
+void KJCLoadGenerator::Receive(KJCLoadClient &client)
+{
+  for (size_t i = 0; i < receive_batch; ++i)
+  {
+    messages[i].msg_hdr.msg_control = controls[i];
+    messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+  }
+  int received = recvmmsg(client.socket, messages, receive_batch, 0, nullptr);
+  if (received < 0)
+  {
+    /* ECONNREFUSED says the server isn't there (yet); nothing to read */
+    return;
+  }
+  int64_t now = Now();
+  for (int i = 0; i < received; ++i)
+  {
+    int64_t arrival = now;
+    for (struct cmsghdr *control = CMSG_FIRSTHDR(&messages[i].msg_hdr);
+         control != nullptr;
+         control = CMSG_NXTHDR(&messages[i].msg_hdr, control))
+    {
+      if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPNS)
+      {
+        struct timespec stamp;
+        memcpy(&stamp, CMSG_DATA(control), sizeof(stamp));
+        arrival = int64_t(stamp.tv_sec) * 1000000000 + stamp.tv_nsec;
+      }
+    }
+    HandleMessage(client, buffers[i], messages[i].msg_len, arrival);
+  }
+}
+
+bool KJCLoadGenerator::ParseAscii(const char *data, size_t size, uint64_t &time,
+                                  size_t &channels)
+{
+  static constexpr char prefix[] = "STATUS;TIME=";
+  const char *end = data + size;
+  if (size < sizeof(prefix) - 1 || memcmp(data, prefix, sizeof(prefix) - 1) != 0)
+  {
+    return false;
+  }
+  std::from_chars_result parsed = std::from_chars(data + sizeof(prefix) - 1, end, time);
+  if (parsed.ec != std::errc { } || parsed.ptr == end || *parsed.ptr != ';')
+  {
+    return false;
+  }
+  /* Then "NAME=value;" per channel, at least one */
+  const char *current = parsed.ptr + 1;
+  channels = 0;
+  while (current != end)
+  {
+    const char *equals = current;
+    while (equals != end && *equals != '=' && *equals != ';')
+    {
+      ++equals;
+    }
+    if (equals == current || equals == end || *equals != '=')
+    {
+      return false;
+    }
+    int32_t value;
+    parsed = std::from_chars(equals + 1, end, value);
+    if (parsed.ec != std::errc { } || parsed.ptr == end || *parsed.ptr != ';')
+    {
+      return false;
+    }
+    current = parsed.ptr + 1;
+    channels++;
+  }
+  return channels > 0;
+}
+
+bool KJCLoadGenerator::HandleSample(KJCLoadClient &client, uint64_t time,
+                                    size_t channels, int64_t arrival,
+                                    bool first_in_datagram)
+{
+  /* TIME is the sample's scheduled time in ns, so it is a whole number of
+     periods and says exactly which sample this is */
+  uint64_t rate_ns = uint64_t(options.rate_us) * 1000;
+  if (client.started == 0 || time % rate_ns != 0 || channels == 0
+      || (client.channels != 0 && channels != client.channels))
+  {
+    return false;
+  }
+  client.channels = channels;
+  uint64_t index = time / rate_ns;
+  if (client.received > 0 && index + 1 == client.expected)
+  {
+    /* The same sample as the one before it; the jitter of a duplicate
+       would be meaningless */
+    client.reordered++;
+  }
+  else if (index >= client.expected)
+  {
+    if (first_in_datagram)
+    {
+      if (client.received > 0)
+      {
+        int64_t expected_gap = int64_t((index - client.last_index) * rate_ns);
+        int64_t gap = arrival - client.last_arrival;
+        jitter.Record(std::chrono::nanoseconds(std::abs(gap - expected_gap)));
+      }
+      client.last_index = index;
+      client.last_arrival = arrival;
+    }
+    client.missing += index - client.expected;
+    client.expected = index + 1;
+  }
+  else
+  {
+    /* Fills in part of a gap counted before */
+    client.reordered++;
+    client.missing -= std::min<uint64_t>(client.missing, 1);
+  }
+  client.received++;
+  return true;
+}
+
+void KJCLoadGenerator::HandleMessage(KJCLoadClient &client, const char *data,
+                                     size_t size, int64_t arrival)
+{
+  std::string_view message { data, size };
+  if (message == "TEST;RESULT=STARTED;")
+  {
+    if (client.started == 0 && client.start_sent != 0)
+    {
+      client.started = arrival;
+      start_latency.Record(std::chrono::nanoseconds(arrival - client.start_sent));
+      return;
+    }
+  }
+  else if (message == "TEST;RESULT=STOPPED;")
+  {
+    if (client.stopped == 0 && client.stop_sent != 0)
+    {
+      client.stopped = arrival;
+      stop_latency.Record(std::chrono::nanoseconds(arrival - client.stop_sent));
+      return;
+    }
+  }
+  else if (message.starts_with("TEST;RESULT=error;"))
+  {
+    client.errors++;
+    return;
+  }
+  else if (message == "STATUS;STATE=IDLE;")
+  {
+    /* It follows STOPPED too; only before that did the server end the run */
+    client.idle = client.idle || client.stopped == 0;
+    return;
+  }
+  else if (message.starts_with("ID;MODEL=") && message.ends_with(";")
+           && message.find(";SERIAL=") != std::string_view::npos)
+  {
+    client.identified = true;
+    return;
+  }
+  else if (options.format == KJCWireFormat::Ascii)
+  {
+    uint64_t time;
+    size_t channels;
+    if (ParseAscii(data, size, time, channels)
+        && HandleSample(client, time, channels, arrival, true))
+    {
+      return;
+    }
+  }
+  else if (options.format == KJCWireFormat::Binary)
+  {
+    if (size >= binary_record_header_size && uint8_t(data[0]) == binary_record_version
+        && size == binary_record_header_size + sizeof(int32_t) * uint8_t(data[1]))
+    {
+      uint64_t time;
+      memcpy(&time, data + 2, sizeof(time));
+      if (HandleSample(client, le64toh(time), uint8_t(data[1]), arrival, true))
+      {
+        return;
+      }
+    }
+  }
+  else if (frame_decoder.Decode(data, size))
+  {
+    bool valid = true;
+    for (size_t i = 0; i < frame_decoder.count && valid; ++i)
+    {
+      valid = HandleSample(client, frame_decoder.times[i], frame_decoder.channels,
+                           arrival, i == 0);
+    }
+    if (valid)
+    {
+      return;
+    }
+  }
+  client.invalid++;
+}
+
+int KJCLoadGenerator::Main(FILE *out)
+{
+  std::unique_ptr<KJCWorkerGroup> local_server;
+  std::thread serving;
+  char port[NI_MAXSERV];
+  snprintf(port, sizeof(port), "%s", options.port);
+  const char *server = options.server;
+  if (options.local_workers > 0)
+  {
+    KJCServerOptions server_options { };
+    server_options.bind_address = "127.0.0.1";
+    server_options.port = "0";
+    server_options.workers = options.local_workers;
+    /* Nobody asks for STATS after the run, so once every client has stopped
+       the session table must be empty again */
+    server_options.idle_sessions = 0;
+    local_server = std::make_unique<KJCWorkerGroup>(server_options);
+    local_server->Bind();
+    serving = std::thread([&local_server]
+                          { local_server->Run(); });
+    server = "127.0.0.1";
+    snprintf(port, sizeof(port), "%u", unsigned(local_server->Port()));
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *server_info;
+  int result = getaddrinfo(server, port, &hints, &server_info);
+  if (result != 0)
+  {
+    fprintf(stderr, "Cannot resolve %s:%s: %s\n", server, port, gai_strerror(result));
+    exit(1);
+  }
+  struct sockaddr_storage server_address;
+  socklen_t server_len = server_info->ai_addrlen;
+  memcpy(&server_address, server_info->ai_addr, server_len);
+  freeaddrinfo(server_info);
+  OpenClients(server_address, server_len);
+
+  /* Client i starts at begin + ramp * i / clients and stops duration later;
+     both run in client order, so a cursor each is all the schedule needs */
+  int64_t begin = Now();
+  int64_t ramp_ns = int64_t(options.ramp.count()) * 1000000;
+  int64_t duration_ns = int64_t(options.duration.count()) * 1000000;
+  auto start_at = [&](size_t i)
+  { return begin + int64_t(double(ramp_ns) * double(i) / double(clients.size())); };
+  size_t next_start = 0;
+  size_t next_stop = 0;
+  size_t stopped = 0;
+  int64_t last_stop_sent = 0;
+  struct epoll_event events[max_events];
+  while (true)
+  {
+    int64_t now = Now();
+    while (next_start < clients.size() && start_at(next_start) <= now)
+    {
+      KJCLoadClient &client = clients[next_start++];
+      Send(client, "ID;", 3);
+      client.start_sent = Now();
+      Send(client, start_command, start_command_size);
+    }
+    while (next_stop < next_start && start_at(next_stop) + duration_ns <= now)
+    {
+      KJCLoadClient &client = clients[next_stop++];
+      client.stop_sent = Now();
+      Send(client, "TEST;CMD=STOP;", 14);
+      last_stop_sent = client.stop_sent;
+    }
+    if (next_stop == clients.size()
+        && (stopped == clients.size() || now >= last_stop_sent + drain_ns))
+    {
+      break;
+    }
+
+    int64_t wake = next_stop == clients.size() ? last_stop_sent + drain_ns :
+                   start_at(next_stop) + duration_ns;
+    if (next_start < clients.size())
+    {
+      wake = std::min(wake, start_at(next_start));
+    }
+    int timeout = int(std::clamp<int64_t>((wake - now + 999999) / 1000000, 0, 1000));
+    int ready = epoll_wait(epoll_fd, events, max_events, timeout);
+    if (ready < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "Error calling epoll_wait (%d)\n", errno);
+      exit(1);
+    }
+    for (int i = 0; i < ready; ++i)
+    {
+      KJCLoadClient &client = clients[events[i].data.u64];
+      bool was_stopped = client.stopped != 0;
+      Receive(client);
+      stopped += !was_stopped && client.stopped != 0;
+    }
+  }
+  int64_t elapsed = Now() - begin;
+
+  size_t sessions_left = 0;
+  if (local_server != nullptr)
+  {
+    local_server->Shutdown();
+    serving.join();
+    sessions_left = local_server->SessionCount();
+  }
+  Report(out, elapsed);
+  if (local_server != nullptr)
+  {
+    local_server->PrintJitterSummary(out);
+    fprintf(out, "Session table: %zu sessions left after the run\n", sessions_left);
+  }
+
+  bool clean = sessions_left == 0;
+  for (const KJCLoadClient &client : clients)
+  {
+    clean = clean && client.invalid == 0 && client.errors == 0
+        && client.identified && client.started != 0 && client.stopped != 0;
+  }
+  return clean ? 0 : 1;
+}
+
+static void PrintHistogram(FILE *out, const char *name,
+                           const KJCLatencyHistogram &histogram)
+{
+  fprintf(out, "%s: %" PRIu64 " measured, p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+          "p99.9 %.1f us, max %.1f us\n", name, histogram.count,
+          histogram.PercentileNanoseconds(50) / 1e3,
+          histogram.PercentileNanoseconds(90) / 1e3,
+          histogram.PercentileNanoseconds(99) / 1e3,
+          histogram.PercentileNanoseconds(99.9) / 1e3,
+          histogram.max_nanoseconds / 1e3);
+}
+
+void KJCLoadGenerator::Report(FILE *out, int64_t elapsed) const
+{
+  size_t identified = 0, started = 0, stopped = 0, idle = 0;
+  uint64_t errors = 0, received = 0, invalid = 0, missing = 0, reordered = 0;
+  uint64_t worst_missing = 0;
+  /* Samples per second each client got between STARTED and sending STOP */
+  std::vector<double> rates;
+  for (const KJCLoadClient &client : clients)
+  {
+    identified += client.identified;
+    started += client.started != 0;
+    stopped += client.stopped != 0;
+    idle += client.idle;
+    errors += client.errors;
+    received += client.received;
+    invalid += client.invalid;
+    missing += client.missing;
+    reordered += client.reordered;
+    worst_missing = std::max(worst_missing, client.missing);
+    if (client.started != 0 && client.stop_sent > client.started)
+    {
+      rates.push_back(double(client.received) * 1e9
+                      / double(client.stop_sent - client.started));
+    }
+  }
+  std::sort(rates.begin(), rates.end());
+  auto rate_at = [&](double percentile)
+  {
+    return rates.empty() ? 0.0 :
+        rates[std::min(rates.size() - 1, size_t(percentile / 100.0 * rates.size()))];
+  };
+
+  fprintf(out, "Load: %zu clients, RATE=%.3f ms (%.1f samples/s each), FORMAT=%s, "
+          "BATCH=%" PRId64 ", %.1f s each, ramp %.1f s\n", clients.size(),
+          options.rate_us / 1e3, 1e6 / double(options.rate_us),
+          options.format == KJCWireFormat::Frame ? "FRAME" :
+          options.format == KJCWireFormat::Binary ? "BIN" : "ASCII",
+          options.batch_us, options.duration.count() / 1e3,
+          options.ramp.count() / 1e3);
+  fprintf(out, "Sessions: %zu identified, %zu started, %zu stopped, %zu ended by the "
+          "server, %" PRIu64 " errors\n", identified, started, stopped, idle, errors);
+  fprintf(out, "Samples: %" PRIu64 " received (%.0f/s in all), %" PRIu64 " invalid messages\n",
+          received, double(received) * 1e9 / double(elapsed), invalid);
+  fprintf(out, "Rate per client: min %.1f, p1 %.1f, p50 %.1f, max %.1f samples/s\n",
+          rate_at(0), rate_at(1), rate_at(50), rate_at(100));
+  fprintf(out, "Loss: %" PRIu64 " samples (%.3f%%), at most %" PRIu64 " for one client; "
+          "%" PRIu64 " reordered or duplicated\n", missing,
+          received + missing == 0 ? 0.0 : 100.0 * double(missing) / double(received + missing),
+          worst_missing, reordered);
+  PrintHistogram(out, "Inter-arrival jitter", jitter);
+  PrintHistogram(out, "START acknowledgement", start_latency);
+  PrintHistogram(out, "STOP acknowledgement", stop_latency);
+}
+
+static void PrintUsage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [--server=ADDRESS] [--port=PORT] [--local[=WORKERS]]\n"
+          "          [--clients=N] [--rate=MS] [--duration=SECONDS] [--ramp=SECONDS]\n"
+          "          [--format=ASCII|BIN|FRAME] [--batch=US]\n", program);
+}
+
+/* Milliseconds of a non-negative decimal number of seconds */
+static bool ParseSeconds(const char *text, std::chrono::milliseconds &value)
+{
+  char *end;
+  double seconds = strtod(text, &end);
+  if (*text == '\0' || *end != '\0' || !(seconds >= 0) || seconds > 86400)
+  {
+    return false;
+  }
+  value = std::chrono::milliseconds(llround(seconds * 1000));
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  KJCLoadOptions options { };
+  static const struct option long_options[] = {
+      { "server", required_argument, nullptr, 's' },
+      { "port", required_argument, nullptr, 'P' },
+      { "local", optional_argument, nullptr, 'L' },
+      { "clients", required_argument, nullptr, 'n' },
+      { "rate", required_argument, nullptr, 'r' },
+      { "duration", required_argument, nullptr, 'd' },
+      { "ramp", required_argument, nullptr, 'a' },
+      { "format", required_argument, nullptr, 'f' },
+      { "batch", required_argument, nullptr, 'b' },
+      { "help", no_argument, nullptr, 'h' },
+      { nullptr, 0, nullptr, 0 } };
+  int option;
+  while ((option = getopt_long(argc, argv, "h", long_options, nullptr)) != -1)
+  {
+    char *end;
+    switch (option)
+    {
+    case 's':
+      options.server = optarg;
+      break;
+    case 'P':
+      options.port = optarg;
+      break;
+    case 'L':
+      {
+        unsigned long workers = optarg == nullptr ? 1 : strtoul(optarg, &end, 10);
+        if (optarg != nullptr && (*optarg == '\0' || *end != '\0' || workers == 0
+                                  || workers > 1024))
+        {
+          fprintf(stderr, "Bad worker count: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.local_workers = unsigned(workers);
+      }
+      break;
+    case 'n':
+      {
+        unsigned long count = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || count == 0 || count > 1000000)
+        {
+          fprintf(stderr, "Bad client count: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.clients = count;
+      }
+      break;
+    case 'r':
+      {
+        /* START takes RATE to the microsecond */
+        double rate = strtod(optarg, &end);
+        if (*optarg == '\0' || *end != '\0' || !(rate >= 0.001) || rate > 1000000)
+        {
+          fprintf(stderr, "Bad rate: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.rate_us = llround(rate * 1000);
+      }
+      break;
+    case 'd':
+    case 'a':
+      if (!ParseSeconds(optarg, option == 'd' ? options.duration : options.ramp))
+      {
+        fprintf(stderr, "Bad %s: %s\n", option == 'd' ? "duration" : "ramp", optarg);
+        PrintUsage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'f':
+      if (strcmp(optarg, "ASCII") == 0)
+      {
+        options.format = KJCWireFormat::Ascii;
+      }
+      else if (strcmp(optarg, "BIN") == 0)
+      {
+        options.format = KJCWireFormat::Binary;
+      }
+      else if (strcmp(optarg, "FRAME") == 0)
+      {
+        options.format = KJCWireFormat::Frame;
+      }
+      else
+      {
+        fprintf(stderr, "Unknown format: %s\n", optarg);
+        PrintUsage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'b':
+      {
+        long batch = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || batch < 0 || batch > 1000000)
+        {
+          fprintf(stderr, "Bad batch window: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.batch_us = batch;
+      }
+      break;
+    default:
+      PrintUsage(argv[0]);
+      return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind < argc)
+  {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  /* A server in this process talks on stdout for every command; the report
+     goes to the original stdout and the server's chatter nowhere */
+  FILE *out = stdout;
+  if (options.local_workers > 0)
+  {
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == nullptr || freopen("/dev/null", "w", stdout) == nullptr)
+    {
+      fprintf(stderr, "Error redirecting the server's output (%d)\n", errno);
+      return 1;
+    }
+  }
+  int status = KJCLoadGenerator(options).Main(out);
+  fflush(out);
+  return status;
+}
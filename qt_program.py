@@ -1,5 +1,6 @@
 import socket
 import re
+import struct
 import threading
 import time
 from time import sleep
@@ -53,7 +54,7 @@ class MainWindow(QtWidgets.QMainWindow):
 
   
         def send_start_message_local():
-            send_start_message(self.seconds_duration, self.milliseconds_rate, self.server_socket, self.remote_address)
+            send_start_message(self.seconds_duration, self.milliseconds_rate, self.server_socket, self.remote_address, wire_format)
 
         def send_stop_message_local():
             send_stop_message(self.server_socket, self.remote_address)
@@ -180,9 +181,25 @@ test_already_started_message = "TEST;RESULT=error;MSG=already_started;"
 test_already_stopped_message = "TEST;RESULT=error;MSG=already_stopped;"
 idle_message = "STATUS;STATE=IDLE;"
 
+# Binary sample record (FORMAT=BIN): version, channel count, time in ms, then one int32 per
+# channel (millivolts, milliamps on the default device); little-endian
+binary_record_version = 1
+binary_record_header = struct.Struct("<BBQ")
+binary_record_channel = struct.Struct("<i")
+
+# Frame of samples (FORMAT=FRAME): version, channel count, sample count, sequence of the first
+# sample, its time, then per sample zigzag varint deltas from the previous one; see the README
+frame_version = 3
+frame_header = struct.Struct("<BBHQQ")
+# The sequence the next frame should start at, and the samples lost so far
+frame_expected_sequence = 0
+frame_missing_samples = 0
+
 # Regex strings
-raw_string_match_discovery = r"^ID;MODEL=([0-9]+);SERIAL=([0-9]+);$"
-raw_string_match_data = r"^STATUS;TIME=([0-9]+);MV=(-?[0-9]+);MA=(-?[0-9]+);$"
+# A server started with --publish adds the group its shared stream goes to (SUBSCRIBE to take it)
+raw_string_match_discovery = r"^ID;MODEL=([0-9]+);SERIAL=([0-9]+);(?:GROUP=([^;]+);)?$"
+# Captures the time and the first two channels, whatever their names (MV and MA by default)
+raw_string_match_data = r"^STATUS;TIME=([0-9]+);[A-Z0-9]+=(-?[0-9]+);[A-Z0-9]+=(-?[0-9]+);(?:[A-Z0-9]+=-?[0-9]+;)*$"
 
 def capture_fields(raw_regex_string, input_string):
     captures = re.search(raw_regex_string, input_string)
@@ -212,6 +229,59 @@ def read_data_message(message):
         log_incorrect_message(message)
     return capture_result
 
+def read_binary_data_message(raw_message):
+    if(len(raw_message) < binary_record_header.size or raw_message[0] != binary_record_version):
+        return None
+    version, channels, milliseconds = binary_record_header.unpack_from(raw_message)
+    if(channels < 2 or len(raw_message) != binary_record_header.size + channels * binary_record_channel.size):
+        return None
+    millivolts, = binary_record_channel.unpack_from(raw_message, binary_record_header.size)
+    milliamps, = binary_record_channel.unpack_from(raw_message, binary_record_header.size + binary_record_channel.size)
+    # Same shape as the regex captures so process_data_message handles both
+    return (milliseconds, millivolts, milliamps)
+
+def read_zigzag_varint(raw_message, offset):
+    zigzag = 0
+    shift = 0
+    while True:
+        byte = raw_message[offset]
+        offset += 1
+        zigzag |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return (zigzag >> 1) ^ -(zigzag & 1), offset
+
+def read_frame_data_message(raw_message):
+    global frame_expected_sequence, frame_missing_samples
+    if(len(raw_message) < frame_header.size or raw_message[0] != frame_version):
+        return None
+    version, channels, count, sequence, milliseconds = frame_header.unpack_from(raw_message)
+    if(channels < 2):
+        return None
+    samples = []
+    values = [0] * channels
+    offset = frame_header.size
+    try:
+        for i in range(count):
+            if i > 0:
+                delta, offset = read_zigzag_varint(raw_message, offset)
+                milliseconds += delta
+            for k in range(channels):
+                delta, offset = read_zigzag_varint(raw_message, offset)
+                values[k] += delta
+            samples.append((milliseconds, values[0], values[1]))
+    except IndexError:
+        return None
+    if(offset != len(raw_message)):
+        return None
+    # Sequences count samples, so a jump ahead is exactly the number lost
+    if(sequence > frame_expected_sequence):
+        frame_missing_samples += sequence - frame_expected_sequence
+        print(f"Missing {sequence - frame_expected_sequence} samples, {frame_missing_samples} in all")
+    if(sequence >= frame_expected_sequence):
+        frame_expected_sequence = sequence + count
+    return samples
+
 def read_identification_message(message):
     # TODO KJC remove print
     print(message)
@@ -222,8 +292,10 @@ def read_identification_message(message):
     print(message)
     return capture_result
 
-def send_start_message(s, ms, server_socket, address):
+def send_start_message(s, ms, server_socket, address, wire_format="ASCII"):
     start_message = f"TEST;CMD=START;DURATION={s};RATE={ms};"
+    if(wire_format != "ASCII"):
+        start_message += f"FORMAT={wire_format};"
     # TODO KJC check for errors
     return_val = server_socket.sendto(start_message.encode('latin-1'), address)
 
@@ -249,13 +321,19 @@ def process_identification_message(capture_result, window):
     model = capture_result[0]
     serial = capture_result[1]
     print(model, serial)
+    if(capture_result[2] is not None):
+        print("Publishing to", capture_result[2])
     window.update_displayed_model_and_serial(model, serial)
 
 def process_idle_message():
     print("In process_idle_message()")
 
 def process_started_message():
+    global frame_expected_sequence, frame_missing_samples
     print("In process_started_message()")
+    # Frame sequences start again from 0
+    frame_expected_sequence = 0
+    frame_missing_samples = 0
 
 def process_stopped_message():
     print("In process_stopped_message()")
@@ -282,8 +360,9 @@ def process_messages(server_socket, window):
     process_messages.number_consecutive_socket_errors = 0
     while True:
         try:
-            message, address = server_socket.recvfrom(1024)
-            message = message.decode('latin-1')
+            # Frames are up to 1472 bytes
+            raw_message, address = server_socket.recvfrom(2048)
+            message = raw_message.decode('latin-1')
         except socket.error as e:
             print("Encountered an error while calling recvfrom:")
             print(repr(e))
@@ -297,7 +376,14 @@ def process_messages(server_socket, window):
 
         process_messages.number_consecutive_socket_errors = 0
         #print(message)
-        capture_result_data = read_data_message(message)
+        frame_samples = read_frame_data_message(raw_message)
+        if frame_samples is not None:
+            for capture_result_frame in frame_samples:
+                process_data_message(capture_result_frame, window)
+            continue
+        capture_result_data = read_binary_data_message(raw_message)
+        if capture_result_data is None:
+            capture_result_data = read_data_message(message)
         if capture_result_data is not None:
             process_data_message(capture_result_data, window)
         else:
@@ -329,6 +415,9 @@ def run_tests():
     discovery_response_test_string.append("ID;MODEL=76576;SERIAL=07485;")
     discovery_response_test_string_captures.append(["76576", "07485"])
 
+    discovery_response_test_string.append("ID;MODEL=1531;SERIAL=4643;GROUP=239.1.2.3:9000;")
+    discovery_response_test_string_captures.append(["1531", "4643", "239.1.2.3:9000"])
+
 
     # Test ID string parsing for parsing correctness
     if(not test_regex_capture(raw_string_match_discovery, 2, discovery_response_test_string, discovery_response_test_string_captures)):
@@ -393,10 +482,15 @@ def run_tests():
 ###########################################################
 
 
-# python qt_program.py 192.168.0.105 8080 100 250
-if(len(sys.argv) != 5):
-    print("Usage: python qt_program.py remote_address remote_port duration_seconds rate_milliseconds")
-    print(f"Wrong number of parameters: Expect 6. Got {len(sys.argv)}")
+# python qt_program.py 192.168.0.105 8080 100 250 [BIN|FRAME]
+if(len(sys.argv) != 5 and len(sys.argv) != 6):
+    print("Usage: python qt_program.py remote_address remote_port duration_seconds rate_milliseconds [ASCII|BIN|FRAME]")
+    print(f"Wrong number of parameters: Expect 5 or 6. Got {len(sys.argv)}")
+    exit()
+
+wire_format = sys.argv[5] if len(sys.argv) == 6 else "ASCII"
+if wire_format not in ("ASCII", "BIN", "FRAME"):
+    print("Usage: wire format must be ASCII, BIN or FRAME")
     exit()
 
 
@@ -1,11 +1,27 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <signal.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -15,862 +31,6848 @@
 
 #include <chrono>
 #include <thread>
+#include <mutex>
 #include <math.h>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <assert.h>
 #include <asm/param.h>
 #include <atomic>
 #include <inttypes.h>
 #include <iostream>
 #include <tuple>
+#include <unordered_map>
+#include <queue>
+#include <deque>
+#include <list>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <variant>
+#include <bit>
+#include <limits>
+#include <memory>
 
 using clk = std::chrono::steady_clock;
 
+/* Per-session timing histograms and counters, reported by the STATS command.
+ * Build with -DKJC_ENABLE_STATS=0 to take the instrumentation out entirely. */
+#ifndef KJC_ENABLE_STATS
+#define KJC_ENABLE_STATS 1
+#endif
+
 
 /* All the functionality outside of some standard libraries is in this file. These
  * classes provide namespaces, really; all of the functionality is static. Putting
  * headers in the cpp file just to keep things easy. */
 
-/* Simple class just to return a value */
-class KJCSensor
+/* Shape of a channel's signal. Each has a period of 1/frequency, swings
+ * between -amplitude and +amplitude and, at phase 0, starts at 0 rising like
+ * a sine; square is the sign of that sine. */
+enum class KJCWaveform
+{
+  Sine, Square, Triangle, Sawtooth
+};
+
+/* Channel names as they appear in ASCII samples, each with its '=', e.g. "MV=" */
+struct KJCChannelLabels
+{
+  static constexpr size_t max_channels = 64;
+  static constexpr size_t max_size = 16;
+  char text[max_channels][max_size];
+  uint8_t size[max_channels];
+
+  void Set(size_t channel, const char *name, size_t name_size);
+};
+
+/* The channels a session streams, lowest index first */
+struct KJCChannelSelection
+{
+  uint8_t channels[KJCChannelLabels::max_channels];
+  size_t count { 0 };
+
+  static KJCChannelSelection FromMask(uint64_t mask);
+  /* Mask of channels 0 to count - 1 */
+  static uint64_t AllOf(size_t count)
+  {
+    return count >= 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+  }
+};
+
+/* The simulated device. Every channel has its own waveform, frequency (Hz),
+ * phase (radians) and amplitude; the properties are stored as parallel
+ * arrays, one per property (struct of arrays), so the generator runs through
+ * each of them in order. The default is the original two channel device: MV
+ * and MA, 0.05 Hz sines a quarter turn apart with an amplitude of 1000. */
+class KJCSensorModel
 {
 public:
-  static std::pair<int32_t, int32_t> SensorValue(double time);
+  static constexpr size_t max_channels = KJCChannelLabels::max_channels;
+  /* Longest ASCII sample: "STATUS;TIME=ms;" then "NAME=value;" per channel */
+  static constexpr size_t max_sample_size = 12 + 20 + 1
+      + max_channels * (KJCChannelLabels::max_size + 11 + 1);
+  /* Longest ASCII aggregate: "AGGREGATE;TIME=t;COUNT=n;" then
+     "NAME=min,max,mean,rms;" per channel */
+  static constexpr size_t max_aggregate_size = 15 + 20 + 7 + 7 + 1
+      + max_channels * (KJCChannelLabels::max_size + 3 * 11 + 10 + 4);
+
+  KJCSensorModel();
+  /* count channels named CH0, CH1...; like the default, each a sine a
+     quarter turn after the one before */
+  static KJCSensorModel Uniform(size_t count);
+  /* Applies "INDEX,WAVEFORM,FREQUENCY_HZ,PHASE_DEGREES,AMPLITUDE" to one
+     channel, e.g. "3,square,10,90,500"; returns false if it doesn't parse */
+  bool ConfigureChannel(const char *specification);
+
+  /* Value of one channel at time seconds after the start, computed directly */
+  int32_t Value(size_t channel, double time) const;
+  /* Non-sine waveforms as a function of cycles since the start */
+  static double Shape(KJCWaveform waveform, double cycles);
+  static const char* WaveformName(KJCWaveform waveform);
+  uint64_t AllChannels() const
+  {
+    return KJCChannelSelection::AllOf(channel_count);
+  }
+
+  size_t channel_count { 0 };
+  KJCWaveform waveforms[max_channels];
+  double frequencies[max_channels];
+  double phases[max_channels];
+  double amplitudes[max_channels];
+  KJCChannelLabels labels;
+
+private:
+  void SetChannel(size_t channel, const char *name, KJCWaveform waveform,
+                  double frequency, double phase, double amplitude);
 };
 
-class KJCSensorServer
+/* Produces the values of KJCSensorModel::Value for many evenly spaced sample
+ * times and a selection of channels in one call. Rather than a sin() per
+ * channel and sample, each block starts from the exact phasor exp(i*2*pi*f*t)
+ * of every distinct frequency, and the rest of the block is that phasor
+ * rotated by a precomputed table of steps; a channel's phase is one more
+ * rotation. Each channel is a separate loop over the block, which vectorizes.
+ * Every block is reseeded, so rounding error can't build up; sines stay within
+ * 1 LSB of Value() and the other waveforms match it exactly. */
+class KJCSensorBlockGenerator
 {
 public:
-  int Main();
+  static constexpr size_t block_size = 64;
+
+  /* Takes the selected channels' properties and builds the rotation tables;
+     only needed when the selection or the time step changes */
+  void Configure(const KJCSensorModel &model,
+                 const KJCChannelSelection &selection, clk::duration time_step);
+  /* Values at first_time, first_time + time_step, ... for count samples.
+     The k-th selected channel's values go to values[k * stride], onwards. */
+  void Generate(clk::duration first_time, size_t count, int32_t *values,
+                size_t stride) const;
 
 private:
-  /* Function running on separate thread to receive and parse commands
-   * from network. */
-  void CommandParsingThread(int socket, struct sockaddr *peer_address,
-                                   socklen_t peer_len,
-                                   std::atomic<bool> &received_stop,
-                                   std::binary_semaphore &stop_signal,
-                                   std::binary_semaphore &wakeup_io_thread);
+  clk::duration time_step { 0 };
+  /* Per selected channel, in selection order */
+  std::vector<KJCWaveform> waveforms;
+  std::vector<double> frequencies;
+  std::vector<double> amplitudes;
+  std::vector<double> phase_turns;
+  std::vector<double> phase_real;
+  std::vector<double> phase_imaginary;
+  std::vector<uint8_t> table_of_channel;
+  /* block_size steps for each distinct sine frequency */
+  std::vector<double> table_frequencies;
+  std::vector<double> rotation_real;
+  std::vector<double> rotation_imaginary;
+};
 
-  /* Network startup */
-  void SetupSocket(int *socket_listen, const char *name,
-                          const char *service);
-  void Cleanup(int socket);
+/* Min, max, sum and sum of squares of each selected channel over a window
+ * of samples (WINDOW=n). The loop generates a chunk of the window at a time
+ * into rows, a row per channel as the block generator writes them, and Add()
+ * reduces each row in fixed size blocks, which the compiler vectorizes; the
+ * sum of squares is spread over independent lanes so it vectorizes too. The
+ * sum is exact, so the mean is as well. */
+struct KJCWindowAggregate
+{
+  static constexpr size_t max_window = 1000000;
+  /* Samples generated and reduced at a time */
+  static constexpr size_t chunk = 256;
+  alignas(64) int32_t rows[KJCChannelLabels::max_channels][chunk];
+  int32_t min[KJCChannelLabels::max_channels];
+  int32_t max[KJCChannelLabels::max_channels];
+  int64_t sum[KJCChannelLabels::max_channels];
+  double sum_squares[KJCChannelLabels::max_channels];
+  size_t count { 0 };
 
-  /* Provide more accurate sleep */
-  void SleepSpecial(const clk::time_point &end_timepoint,
-                           std::binary_semaphore &stop_signal);
+  void Reset(size_t channels);
+  /* Takes in the first samples values of the first channels rows */
+  void Add(size_t channels, size_t samples);
+  /* Both rounded to the nearest integer */
+  int32_t Mean(size_t channel) const;
+  uint32_t Rms(size_t channel) const;
 
-  /***** Functions to parse commands from network ******/
-  bool ParseStopCommand(char *read, size_t bytes_received);
-  bool ParseIdCommand(char *read, size_t bytes_received);
-  bool ParseStartCommand(
-      char *read, size_t bytes_received, std::chrono::seconds &duration_seconds,
-      std::chrono::microseconds &duration_microseconds,
-      std::chrono::milliseconds &rate_milliseconds,
-      std::chrono::microseconds &rate_microseconds);
+private:
+  static constexpr size_t block = 64;
+  static constexpr size_t lanes = 4;
+  void AddRow(size_t channel, size_t samples);
+};
 
-  /**** Network sends ****/
-  void SendSensorValue(int socket, struct sockaddr *address,
-                              std::pair<int32_t, int32_t> value, clk::time_point current,
-                              clk::time_point start);
-  void SendStartedMessage(int socket, struct sockaddr *peer_address,
-                                 socklen_t peer_len);
-  void SendStoppedMessage(int socket, struct sockaddr *peer_address,
-                                 socklen_t peer_len);
-  void SendErrorAlreadyStartedMessage(int socket,
-                                             struct sockaddr *peer_address,
-                                             socklen_t peer_len);
-  void SendErrorAlreadyStoppedMessage(int socket,
-                                             struct sockaddr *peer_address,
-                                             socklen_t peer_len);
-  void SendDiscoveryMessage(int socket, struct sockaddr *peer_address,
-                                   socklen_t peer_len);
-  void SendIdleStatusMessage(int socket, struct sockaddr *peer_address,
-                                    socklen_t peer_len);
+/* A captured trace to replay, memory mapped read-only and shared by every
+ * session and worker that plays it. File layout, all little-endian:
+ *   "KJCTRACE", uint32 version (1), uint32 channel count, uint64 sample
+ *   period in ns, uint64 sample count, an 8 byte NUL padded name per channel,
+ *   then the samples: one int32 per channel for each sample in turn.
+ * Nothing is read or parsed up front. The kernel reads ahead sequentially,
+ * and each session asks for the stretch ahead of it, so traces larger than
+ * RAM stream from disk without the loop stalling on page faults. */
+class KJCTrace
+{
+public:
+  static constexpr uint32_t version = 1;
+  static constexpr size_t header_size = 32;
+  static constexpr size_t name_size = 8;
+  /* Asked for ahead of each reader */
+  static constexpr size_t readahead_bytes = 4 << 20;
+
+  /* Maps the file; says why and returns nullptr if it isn't a usable trace */
+  static std::unique_ptr<KJCTrace> Open(const char *name, const char *path);
+  /* Names START's TRACE= field accepts: 1 to 32 of [A-Za-z0-9_.-] */
+  static bool ValidName(std::string_view name);
+  ~KJCTrace();
+
+  /* The channel values of one sample, as stored in the file */
+  const int32_t* Row(uint64_t sample) const
+  {
+    return (const int32_t*) (mapping + data_offset + sample * row_size);
+  }
+  /* Starts reading in the stretch after sample, unless that was asked for
+     recently; prefetched_until is the caller's own record of how far */
+  void Prefetch(uint64_t sample, uint64_t &prefetched_until) const;
+
+  char name[33];
+  size_t channel_count;
+  clk::duration period;
+  uint64_t sample_count;
+  KJCChannelLabels labels;
+
+private:
+  KJCTrace() = default;
+
+  const char *mapping { nullptr };
+  size_t mapping_size { 0 };
+  size_t data_offset { 0 };
+  size_t row_size { 0 };
 };
 
+/* One entry of a recorder ring: a sample as it was sent, or the start of a
+ * stream's description. A description has no channels; its text, time_ms
+ * bytes long, runs on through the text of as many further entries as it
+ * needs. */
+struct KJCRecord
+{
+  static constexpr size_t text_capacity = sizeof(int32_t) * KJCChannelLabels::max_channels;
+  int64_t sent_ns;
+  uint64_t time_ms;
+  uint32_t stream;
+  uint8_t channel_count;
+  union
+  {
+    int32_t values[KJCChannelLabels::max_channels];
+    char text[text_capacity];
+  };
+};
 
-std::pair<int32_t, int32_t> KJCSensor::SensorValue(double time)
+/* Single producer, single consumer ring of preallocated records. The event
+ * loop fills and publishes slots without locks or system calls. When the
+ * writer has fallen so far behind that no slot is free, the loop counts the
+ * record as dropped rather than wait. */
+class KJCRecordRing
 {
-  /* For a time t since we started the sensor, f(t) = sin(2*pi*sqrt(2)*t)
-   * or f(t) = sin(2*pi*0.05*t) depending on the commenting below with 
-   * t in seconds */
-  double frequency = /* sqrt(2.0) */ 0.05;
-  double phase = M_PI / 2;
-  double amplitude = 1000;
-  double argument_millivolts = 2 * M_PI * frequency * time;
-  double argument_milliamps = phase + 2 * M_PI * frequency * time;
-  double millivolts = sin(argument_millivolts);
-  double milliamps = sin(argument_milliamps);
-  return std::make_pair<int32_t, int32_t>(amplitude*millivolts, amplitude*milliamps);
-}
+public:
+  /* Rounded up to a power of two */
+  explicit KJCRecordRing(size_t slot_count);
 
-void KJCSensorServer::SetupSocket(int *socket_listen, const char *name,
-                                  const char *service)
+  /***** Producer ******/
+  /* Slot for the record index places after the last one published, or
+     nullptr if the ring is full that far */
+  KJCRecord* Reserve(size_t index);
+  void Publish(size_t count);
+  void CountDropped(uint64_t count)
+  {
+    dropped.store(dropped.load(std::memory_order_relaxed) + count,
+                  std::memory_order_relaxed);
+  }
+
+  /***** Consumer ******/
+  /* Records published and not yet released */
+  size_t Readable() const;
+  const KJCRecord& Peek(size_t index) const;
+  void Release(size_t count);
+  uint64_t Dropped() const
+  {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::vector<KJCRecord> slots;
+  size_t mask;
+  /* Each side writes its own index on its own cache line */
+  alignas(64) std::atomic<uint64_t> head { 0 };
+  /* The producer's last look at tail, so it rarely touches the consumer's line */
+  uint64_t cached_tail { 0 };
+  std::atomic<uint64_t> dropped { 0 };
+  alignas(64) std::atomic<uint64_t> tail { 0 };
+};
+
+/* Writes everything the workers send to a file, from a thread of its own.
+ * Each worker's loop hands its records over through its own KJCRecordRing;
+ * the writer gathers them into column blocks in a large page aligned buffer
+ * that goes to the file a whole chunk at a time. Neither side ever waits for
+ * the other. File layout, little-endian:
+ *   "KJCREC", 0, 1 (version), then blocks of uint32 kind, uint32 body size, body
+ *   kind 1, samples: uint32 count, uint64 samples the ring has dropped so far,
+ *     int64 send time of the first record (ns, steady clock), then columns:
+ *     send time delta from the previous record (zigzag varint), stream
+ *     (uint32), TIME in ms as a delta from the previous record (zigzag
+ *     varint), channel count (uint8), and last the values, one int32 column
+ *     per channel position over the records that have that position
+ *   kind 2, stream: uint32 stream, then text like
+ *     "peer=127.0.0.1:8082;source=model;format=ASCII;channels=MV,MA;" */
+class KJCRecorder
 {
-  struct addrinfo hints;
-  memset(&hints, 0, sizeof(hints));
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE;
+public:
+  static constexpr size_t ring_slots = 1 << 14;
+  static constexpr size_t chunk_size = 1 << 20;
+  static constexpr size_t max_block_records = 256;
 
-  struct addrinfo *bind_address;
-  getaddrinfo(name, service, &hints, &bind_address);
+  /* Creates the file and starts the writer; says why and returns nullptr on failure */
+  static std::unique_ptr<KJCRecorder> Open(const char *path);
+  /* Writes out whatever the rings still hold, then closes the file. Only
+     once the event loops have stopped publishing; the destructor calls it too. */
+  void Close();
+  ~KJCRecorder();
 
-  /* Create the socket */
-  *socket_listen = socket(bind_address->ai_family, bind_address->ai_socktype,
-                          bind_address->ai_protocol);
-  if (*socket_listen < 0)
+  /* A ring for one event loop to publish to; lives as long as the recorder */
+  KJCRecordRing* AddRing();
+  uint32_t NextStream()
   {
-    fprintf(stderr, "socket() failed. (%d)\n", errno);
-    exit(1);
+    return next_stream++;
+  }
+
+  /* Progress of the writer, readable from any thread */
+  std::atomic<uint64_t> samples_written { 0 };
+  std::atomic<uint64_t> streams_written { 0 };
+  std::atomic<uint64_t> bytes_written { 0 };
+  uint64_t Dropped();
+
+private:
+  KJCRecorder() = default;
+  void Run();
+  /* Moves records from the front of the ring into the file buffer; returns how many */
+  size_t WriteBlock(KJCRecordRing &ring);
+  void Append(const char *bytes, size_t size);
+  void WriteOut(const char *bytes, size_t size);
+
+  int fd { -1 };
+  char path[256];
+  std::thread writer;
+  std::atomic<bool> running { true };
+  std::atomic<uint32_t> next_stream { 1 };
+  /* Only held to add a ring or to take a copy of the list */
+  std::mutex rings_mutex;
+  std::vector<std::unique_ptr<KJCRecordRing>> rings;
+  /* Writer thread only */
+  char *chunk { nullptr };
+  size_t chunk_used { 0 };
+  std::vector<char> block;
+  bool failed { false };
+};
+
+/* Where --generate writes its stream when the output is a file: every
+ * message as a client would receive it, ASCII ones a line each, BIN and FRAME
+ * ones after their length as a uint32 little-endian. The event loop writes
+ * it itself, 1 MB at a time; on the virtual clock it has no deadline to miss. */
+class KJCStreamFile
+{
+public:
+  static constexpr size_t chunk_size = 1 << 20;
+
+  /* Creates the file; says why and returns nullptr on failure */
+  static std::unique_ptr<KJCStreamFile> Open(const char *path);
+  /* Writes out the rest and closes the file; false if any write failed. The
+     destructor calls it too. */
+  bool Close();
+  ~KJCStreamFile();
+
+  /* One message; false once a write has failed, after which nothing more is
+     written */
+  bool Write(const char *bytes, size_t size, bool text);
+
+  uint64_t messages_written { 0 };
+  uint64_t bytes_written { 0 };
+
+private:
+  KJCStreamFile() = default;
+  void Append(const char *bytes, size_t size);
+  void WriteOut(const char *bytes, size_t size);
+
+  int fd { -1 };
+  char path[256];
+  std::vector<char> chunk;
+  size_t chunk_used { 0 };
+  bool failed { false };
+};
+
+/* How the event loop waits for its next deadline. Hybrid is the original
+ * sleep-then-spin; it has the least jitter but keeps a core busy. */
+enum class KJCPacingMode
+{
+  Hybrid, Nanosleep, Timerfd
+};
+
+/* Histogram of latencies in nanoseconds, HDR style: each power of two is
+ * split into sub_buckets linear steps, so any value is known to within
+ * 1/sub_buckets (12.5%) while the whole range fits in a few KB. Recording is
+ * a couple of shifts and an increment. Values of 2^max_exponent ns (about
+ * 18 minutes) and more share the last bucket. */
+struct KJCLatencyHistogram
+{
+  static constexpr int sub_bucket_bits = 3;
+  static constexpr int sub_buckets = 1 << sub_bucket_bits;
+  static constexpr int max_exponent = 40;
+  static constexpr int bucket_count = (max_exponent - sub_bucket_bits + 1)
+      * sub_buckets;
+  uint64_t buckets[bucket_count] { };
+  uint64_t count { 0 };
+  uint64_t total_nanoseconds { 0 };
+  uint64_t max_nanoseconds { 0 };
+
+  void Record(clk::duration latency);
+  /* Merges another histogram's latencies into this one */
+  void Add(const KJCLatencyHistogram &other);
+  /* Upper bound of the bucket holding the given percentile */
+  uint64_t PercentileNanoseconds(double percentile) const;
+  double MeanNanoseconds() const;
+};
+
+/* Tells the event loop when to wake for the next deadline. Every mode arms a
+ * timerfd that the loop waits on along with the socket, so commands are
+ * handled while we wait; the modes differ in how early the timer goes off and
+ * how the rest of the way to the deadline is covered:
+ * - hybrid: two kernel ticks early, then the loop busy-polls (sleep-then-spin)
+ * - nanosleep: shortly early, then an absolute clock_nanosleep()
+ * - timerfd: at the deadline itself */
+class KJCPacer
+{
+public:
+  explicit KJCPacer(KJCPacingMode mode);
+  ~KJCPacer();
+
+  /* Readable when the armed time has passed; the loop must Acknowledge() it */
+  int TimerFd() const
+  {
+    return timer_fd;
+  }
+  /* Arms the timer for a deadline, early by the mode's margin */
+  void Arm(const clk::time_point &deadline);
+  /* For a thread under SCHED_FIFO with real-time throttling on: its timer
+     wakeups are prompt, so hybrid only spins the last few microseconds.
+     Spinning for ticks would get the thread throttled. */
+  void UseRealTimeMargin();
+  void Disarm();
+  void Acknowledge();
+  /* True once the deadline is within the margin and the loop should stop sleeping */
+  bool Near(const clk::time_point &deadline) const
+  {
+    return clk::now() >= deadline - margin;
+  }
+  /* Covers the last stretch once Near(); returns true when the deadline has
+     passed and records how late we are. Hybrid never blocks here and returns
+     false until then, so the loop keeps polling the socket as it spins. */
+  bool FinishWait(const clk::time_point &deadline);
+
+  /* Prints lateness percentiles and CPU use of the calling thread since the
+     last reset; only call from the thread running the loop */
+  void Report(FILE *out);
+  void ReportAndReset(FILE *out);
+  void ResetReport();
+
+  static const char* ModeName(KJCPacingMode mode);
+  static bool ParseMode(const char *name, KJCPacingMode &mode);
+
+  KJCPacingMode mode;
+  KJCLatencyHistogram lateness;
+  /* Like lateness, but never reset; for the summary at exit */
+  KJCLatencyHistogram run_lateness;
+
+private:
+  void SetTimer(const struct timespec &value);
+
+  int timer_fd { -1 };
+  clk::duration margin { 0 };
+  /* What the timer is set to, so an unchanged deadline costs no syscall */
+  clk::time_point armed_for { clk::time_point::min() };
+  clk::time_point report_wall_start;
+  std::chrono::nanoseconds report_cpu_start { 0 };
+};
+
+/* The clock sessions are scheduled and timed by. It is the steady clock
+ * unless --speed makes it virtual: then it runs speed times as fast from a
+ * whole second of the steady clock when the server was made, or with
+ * --speed=max stands still until the loop moves it on to the next deadline,
+ * so nothing ever waits. TIME counts scheduled slots from START, so a stream
+ * has the same TIMEs and values on either clock; only the pace differs. */
+class KJCSessionClock
+{
+public:
+  /* 1 for real time, 0 for as fast as the CPU allows */
+  explicit KJCSessionClock(double speed = 1.0);
+
+  clk::time_point Now() const
+  {
+    if (speed == 1.0)
+    {
+      return clk::now();
+    }
+    if (speed == 0.0)
+    {
+      return virtual_now;
+    }
+    return origin + std::chrono::duration_cast<clk::duration>((clk::now() - origin) * speed);
+  }
+  /* When a time of this clock comes on the steady clock, for the pacer */
+  clk::time_point RealTime(clk::time_point time) const
+  {
+    if (speed == 1.0 || speed == 0.0)
+    {
+      return time;
+    }
+    return origin + std::chrono::duration_cast<clk::duration>((time - origin) / speed);
+  }
+  bool Unlimited() const
+  {
+    return speed == 0.0;
+  }
+  /* With Unlimited(), moves the clock on to time unless it is there already */
+  void AdvanceTo(clk::time_point time)
+  {
+    virtual_now = std::max(virtual_now, time);
+  }
+
+private:
+  double speed;
+  clk::time_point origin;
+  clk::time_point virtual_now;
+};
+
+/* Writes a message into a caller's buffer without allocating. Constant
+ * segments are string literals, so their lengths are known at compile time;
+ * numbers are written in place with std::to_chars. If the buffer is too small
+ * nothing more is written and Overflowed() says so. */
+class KJCMessageEncoder
+{
+public:
+  KJCMessageEncoder(char *buffer, size_t capacity) :
+      begin(buffer), current(buffer), end(buffer + capacity)
+  {
+  }
+
+  template<size_t N>
+  KJCMessageEncoder& Literal(const char (&segment)[N])
+  {
+    /* N counts the null terminator, which we don't send */
+    if (size_t(end - current) < N - 1)
+    {
+      overflowed = true;
+      return *this;
+    }
+    memcpy(current, segment, N - 1);
+    current += N - 1;
+    return *this;
+  }
+
+  template<typename Integer>
+  KJCMessageEncoder& Number(Integer value)
+  {
+    std::to_chars_result result = std::to_chars(current, end, value);
+    if (result.ec != std::errc { })
+    {
+      overflowed = true;
+      return *this;
+    }
+    current = result.ptr;
+    return *this;
+  }
+
+  /* Text only known at run time, such as a channel label */
+  KJCMessageEncoder& Text(const char *text, size_t size)
+  {
+    if (size_t(end - current) < size)
+    {
+      overflowed = true;
+      return *this;
+    }
+    memcpy(current, text, size);
+    current += size;
+    return *this;
+  }
+
+  /* Lowest byte first, regardless of the host's byte order */
+  KJCMessageEncoder& LittleEndian(uint64_t value, size_t bytes)
+  {
+    if (size_t(end - current) < bytes)
+    {
+      overflowed = true;
+      return *this;
+    }
+    if constexpr (std::endian::native == std::endian::little)
+    {
+      memcpy(current, &value, bytes);
+      current += bytes;
+      return *this;
+    }
+    for (size_t i = 0; i < bytes; ++i)
+    {
+      *current++ = char(value >> (8 * i));
+    }
+    return *this;
+  }
+
+  /* Signed number as a zigzag LEB128 varint, so small magnitudes of either
+     sign take few bytes */
+  KJCMessageEncoder& ZigZagVarint(int64_t value)
+  {
+    uint64_t zigzag = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+    size_t bytes = 1;
+    for (uint64_t rest = zigzag >> 7; rest != 0; rest >>= 7)
+    {
+      bytes++;
+    }
+    if (size_t(end - current) < bytes)
+    {
+      overflowed = true;
+      return *this;
+    }
+    for (; zigzag >= 0x80; zigzag >>= 7)
+    {
+      *current++ = char(zigzag | 0x80);
+    }
+    *current++ = char(zigzag);
+    return *this;
+  }
+
+  /* Overwrites bytes already encoded at offset, lowest first, e.g. with a
+     count only known once what it counts is in */
+  void Patch(size_t offset, uint64_t value, size_t bytes)
+  {
+    if (offset + bytes > Size())
+    {
+      overflowed = true;
+      return;
+    }
+    for (size_t i = 0; i < bytes; ++i)
+    {
+      begin[offset + i] = char(value >> (8 * i));
+    }
+  }
+
+  const char* Data() const
+  {
+    return begin;
+  }
+  size_t Size() const
+  {
+    return current - begin;
+  }
+  bool Overflowed() const
+  {
+    return overflowed;
+  }
+
+private:
+  char *begin;
+  char *current;
+  char *end;
+  bool overflowed { false };
+};
+
+/* Buffer for messages sent one at a time. Each thread that sends gets its own. */
+struct alignas(64) KJCMessageBuffer
+{
+  static constexpr size_t capacity = 4096;
+  static_assert(capacity >= KJCSensorModel::max_sample_size);
+  static_assert(capacity >= KJCSensorModel::max_aggregate_size);
+  char bytes[capacity];
+};
+
+/* Samples that go out in one sendmmsg(), or one UDP_SEGMENT send when
+ * they all have the same length. The messages are encoded one after the
+ * other into payloads, which is small enough for a single GSO send. Values
+ * are kept a row per selected channel, as the generator writes them. */
+struct KJCSendBatch
+{
+  static constexpr size_t max_messages = 64;
+  static constexpr size_t payload_capacity = 48 * 1024;
+  static_assert(payload_capacity >= KJCSensorModel::max_sample_size);
+  struct mmsghdr headers[max_messages];
+  struct iovec vectors[max_messages];
+  alignas(64) char payloads[payload_capacity];
+  alignas(64) int32_t values[KJCSensorModel::max_channels][max_messages];
+  size_t count { 0 };
+};
+
+/* Commands read from the socket with one recvmmsg() */
+struct KJCReceiveBatch
+{
+  static constexpr size_t max_messages = 16;
+  static constexpr size_t max_message_size = 1024;
+  struct mmsghdr headers[max_messages];
+  struct iovec vectors[max_messages];
+  struct sockaddr_storage peer_addresses[max_messages];
+  char payloads[max_messages][max_message_size];
+};
+
+struct KJCSession;
+
+/* Kernel software TX timestamps (--tx-timestamps). With SO_TIMESTAMPING's
+ * OPT_ID the kernel numbers the datagrams sent on the socket, one number per
+ * send call for a UDP_SEGMENT batch, and reports when each left the stack on
+ * the socket's error queue under its number. The loop counts its sends the
+ * same way and keeps, for those that carried samples, when they were
+ * scheduled, so each departure can be set against its schedule. */
+class KJCTxTimestamps
+{
+public:
+  /* Asks for the timestamps on the socket, which numbers sends from 0 from
+     then on; false if the kernel refuses */
+  bool Enable(int socket);
+  /* Number the kernel gives the next send */
+  uint32_t NextKey() const
+  {
+    return next_key;
+  }
+  /* Counts sends that left the socket, samples or not */
+  void Sent(size_t sends)
+  {
+    next_key += uint32_t(sends);
+  }
+  /* The sends numbered from first_key up to NextKey() carried samples of the
+     session, scheduled to go out at scheduled */
+  void Expect(KJCSession &session, uint32_t first_key, clk::time_point scheduled);
+  /* Gives up on the sends of a session that is about to be erased */
+  void Forget(const KJCSession &session);
+  /* Reads the timestamps waiting on the error queue and records each
+     departure against the schedule of its send */
+  void Drain(int socket);
+
+  /* Departure minus schedule, over every send of samples */
+  KJCLatencyHistogram departure;
+  /* Sends of samples whose timestamp never came, e.g. because the error
+     queue outgrew the socket's receive buffer */
+  uint64_t lost { 0 };
+
+private:
+  struct Pending
+  {
+    uint32_t key;
+    /* nullptr once the timestamp has come */
+    KJCSession *session;
+    /* Tells the session's stream apart from a later one */
+    clk::time_point stream_start;
+    clk::time_point scheduled;
+  };
+  static constexpr size_t capacity = 4096;
+  static constexpr size_t max_messages = 16;
+  Pending pending[capacity] { };
+  uint32_t next_key { 0 };
+  struct mmsghdr headers[max_messages];
+  alignas(struct cmsghdr) char controls[max_messages][256];
+};
+
+/* Command line options of the server */
+
+/* One datagram the event loop has encoded ahead of time for the transmit
+ * thread, with when to send it (--pipeline). The transmit thread fills in
+ * how it went before handing the slot back. */
+struct KJCPipelineSlot
+{
+  enum class Kind : uint8_t
+  {
+    Sample,
+    /* The STATUS;STATE=IDLE; that ends a stream */
+    Idle,
+    /* Not sent: the stream's description, for the recorder */
+    Stream,
+    /* A window's aggregates (WINDOW=n); not recorded */
+    Aggregate
+  };
+  Kind kind;
+  /* The first sample of a stream can't be encoded before it is due */
+  bool first;
+  clk::time_point send_at;
+  clk::time_point published_at;
+  KJCSession *session;
+  uint64_t generation;
+  struct sockaddr_storage peer_address;
+  socklen_t peer_len;
+  /* The sample as the recorder wants it, when there is a recorder */
+  KJCRecord record;
+  size_t size;
+  /***** Filled in by the transmit thread ******/
+  /* The session had stopped or restarted, so nothing was sent */
+  bool skipped;
+  bool delivered;
+  clk::duration lateness;
+  clk::duration send_time;
+  alignas(64) char payload[KJCMessageBuffer::capacity];
+};
+
+/* Single producer, single consumer ring of KJCPipelineSlot between the event
+ * loop, which generates and encodes samples, and the transmit thread, which
+ * only waits for deadlines and sends. Slots come back to the loop once sent,
+ * with their results, so the loop keeps sole ownership of the sessions. A
+ * side that runs out of slots (or of work) asks the other for a wakeup
+ * through an eventfd; otherwise neither makes a system call to hand over. */
+class KJCSamplePipeline
+{
+public:
+  static constexpr size_t max_depth = 1 << 16;
+
+  /* depth is rounded up to a power of two; mode is how the transmit thread waits */
+  KJCSamplePipeline(size_t depth, KJCPacingMode mode);
+  ~KJCSamplePipeline();
+
+  /***** Event loop ******/
+  /* The next free slot, or nullptr when the transmitter is a whole ring
+     behind; GeneratorFd() is then readable once it has caught up by half */
+  KJCPipelineSlot* Reserve();
+  void Publish();
+  /* Each slot the transmitter has finished with, oldest first, then nullptr */
+  KJCPipelineSlot* Reclaim();
+  int GeneratorFd() const
+  {
+    return generator_fd;
+  }
+  void GeneratorWoken();
+
+  /***** Transmit thread ******/
+  /* The oldest published slot, or nullptr if there is none */
+  KJCPipelineSlot* Front();
+  /* Hands the front slot back; wake_generator for slots the loop must see soon */
+  void Release(bool wake_generator);
+  /* Makes TransmitterFd() readable on the next Publish(); look at Front()
+     again afterwards, in case it came first */
+  void WantPublish(bool want);
+  int TransmitterFd() const
+  {
+    return transmitter_fd;
+  }
+  void TransmitterWoken();
+  /* Wakes the transmit thread so it notices the loop has stopped */
+  void Stop();
+
+  size_t Depth() const
+  {
+    return slots.size();
+  }
+  /* Times the loop had a sample to encode and no free slot */
+  std::atomic<uint64_t> ring_full { 0 };
+  /* Samples that reached the ring only after they were due: the transmit
+     thread had run out of work. Not counting the first of each stream. */
+  std::atomic<uint64_t> ring_empty { 0 };
+  /* Paces the transmit thread */
+  KJCPacer pacer;
+
+private:
+  static void Signal(int fd);
+  static void Drain(int fd);
+
+  std::vector<KJCPipelineSlot> slots;
+  size_t mask;
+  /* Published by the loop */
+  alignas(64) std::atomic<uint64_t> head { 0 };
+  /* Loop only: slots below this have been reclaimed */
+  uint64_t reclaimed { 0 };
+  std::atomic<bool> generator_waiting { false };
+  /* Released by the transmitter */
+  alignas(64) std::atomic<uint64_t> tail { 0 };
+  std::atomic<bool> transmitter_waiting { false };
+  int generator_fd { -1 };
+  int transmitter_fd { -1 };
+};
+
+/* Opt-in real-time execution (--rt): the pacing threads run under SCHED_FIFO
+ * with memory locked and their stacks and buffers faulted in up front, so
+ * neither the scheduler nor page faults come between them and a deadline.
+ * Without the privileges, each part that fails is reported and skipped. */
+struct KJCRealTimeProfile
+{
+  bool enabled { false };
+  int priority { 50 };
+  /* CPUs to pin the pacing threads to, in turn; empty leaves it to the group */
+  std::vector<int> cpus;
+
+  /* Locks the process's memory; call before starting the threads */
+  void LockMemory() const;
+  /* Applies the profile to the calling thread, and pins it when cpu >= 0;
+     returns true if the thread now runs under SCHED_FIFO */
+  bool ConfigureThread(const char *role, int cpu) const;
+  /* Parses a list like "2,4-7" */
+  static bool ParseCpuList(const char *text, std::vector<int> &cpus);
+  /* True if the kernel limits how much of each period real-time threads may
+     run (kernel.sched_rt_runtime_us), so they mustn't spin for long */
+  static bool Throttled();
+
+private:
+  /* Touches the stack a pacing thread might use, while it is still cheap */
+  static void PrefaultStack();
+};
+
+struct KJCPublishOptions;
+struct KJCGenerateOptions;
+
+struct KJCServerOptions
+{
+  KJCPacingMode pacing_mode { KJCPacingMode::Hybrid };
+  /* nullptr binds to all local addresses */
+  const char *bind_address { nullptr };
+  const char *port { "8080" };
+  /* Event loops, each on its own SO_REUSEPORT socket; 0 means one per CPU */
+  unsigned workers { 1 };
+  /* The device every worker simulates */
+  KJCSensorModel model;
+  /* Traces START may ask for with TRACE=; shared by all workers */
+  std::vector<std::shared_ptr<const KJCTrace>> traces;
+  /* Records every sample sent when set; shared by all workers */
+  std::shared_ptr<KJCRecorder> recorder;
+  /* With a depth, each worker encodes samples ahead into a ring of that many
+     slots and a transmit thread of its own sends them; 0 sends inline */
+  size_t pipeline_depth { 0 };
+  KJCRealTimeProfile realtime;
+  /* Collects the kernel's TX timestamps of the samples, see KJCTxTimestamps */
+  bool tx_timestamps { false };
+  /* Bytes of recent messages each session keeps for RESEND; 0 for none */
+  size_t resend_buffer { 0 };
+  /* Messages per second each event loop sends again for RESEND, at most */
+  uint32_t resend_rate { 10000 };
+  /* Ended sessions each event loop keeps for STATS and RESEND, at most */
+  size_t idle_sessions { 1024 };
+  /* The shared stream of --publish when set; shared by all workers */
+  std::shared_ptr<const KJCPublishOptions> publish;
+  /* Pace of the session clock, see KJCSessionClock: 1 for real time, 0 for
+     as fast as possible */
+  double speed { 1.0 };
+  /* The one stream of --generate when set, for a single worker */
+  std::shared_ptr<const KJCGenerateOptions> generate;
+};
+
+/* Encoding of sample messages. ASCII is "STATUS;TIME=ms;" and then
+ * "NAME=value;" for each selected channel, e.g. "STATUS;TIME=ms;MV=mv;MA=ma;".
+ * Binary is a little-endian record: version byte, channel count byte, 64 bit
+ * TIME, then one int32 per selected channel, lowest index first. Frame packs
+ * several samples into one datagram, see frame_version. */
+enum class KJCWireFormat
+{
+  Ascii, Binary, Frame
+};
+
+/* What a stream does about the slots it missed when the loop falls a whole
+ * period or more behind: send them all back-to-back as soon as it can (the
+ * default), leave them out and go on with the latest slot that is due, or
+ * send them together in one batched send (one frame with FORMAT=FRAME). */
+enum class KJCOverrunPolicy
+{
+  Burst, Skip, Coalesce
+};
+
+/* Unit of the TIME field of both formats; milliseconds unless START asks */
+enum class KJCTimeResolution
+{
+  Milliseconds, Microseconds, Nanoseconds
+};
+
+constexpr uint8_t binary_record_version = 1;
+constexpr size_t binary_record_header_size = 2 + sizeof(uint64_t);
+
+/* With WINDOW=n a session sends, instead of every n samples, one message with
+ * the min, max, mean and RMS of each selected channel over them; mean and RMS
+ * are rounded. TIME is that of the window's first sample. ASCII is
+ * "AGGREGATE;TIME=t;COUNT=n;" and then "NAME=min,max,mean,rms;" per channel.
+ * Binary is version byte (2), channel count byte, 64 bit TIME, uint32 count,
+ * then int32 min, max and mean and uint32 RMS per channel. */
+constexpr uint8_t binary_aggregate_version = 2;
+
+/* FORMAT=FRAME: each datagram is a frame of consecutive samples. The header
+ * is version byte (3), channel count byte, uint16 sample count, uint64
+ * sequence and the 64 bit TIME of the first sample, little-endian. The
+ * sequence is the index of the first sample in the stream, so the next frame
+ * starts at sequence + count and a gap says exactly how many samples were
+ * lost. Each sample follows as zigzag varints (LEB128 of (v << 1) ^ (v >> 63)):
+ * its TIME less the previous sample's, except for the first, whose TIME is in
+ * the header, then per channel its value less the previous sample's. The
+ * first sample's values are taken from 0, so every frame decodes on its own. */
+constexpr uint8_t frame_version = 3;
+constexpr size_t frame_header_size = 4 + 2 * sizeof(uint64_t);
+/* Most bytes of one sample in a frame: a 64 bit TIME delta takes up to 10,
+   the difference of two int32 up to 5 */
+constexpr size_t FrameSampleSizeBound(size_t channels)
+{
+  return 10 + 5 * channels;
+}
+/* A frame fits in one Ethernet packet, so it is never fragmented */
+constexpr size_t max_frame_size = 1500 - 20 - 8;
+static_assert(frame_header_size + FrameSampleSizeBound(KJCSensorModel::max_channels)
+                  <= max_frame_size);
+
+/* Reads FORMAT=FRAME datagrams back, as a client would. Frames may be lost
+ * or arrive out of order; the sequence numbers say how many samples are
+ * missing at any point, exactly. */
+class KJCFrameDecoder
+{
+public:
+  /* Most samples a frame can hold: a byte of TIME and of one channel each.
+     Live streams put no more in one than they batch; RANGE fills them. */
+  static constexpr size_t max_samples = (max_frame_size - frame_header_size) / 2;
+
+  /* Decodes one datagram into the fields below; returns false, and counts
+     nothing, if it isn't a whole frame */
+  bool Decode(const char *data, size_t size);
+
+  /* The last frame decoded: value k of sample i is values[i][k] */
+  size_t channels { 0 };
+  size_t count { 0 };
+  uint64_t sequence { 0 };
+  uint64_t times[max_samples];
+  int32_t values[max_samples][KJCSensorModel::max_channels];
+
+  /* Sequence the next frame should start at */
+  uint64_t expected { 0 };
+  /* Samples skipped over and not seen since */
+  uint64_t missing { 0 };
+  /* Frames that started before the expected sequence: late or duplicated */
+  uint64_t late { 0 };
+  uint64_t frames { 0 };
+};
+
+/* Optional fields that may follow RATE in a start command */
+struct KJCStartOptions
+{
+  /* BATCH=us: samples due within this window of the first are sent together */
+  std::chrono::microseconds batch_window { 0 };
+  /* FORMAT=ASCII|BIN */
+  KJCWireFormat format { KJCWireFormat::Ascii };
+  /* TSRES=MS|US|NS */
+  KJCTimeResolution resolution { KJCTimeResolution::Milliseconds };
+  /* WINDOW=n: aggregates of every n samples instead of the samples; 0 for none */
+  uint32_t window { 0 };
+  /* CHANNELS=0,2-5: bit n selects channel n; 0 means every channel */
+  uint64_t channel_mask { 0 };
+  /* OVERRUN=BURST|SKIP|COALESCE */
+  KJCOverrunPolicy overrun { KJCOverrunPolicy::Burst };
+  /* TRACE=name: replay this trace instead of the model. Points into the
+     command's datagram, so only valid while it is handled. */
+  std::string_view trace;
+};
+
+/* Where --publish sends its stream: nowhere, a multicast group, or every
+   subscriber in turn from a list each worker keeps (a stand-in for
+   multicast where there is none) */
+enum class KJCPublishMode
+{
+  Off, Multicast, Local
+};
+
+/* One stream of the model, generated and encoded once per sample however
+ * many clients take it. Clients join with SUBSCRIBE; ID advertises the group.
+ * TIME counts from the epoch in every worker, so a sample's TIME and values
+ * are the same whichever worker sends it and whenever it starts. */
+struct KJCPublishOptions
+{
+  KJCPublishMode mode { KJCPublishMode::Off };
+  /* The group, with Multicast */
+  struct sockaddr_storage group;
+  socklen_t group_len { 0 };
+  /* "ADDRESS:PORT" of the group or "local", as ID and SUBSCRIBE advertise it */
+  std::string name;
+  /* RATE and the START fields the stream is made with, as given, for SUBSCRIBE */
+  std::string fields;
+  clk::duration rate;
+  KJCStartOptions stream;
+  clk::time_point epoch;
+};
+
+/* One stream the server makes on its own as soon as it runs, with no client,
+ * and stops serving when it ends: to an address, or into a file. Meant for
+ * the virtual clock, to generate hours of data in seconds. */
+struct KJCGenerateOptions
+{
+  /* "TEST;CMD=START;" and the fields given; the trace name points into it */
+  std::string command;
+  clk::duration duration;
+  clk::duration rate;
+  KJCStartOptions stream;
+  /* Where the stream goes, with file unset */
+  struct sockaddr_storage address;
+  socklen_t address_len { 0 };
+  std::shared_ptr<KJCStreamFile> file;
+};
+
+/***** Commands from the network, as produced by KJCCommandParser ******/
+/* "TEST;CMD=START;DURATION=s;RATE=ms;" plus optional fields */
+struct KJCStartCommand
+{
+  clk::duration duration;
+  clk::duration rate;
+  KJCStartOptions options;
+};
+
+/* "TEST;CMD=STOP;" */
+struct KJCStopCommand
+{
+};
+
+/* "ID;" */
+struct KJCIdCommand
+{
+};
+
+/* "STATS;" */
+struct KJCStatsCommand
+{
+};
+
+/* "TEST;CMD=RESEND;FROM=n;TO=n;": samples from to to, both included,
+   counting from 0 at START */
+struct KJCResendCommand
+{
+  uint64_t from;
+  uint64_t to;
+};
+
+/* "TEST;CMD=RANGE;FROM=ms;TO=ms;RATE=ms;" plus the FORMAT, TSRES and CHANNELS
+   fields: all at once, the samples n of a session started at 0 with that
+   RATE whose time n * RATE is from FROM up to, but not including, TO */
+struct KJCRangeCommand
+{
+  clk::duration from;
+  clk::duration to;
+  clk::duration rate;
+  KJCStartOptions options;
+};
+
+/* "TEST;CMD=SUBSCRIBE;" */
+struct KJCSubscribeCommand
+{
+};
+
+/* "TEST;CMD=UNSUBSCRIBE;" */
+struct KJCUnsubscribeCommand
+{
+};
+
+/* Anything we don't recognise; it is ignored */
+struct KJCUnknownCommand
+{
+};
+
+using KJCCommand = std::variant<KJCUnknownCommand, KJCStartCommand,
+    KJCStopCommand, KJCIdCommand, KJCStatsCommand, KJCResendCommand,
+    KJCSubscribeCommand, KJCUnsubscribeCommand, KJCRangeCommand>;
+
+/* Classifies a datagram by its prefix and parses it in a single pass. Fields
+ * are read in place with std::from_chars; nothing is allocated. */
+class KJCCommandParser
+{
+public:
+  static KJCCommand Parse(const char *read, size_t bytes_received);
+  /* "RATE=ms;" and then optional start fields, as in a start command; for
+     --publish-stream */
+  static bool ParseStream(const char *current, const char *end,
+                          clk::duration &rate, KJCStartOptions &options);
+
+  /* Largest whole part of DURATION or RATE; keeps the durations from overflowing */
+  static constexpr int64_t max_field_value = 1000000000;
+
+private:
+  template<size_t N>
+  static bool Match(const char *&current, const char *end,
+                    const char (&segment)[N]);
+  static bool ParseStart(const char *current, const char *end,
+                         KJCStartCommand &command);
+  static bool ParseResend(const char *current, const char *end,
+                          KJCResendCommand &command);
+  static bool ParseRange(const char *current, const char *end,
+                         KJCRangeCommand &command);
+  static bool ParseDecimal(const char *&current, const char *end,
+                           int fraction_digits, int64_t &whole,
+                           int64_t &fraction);
+  static bool ParseStartOption(const char *&current, const char *end,
+                               KJCStartOptions &options);
+  static bool ParseChannelList(const char *&current, const char *end,
+                               uint64_t &mask);
+};
+
+/* Lifecycle of one client's stream */
+enum class KJCSessionState
+{
+  Idle, Started, Stopped
+};
+
+/* The sample messages a session sent last, kept for RESEND. Messages are
+ * copied one after the other into a byte ring, oldest overwritten first, with
+ * a descriptor each in a second ring that may also run out first. Both are
+ * allocated at START, so storing never allocates. Message n holds samples
+ * first to first + count - 1 of the stream; first only grows. */
+class KJCResendRing
+{
+public:
+  struct Message
+  {
+    uint64_t first;
+    uint32_t count;
+    uint32_t size;
+    size_t offset;
+  };
+
+  /* Room for size bytes of messages, and empty */
+  void Allocate(size_t size);
+  void Clear()
+  {
+    oldest = next = 0;
+    head = 0;
+  }
+  bool Enabled() const
+  {
+    return capacity > 0;
+  }
+  /* Copies one message; one larger than the ring isn't kept */
+  void Store(uint64_t first, uint32_t count, const char *data, size_t size);
+  /* Oldest kept message with a sample at or after sample; nullptr if none */
+  const Message* Find(uint64_t sample) const;
+  const char* Payload(const Message &message) const
+  {
+    return bytes.get() + message.offset;
+  }
+
+private:
+  std::unique_ptr<char[]> bytes;
+  size_t capacity { 0 };
+  std::vector<Message> messages;
+  /* Numbers of the oldest message kept and of the next one stored */
+  uint64_t oldest { 0 };
+  uint64_t next { 0 };
+  /* Where the next message goes in bytes */
+  size_t head { 0 };
+};
+
+/* How well one session's samples kept to their schedule. Lateness is from a
+ * sample's deadline to the start of its send, send time is the send call
+ * itself; batched sessions record both once per batch. Departure, only with
+ * --tx-timestamps, is from the deadline to the kernel's timestamp of the
+ * datagram leaving, once per send call too. An overrun is a message that went
+ * out a whole period (RATE, or a window of them) or more late. */
+struct KJCSessionStats
+{
+  KJCLatencyHistogram lateness;
+  KJCLatencyHistogram send_time;
+  KJCLatencyHistogram departure;
+  uint64_t sent { 0 };
+  uint64_t failed { 0 };
+  uint64_t overrun { 0 };
+  /* Samples an overrun left out (SKIP), sent a period or more late one after
+     another (BURST), and sent late behind the due one in its batch (COALESCE) */
+  uint64_t skipped { 0 };
+  uint64_t burst { 0 };
+  uint64_t coalesced { 0 };
+  /* RESEND: samples asked for that were sent again, that were no longer (or
+     never) kept, and the messages that carried them */
+  uint64_t resend_hits { 0 };
+  uint64_t resend_misses { 0 };
+  uint64_t resent { 0 };
+};
+
+/* A peer on the fan-out list of --publish=local */
+struct KJCSubscriber
+{
+  struct sockaddr_storage address;
+  socklen_t address_len;
+};
+
+/* Everything needed to stream to one peer. Each client gets its own
+ * DURATION/RATE/start time, so many test rigs can share one server. */
+struct KJCSession
+{
+  struct sockaddr_storage peer_address;
+  socklen_t peer_len;
+  /* Set for the published stream with --publish=local: every message goes to
+     each of these instead of the peer address */
+  const std::vector<KJCSubscriber> *subscribers { nullptr };
+  /* Set for the stream of --generate into a file: it gets every message */
+  KJCStreamFile *output { nullptr };
+  KJCSessionState state { KJCSessionState::Idle };
+  clk::time_point start_timepoint;
+  clk::time_point end_timepoint;
+  clk::duration rate;
+  clk::duration batch_window { 0 };
+  KJCWireFormat format { KJCWireFormat::Ascii };
+  KJCTimeResolution resolution { KJCTimeResolution::Milliseconds };
+  /* Samples per aggregate message, 0 to send the samples themselves */
+  uint32_t window { 0 };
+  KJCOverrunPolicy overrun { KJCOverrunPolicy::Burst };
+  KJCChannelSelection channels;
+  /* Replayed instead of the model when set; sample n goes out as sample n */
+  const KJCTrace *trace { nullptr };
+  uint64_t prefetched_until { 0 };
+  /* Names of the channels, from the model or the trace */
+  const KJCChannelLabels *labels { nullptr };
+  /* Identifies the stream in the recorder's file */
+  uint32_t record_stream { 0 };
+  /* The pipeline still has to pass the stream's description to the recorder */
+  bool describe_stream { false };
+  /* Most bytes one sample message of this session can take */
+  size_t sample_size_bound { 0 };
+  /* Configured for this session's rate and channels; used for batched and
+     coalesced samples */
+  KJCSensorBlockGenerator generator;
+  uint64_t samples_sent { 0 };
+  /* Send syscalls, for comparing batched with unbatched streams */
+  uint64_t sends { 0 };
+  /* Recent messages, with --resend-buffer */
+  KJCResendRing resend;
+  /* Ranges of samples still to send again for RESEND, oldest first, in a
+     ring; the session is in the server's resend_queue while it has any */
+  struct ResendRange
+  {
+    uint64_t from;
+    uint64_t to;
+  };
+  static constexpr size_t max_resend_ranges = 16;
+  ResendRange resend_ranges[max_resend_ranges];
+  size_t resend_first { 0 };
+  size_t resend_count { 0 };
+  bool resend_queued { false };
+  /* Bumped on every START and STOP so the scheduler can recognise queue
+     entries that belong to a stream which no longer exists. Atomic because
+     the transmit thread checks pipeline slots against it. */
+  std::atomic<uint64_t> generation { 0 };
+  /* Schedule entries and pipeline slots pointing at the session; the table
+     only erases a session that has none and isn't in the resend_queue */
+  uint32_t references { 0 };
+  /* In the server's idle_sessions, at idle_position, once it has ended and
+     nothing refers to it any more */
+  bool idle_listed { false };
+  std::list<KJCSession*>::iterator idle_position;
+#if KJC_ENABLE_STATS
+  KJCSessionStats stats;
+#endif
+
+  /* Time from one message of the stream to the next */
+  clk::duration Period() const
+  {
+    return window > 0 ? int64_t(window) * rate : rate;
+  }
+  /* Past the end of DURATION: the slot's own deadline decides, except with
+     RATE=0, where every slot has the first one's and the time now does */
+  bool Ended(clk::time_point deadline, clk::time_point now) const
+  {
+    return rate > clk::duration { 0 } ? deadline >= end_timepoint
+        : now >= end_timepoint;
+  }
+};
+
+/* Peer address reduced to something we can hash; sessions are keyed by it */
+struct KJCPeerKey
+{
+  uint64_t address_high;
+  uint64_t address_low;
+  uint32_t port_family;
+
+  static KJCPeerKey FromAddress(const struct sockaddr_storage &address);
+  bool operator==(const KJCPeerKey &other) const = default;
+};
+
+struct KJCPeerKeyHash
+{
+  size_t operator()(const KJCPeerKey &key) const
+  {
+    return std::hash<uint64_t> { }(key.address_high * 31 + key.address_low)
+        ^ (size_t(key.port_family) << 1);
+  }
+};
+
+/* Deadline of the next sample of one session. The queue may hold stale
+   entries for stopped sessions; the generation tells them apart. */
+struct KJCScheduleEntry
+{
+  clk::time_point deadline;
+  KJCSession *session;
+  uint64_t generation;
+
+  bool operator>(const KJCScheduleEntry &other) const
+  {
+    return deadline > other.deadline;
+  }
+};
+
+/* A RANGE being answered. The session says how its samples are encoded and
+ * who gets them; its stream starts at the epoch, so TIME and the FRAME
+ * sequence are those of a session started at 0, and samples_sent is the
+ * next sample to go. Samples are generated a block at a time and packed
+ * into datagrams of up to max_frame_size: a frame of them with FORMAT=FRAME,
+ * records back to back with BIN, and lines with ASCII. */
+struct KJCRangeJob
+{
+  static constexpr size_t block = 1024;
+  static_assert(block % KJCSensorBlockGenerator::block_size == 0);
+  KJCSession session;
+  /* The sample after the last */
+  uint64_t end { 0 };
+  /* Most samples one datagram can take */
+  size_t per_datagram { 0 };
+  /* Values of samples buffered_first onwards, a row of block per channel */
+  std::unique_ptr<int32_t[]> values;
+  uint64_t buffered_first { 0 };
+  size_t buffered_count { 0 };
+  uint64_t requested { 0 };
+  clk::time_point started;
+};
+
+class KJCSensorServer
+{
+public:
+  explicit KJCSensorServer(const KJCServerOptions &options = KJCServerOptions { });
+  ~KJCSensorServer();
+  /* Handles commands and streams on an already bound socket until Shutdown() */
+  void Serve(int socket);
+  /* Makes Serve() return; safe from any thread and from signal handlers */
+  void Shutdown();
+
+private:
+  friend class KJCSensorBench;
+  friend class KJCWorkerGroup;
+
+  /* Reads and handles up to a batch of the commands waiting on the socket,
+   * so a flood of them can't hold up the samples */
+  void ReceiveCommands(int socket);
+
+  /* Sends the samples that are due, a bounded number at a time so commands
+   * are never kept waiting for long */
+  void ServeDueSessions(int socket);
+  /* Pops schedule entries of sessions that stopped or restarted */
+  void DropStaleEntries();
+  /* Every schedule entry counts as a reference to its session, see ListIdle() */
+  void Schedule(clk::time_point deadline, KJCSession &session, uint64_t generation);
+  KJCScheduleEntry Unschedule();
+  /* Puts a session of the table in idle_sessions once it has ended and nothing
+     refers to it; UnlistIdle() takes it out again when it is used */
+  void ListIdle(KJCSession &session);
+  void UnlistIdle(KJCSession &session);
+  /* Erases the longest idle sessions beyond max_idle_sessions */
+  void EvictIdleSessions();
+  /* Sends the samples of a batched session due from deadline up to
+     window_end; returns the next deadline and how many samples the kernel took */
+  clk::time_point SendBatchedSamples(int socket, KJCSession &session,
+                                     clk::time_point deadline,
+                                     clk::time_point window_end,
+                                     size_t &delivered);
+  /* Slots after the one due at deadline that are past at now as well, up to
+     the end of the survey or trace */
+  static uint64_t MissedSlots(const KJCSession &session, clk::time_point deadline,
+                              clk::time_point now);
+  /* With OVERRUN=SKIP, moves the session past the slots it missed; returns
+     the deadline of the one to send */
+  clk::time_point SkipMissedSlots(KJCSession &session, clk::time_point deadline,
+                                  clk::time_point now);
+  /* Returns the number of messages sent; to a list of subscribers, the
+     number every one of them was sent */
+  size_t SendBatch(int socket, KJCSession &session);
+  size_t SendBatchTo(int socket, const struct sockaddr_storage &address,
+                     socklen_t address_len);
+  /* Values of the session's next sample, due at deadline, in selection
+     order; like TraceValues() they may end up in scratch */
+  const int32_t* SampleValues(KJCSession &session, clk::time_point deadline,
+                              int32_t *scratch);
+  /* Min, max, mean and RMS of each channel over the session's window of
+     samples ending at deadline, in the session's format */
+  void FormatAggregate(KJCMessageEncoder &encoder, KJCSession &session,
+                       clk::time_point deadline);
+  /* Values of one sample of a trace session, in selection order. Points
+     into the mapping when that is already the layout, else into scratch. */
+  const int32_t* TraceValues(KJCSession &session, uint64_t sample,
+                             int32_t *scratch);
+  /* nullptr if there is no such trace */
+  const KJCTrace* FindTrace(std::string_view name) const;
+
+  /***** Pipeline (--pipeline) ******/
+  /* Encodes the samples due within pipeline_lookahead into the pipeline,
+     oldest deadline first, until it is full */
+  void GenerateDueSamples();
+  /* Takes back the slots the transmit thread is done with: statistics, and
+     the end of streams whose last message has gone out */
+  void ReclaimPipelineSlots();
+  /* The transmit thread: sends each slot at its time until the loop stops */
+  void Transmit(int socket);
+
+  /***** RESEND ******/
+  /* Keeps a message of the session, samples first to first + count - 1 of
+     its stream, if the session keeps any */
+  static void KeepForResend(KJCSession &session, uint64_t first, uint32_t count,
+                            const KJCMessageEncoder &encoder)
+  {
+    if (session.resend.Enabled() && !encoder.Overflowed())
+    {
+      session.resend.Store(first, count, encoder.Data(), encoder.Size());
+    }
+  }
+  /* Queues the samples to be sent again, or replies with why not */
+  void HandleResend(int socket, const struct sockaddr_storage &peer_address,
+                    socklen_t peer_len, const KJCResendCommand &resend);
+  /* Sends queued RESEND messages as the rate allows, but only while no
+     sample is about to be due, so they never hold one up */
+  void ServeResends(int socket, clk::duration lead);
+
+  /***** RANGE ******/
+  /* Queues the range's samples and replies with how many there are, or
+     with why not */
+  void HandleRange(int socket, const struct sockaddr_storage &peer_address,
+                   socklen_t peer_len, const KJCRangeCommand &range);
+  /* Sends queued ranges, a datagram at a time, while no sample is about to
+     be due; false when the socket's send queue is full enough that the loop
+     should wait for EPOLLOUT */
+  bool ServeRanges(int socket, clk::duration lead);
+  /* Packs the job's next samples into one datagram; returns how many */
+  size_t FormatRange(KJCMessageEncoder &encoder, KJCRangeJob &job);
+  /* Tells the peer how many samples went out */
+  void FinishRange(int socket, const KJCRangeJob &job);
+  /* Ends the peer's range early; false if it has none */
+  bool CancelRange(int socket, const struct sockaddr_storage &peer_address);
+
+  /***** Publishing (--publish) ******/
+  /* Schedules the published stream from its next slot on the epoch's grid */
+  void StartPublishing();
+  void StopPublishing();
+  /* Adds or removes the peer, with --publish=local, and replies */
+  void HandleSubscribe(int socket, const struct sockaddr_storage &peer_address,
+                       socklen_t peer_len, bool subscribe);
+  /* Sends one message to every subscriber of the session, in sendmmsg()
+     batches; true if all of them got it */
+  bool FanOut(int socket, const KJCSession &session,
+              const KJCMessageEncoder &encoder);
+
+  /***** Generating (--generate) ******/
+  /* Schedules the generated stream from now on the session clock */
+  void StartGenerating();
+
+  /***** Session clock (--speed) ******/
+  /* When the loop has to be ready for the next deadline, on the steady clock */
+  clk::time_point NextWakeup(clk::duration lead) const
+  {
+    return clock.RealTime(schedule.top().deadline) - lead;
+  }
+  /* Covers the last stretch to the next deadline, see KJCPacer::FinishWait();
+     on the unlimited clock there is nothing to wait for */
+  bool ReachDeadline(clk::duration lead);
+  /***** Recording ******/
+  /* Describes a session's new stream to the recorder */
+  void RecordStream(KJCSession &session);
+  static void DescribeStream(const KJCSession &session,
+                             KJCMessageEncoder &encoder);
+  /* The text in as many ring slots as it needs; counted as dropped if they
+     aren't free */
+  static void PublishStreamDescription(KJCRecordRing &ring, uint32_t stream,
+                                       const char *text, size_t size);
+  static void FillRecord(KJCRecord &record, const KJCSession &session,
+                         const int32_t *values, size_t stride,
+                         clk::time_point current);
+  /* Copies a sample about to be sent into the next free ring slot */
+  void StageRecord(const KJCSession &session, const int32_t *values,
+                   size_t stride, clk::time_point current);
+  /* Publishes the first delivered staged samples with their send time;
+     the rest never went out. Counts what didn't fit in the ring as dropped. */
+  void CommitRecords(size_t delivered, clk::time_point sent);
+  void ReportSession(const KJCSession &session);
+
+  /***** Session table ******/
+  /* Sets up a session's stream for the rate and START fields, from its
+     first sample; the peer and times are the caller's */
+  void ConfigureSession(KJCSession &session, clk::duration rate,
+                        const KJCStartOptions &options);
+  /* Return false if the peer's session is already in the requested state */
+  bool StartSession(int socket, const struct sockaddr_storage &peer_address,
+                    socklen_t peer_len, clk::duration duration,
+                    clk::duration rate,
+                    const KJCStartOptions &options = KJCStartOptions { });
+  bool StopSession(int socket, const struct sockaddr_storage &peer_address);
+  /* Replies to STATS with the statistics of the peer's session */
+  void SendSessionStats(int socket, const struct sockaddr_storage &peer_address,
+                        socklen_t peer_len);
+
+  /* Network startup. Sockets that share a port with reuse_port get the
+     datagrams of each peer spread over them by the kernel. */
+  void SetupSocket(int *socket_listen, const char *name,
+                          const char *service, bool reuse_port = false);
+  void Cleanup(int socket);
+
+  /***** Commands from the network ******/
+  /* Parses one datagram and acts on it */
+  void HandleCommand(int socket, const struct sockaddr_storage &peer_address,
+                     socklen_t peer_len, const char *read,
+                     size_t bytes_received);
+
+  /**** Network sends ****/
+  /* Append one sample message to the encoder. The value of the k-th selected
+     channel is values[k * stride]. */
+  void FormatSensorValue(KJCMessageEncoder &encoder,
+                         const KJCChannelLabels &labels,
+                         const KJCChannelSelection &selection,
+                         const int32_t *values, size_t stride,
+                         clk::time_point current, clk::time_point start,
+                         KJCTimeResolution resolution =
+                             KJCTimeResolution::Milliseconds);
+  void FormatSensorValueBinary(KJCMessageEncoder &encoder,
+                               const KJCChannelSelection &selection,
+                               const int32_t *values, size_t stride,
+                               clk::time_point current, clk::time_point start,
+                               KJCTimeResolution resolution =
+                             KJCTimeResolution::Milliseconds);
+  /* One frame of count of the session's samples, starting with its next one,
+     due at first; the k-th channel of sample i is values[k * stride + i].
+     Given a limit, only the samples that surely keep the encoder's size
+     within it go in, at least one; returns how many did. */
+  static size_t FormatFrame(KJCMessageEncoder &encoder, const KJCSession &session,
+                            const int32_t *values, size_t stride, size_t count,
+                            clk::time_point first,
+                            size_t limit = std::numeric_limits<size_t>::max());
+  /* Return false if the sample couldn't be sent */
+  bool SendSensorValue(int socket, KJCSession &session,
+                       const int32_t *values, clk::time_point current);
+  /* A message of the session's stream, to its peer or its subscribers */
+  bool SendStreamMessage(int socket, KJCSession &session,
+                         const KJCMessageEncoder &encoder);
+  void SendStartedMessage(int socket, struct sockaddr *peer_address,
+                                 socklen_t peer_len);
+  void SendStoppedMessage(int socket, struct sockaddr *peer_address,
+                                 socklen_t peer_len);
+  void SendErrorAlreadyStartedMessage(int socket,
+                                             struct sockaddr *peer_address,
+                                             socklen_t peer_len);
+  void SendErrorAlreadyStoppedMessage(int socket,
+                                             struct sockaddr *peer_address,
+                                             socklen_t peer_len);
+  void SendErrorUnknownChannelMessage(int socket,
+                                      struct sockaddr *peer_address,
+                                      socklen_t peer_len);
+  void SendErrorUnknownTraceMessage(int socket, struct sockaddr *peer_address,
+                                    socklen_t peer_len);
+  void SendErrorBadRateMessage(int socket, struct sockaddr *peer_address,
+                               socklen_t peer_len);
+  void SendDiscoveryMessage(int socket, struct sockaddr *peer_address,
+                                   socklen_t peer_len);
+  void SendIdleStatusMessage(int socket, struct sockaddr *peer_address,
+                                    socklen_t peer_len);
+  /* Every message goes out through here; a bad encode is reported, not sent */
+  bool SendMessage(int socket, struct sockaddr *peer_address,
+                   socklen_t peer_len, const KJCMessageEncoder &encoder);
+  /* Encoder over the calling thread's message buffer */
+  static KJCMessageEncoder OutgoingMessage();
+
+  /* Sessions live in a node-based map, so the pointers held by the schedule
+     stay valid while other peers are added */
+  std::unordered_map<KJCPeerKey, KJCSession, KJCPeerKeyHash> sessions;
+  /* Sessions that have ended and that nothing refers to any more, longest
+     idle first. They stay for STATS and RESEND until there are more than
+     max_idle_sessions of them, then the first are erased. */
+  std::list<KJCSession*> idle_sessions;
+  std::priority_queue<KJCScheduleEntry, std::vector<KJCScheduleEntry>,
+      std::greater<KJCScheduleEntry>> schedule;
+
+  /* Everything above and below is only touched by the thread in Serve(); the
+     eventfd and the flag are how other threads and signal handlers stop it */
+  int shutdown_fd { -1 };
+  std::atomic<bool> running { true };
+
+  /* Decides how the event loop waits for deadlines */
+  KJCPacer pacer;
+  /* What the deadlines are on */
+  KJCSessionClock clock;
+  /* What the samples are made of */
+  KJCSensorModel model;
+  std::vector<std::shared_ptr<const KJCTrace>> traces;
+
+  /* Keeps the recorder alive while this loop publishes to its ring */
+  std::shared_ptr<KJCRecorder> recorder;
+  KJCRecordRing *record_ring { nullptr };
+  /* Samples of the current send that have a ring slot, and that didn't get one */
+  size_t staged_records { 0 };
+  size_t unstaged_records { 0 };
+
+  /* Only with --pipeline; the loop then waits on the pacer in timerfd mode
+     and the transmit thread in the chosen mode */
+  std::unique_ptr<KJCSamplePipeline> pipeline;
+  /* Waiting for the transmit thread to free slots */
+  bool pipeline_full { false };
+  /* How far ahead of their deadlines the loop encodes samples */
+  static constexpr std::chrono::milliseconds pipeline_lookahead { 2 };
+
+  /* Only with --tx-timestamps; every send on the socket goes through Sent() */
+  std::unique_ptr<KJCTxTimestamps> tx_timestamps;
+
+  /* Applied to the loop's thread and the transmit thread as they start */
+  KJCRealTimeProfile realtime;
+  /* CPUs the worker group chose for them; -1 for no pinning */
+  int loop_cpu { -1 };
+  int transmit_cpu { -1 };
+  /* The pacer that waits for the send deadlines: the loop's, or with a
+     pipeline the transmit thread's */
+  const KJCPacer& SendPacer() const
+  {
+    return pipeline != nullptr ? pipeline->pacer : pacer;
+  }
+
+  KJCSendBatch batch;
+  KJCReceiveBatch commands;
+  KJCWindowAggregate window_aggregate;
+  bool gso_supported { true };
+
+  /* Bounds on the work done between two looks at the socket */
+  static constexpr size_t max_sends_per_turn = 64;
+  static constexpr size_t max_resends_per_turn = 16;
+
+  /* Sessions with samples to send again, served in turn */
+  std::deque<KJCSession*> resend_queue;
+  size_t resend_buffer { 0 };
+  uint32_t resend_rate { 0 };
+  /* Length of idle_sessions that EvictIdleSessions() keeps to */
+  size_t max_idle_sessions { 0 };
+  /* Token bucket for resend_rate: messages that may go out now, up to 10 ms worth */
+  double resend_tokens { 0 };
+  clk::time_point resend_refilled;
+  /* How far ahead of the next deadline a resend may still start; a few sends' worth */
+  static constexpr std::chrono::microseconds resend_slack { 20 };
+
+  /* RANGEs still going out, served in turn, one per peer */
+  std::deque<std::unique_ptr<KJCRangeJob>> range_queue;
+  static constexpr size_t max_ranges = 16;
+  static constexpr uint64_t max_range_samples = 100000000;
+  static constexpr size_t max_range_sends_per_turn = 16;
+  /* Asked for as the socket's SO_SNDBUF with the first range, and what the
+     kernel gave; ranges only send while less than half of it is queued */
+  static constexpr int range_send_buffer = 4 * 1024 * 1024;
+  size_t send_buffer { 0 };
+  /* Waiting for EPOLLOUT before sending more of them */
+  bool range_blocked { false };
+  char range_datagram[max_frame_size];
+
+  /* The stream of --publish, a session of its own outside the table; with
+     several workers only publish_sender sends to the group, while with
+     --publish=local each worker serves its own subscribers */
+  std::shared_ptr<const KJCPublishOptions> publish;
+  bool publish_sender { true };
+  KJCSession publisher;
+  std::vector<KJCSubscriber> subscribers;
+  static constexpr size_t max_subscribers = 1024;
+  struct mmsghdr fanout_headers[KJCSendBatch::max_messages];
+
+  /* The stream of --generate, a session of its own outside the table */
+  std::shared_ptr<const KJCGenerateOptions> generate;
+  KJCSession generated;
+
+  /* Totals over all sessions */
+  uint64_t total_samples_sent { 0 };
+  clk::duration total_lateness { 0 };
+};
+
+/* Runs one KJCSensorServer per worker thread, each with its own SO_REUSEPORT
+ * socket on the same address and port. The kernel hashes each peer to one of
+ * the sockets, so a peer's session always lives on the same worker, and the
+ * workers share nothing. With more than one worker, each thread is pinned to
+ * its own CPU. */
+class KJCWorkerGroup
+{
+public:
+  explicit KJCWorkerGroup(const KJCServerOptions &options = KJCServerOptions { });
+  int Main();
+  /* Binds a socket per worker; with port "0" they all share the first one's ephemeral port */
+  void Bind();
+  /* Serves on the bound sockets until Shutdown() */
+  void Run();
+  /* Makes Run() return; safe from any thread and from signal handlers */
+  void Shutdown();
+  /* Port the workers are bound to, once Bind() has returned */
+  uint16_t Port() const;
+  /* Lateness of every send deadline of the run, over all workers */
+  void PrintJitterSummary(FILE *out) const;
+  /* Sessions the workers still keep, idle ones included, once Run() has returned */
+  size_t SessionCount() const;
+
+private:
+  friend class KJCSensorBench;
+
+  KJCServerOptions options;
+  std::vector<std::unique_ptr<KJCSensorServer>> workers;
+  std::vector<int> sockets;
+};
+
+
+KJCSensorModel::KJCSensorModel()
+{
+  /* For a time t since we started the sensor, f(t) = sin(2*pi*0.05*t), and
+     the same a quarter turn on for milliamps; t in seconds */
+  SetChannel(0, "MV", KJCWaveform::Sine, 0.05, 0, 1000);
+  SetChannel(1, "MA", KJCWaveform::Sine, 0.05, M_PI / 2, 1000);
+  channel_count = 2;
+}
+
+KJCSensorModel KJCSensorModel::Uniform(size_t count)
+{
+  KJCSensorModel model;
+  model.channel_count = std::min(count, max_channels);
+  for (size_t channel = 0; channel < model.channel_count; ++channel)
+  {
+    char name[KJCChannelLabels::max_size];
+    snprintf(name, sizeof(name), "CH%u", unsigned(channel));
+    model.SetChannel(channel, name, KJCWaveform::Sine, 0.05,
+                     (M_PI / 2) * double(channel % 4), 1000);
+  }
+  return model;
+}
+
+void KJCSensorModel::SetChannel(size_t channel, const char *name,
+                                KJCWaveform waveform, double frequency,
+                                double phase, double amplitude)
+{
+  labels.Set(channel, name, strlen(name));
+  waveforms[channel] = waveform;
+  frequencies[channel] = frequency;
+  phases[channel] = phase;
+  amplitudes[channel] = amplitude;
+}
+
+bool KJCSensorModel::ConfigureChannel(const char *specification)
+{
+  unsigned channel;
+  char waveform_name[16];
+  double frequency, phase_degrees, amplitude;
+  int consumed = 0;
+  if (sscanf(specification, "%u,%15[a-z],%lf,%lf,%lf%n", &channel,
+             waveform_name, &frequency, &phase_degrees, &amplitude,
+             &consumed) != 5 || specification[consumed] != '\0'
+      || channel >= channel_count || !(frequency >= 0)
+      || !(fabs(amplitude) <= double(INT32_MAX)) || !std::isfinite(phase_degrees))
+  {
+    return false;
+  }
+  for (KJCWaveform waveform : { KJCWaveform::Sine, KJCWaveform::Square,
+      KJCWaveform::Triangle, KJCWaveform::Sawtooth })
+  {
+    if (strcmp(waveform_name, WaveformName(waveform)) == 0)
+    {
+      waveforms[channel] = waveform;
+      frequencies[channel] = frequency;
+      phases[channel] = phase_degrees * M_PI / 180;
+      amplitudes[channel] = amplitude;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* KJCSensorModel::WaveformName(KJCWaveform waveform)
+{
+  switch (waveform)
+  {
+  case KJCWaveform::Square:
+    return "square";
+  case KJCWaveform::Triangle:
+    return "triangle";
+  case KJCWaveform::Sawtooth:
+    return "sawtooth";
+  default:
+    return "sine";
+  }
+}
+
+double KJCSensorModel::Shape(KJCWaveform waveform, double cycles)
+{
+  switch (waveform)
+  {
+  case KJCWaveform::Square:
+    return cycles - floor(cycles) < 0.5 ? 1.0 : -1.0;
+  case KJCWaveform::Triangle:
+    {
+      double turn = cycles + 0.25 - floor(cycles + 0.25);
+      return 1.0 - 4.0 * fabs(turn - 0.5);
+    }
+  case KJCWaveform::Sawtooth:
+    return 2.0 * (cycles + 0.5 - floor(cycles + 0.5)) - 1.0;
+  default:
+    return sin(2 * M_PI * cycles);
+  }
+}
+
+int32_t KJCSensorModel::Value(size_t channel, double time) const
+{
+  if (waveforms[channel] == KJCWaveform::Sine)
+  {
+    /* Written out as the original two channel code had it, so the default
+       device produces exactly the values it always did */
+    return int32_t(amplitudes[channel]
+        * sin(phases[channel] + 2 * M_PI * frequencies[channel] * time));
+  }
+  double cycles = frequencies[channel] * time + phases[channel] / (2 * M_PI);
+  return int32_t(amplitudes[channel] * Shape(waveforms[channel], cycles));
+}
+
+void KJCChannelLabels::Set(size_t channel, const char *name, size_t name_size)
+{
+  /* Room for the '=' and a terminator */
+  name_size = std::min(name_size, max_size - 2);
+  memcpy(text[channel], name, name_size);
+  text[channel][name_size] = '=';
+  text[channel][name_size + 1] = '\0';
+  size[channel] = uint8_t(name_size + 1);
+}
+
+KJCChannelSelection KJCChannelSelection::FromMask(uint64_t mask)
+{
+  KJCChannelSelection selection;
+  for (; mask != 0; mask &= mask - 1)
+  {
+    selection.channels[selection.count++] = uint8_t(__builtin_ctzll(mask));
+  }
+  return selection;
+}
+
+void KJCSensorBlockGenerator::Configure(const KJCSensorModel &model,
+                                        const KJCChannelSelection &selection,
+                                        clk::duration step)
+{
+  time_step = step;
+  waveforms.clear();
+  frequencies.clear();
+  amplitudes.clear();
+  phase_turns.clear();
+  phase_real.clear();
+  phase_imaginary.clear();
+  table_of_channel.clear();
+  table_frequencies.clear();
+  rotation_real.clear();
+  rotation_imaginary.clear();
+  for (size_t k = 0; k < selection.count; ++k)
+  {
+    size_t channel = selection.channels[k];
+    double frequency = model.frequencies[channel];
+    waveforms.push_back(model.waveforms[channel]);
+    frequencies.push_back(frequency);
+    amplitudes.push_back(model.amplitudes[channel]);
+    phase_turns.push_back(model.phases[channel] / (2 * M_PI));
+    phase_real.push_back(cos(model.phases[channel]));
+    phase_imaginary.push_back(sin(model.phases[channel]));
+
+    /* Sines of the same frequency share a table; they differ only by phase */
+    size_t table = std::find(table_frequencies.begin(), table_frequencies.end(),
+                             frequency) - table_frequencies.begin();
+    if (model.waveforms[channel] == KJCWaveform::Sine
+        && table == table_frequencies.size())
+    {
+      table_frequencies.push_back(frequency);
+      for (size_t i = 0; i < block_size; ++i)
+      {
+        double offset = std::chrono::duration<double> { step * i }.count();
+        double angle = 2 * M_PI * frequency * offset;
+        rotation_real.push_back(cos(angle));
+        rotation_imaginary.push_back(sin(angle));
+      }
+    }
+    table_of_channel.push_back(uint8_t(table));
+  }
+}
+
+void KJCSensorBlockGenerator::Generate(clk::duration first_time, size_t count,
+                                       int32_t *values, size_t stride) const
+{
+  double seed_real[KJCSensorModel::max_channels];
+  double seed_imaginary[KJCSensorModel::max_channels];
+  for (size_t block_start = 0; block_start < count; block_start += block_size)
+  {
+    /* Same argument as Value() computes, so the seed matches it exactly */
+    double time = std::chrono::duration<double, std::ratio<1,1>> { first_time
+        + time_step * block_start }.count();
+    for (size_t table = 0; table < table_frequencies.size(); ++table)
+    {
+      double argument = 2 * M_PI * table_frequencies[table] * time;
+      seed_real[table] = cos(argument);
+      seed_imaginary[table] = sin(argument);
+    }
+    size_t samples = std::min(block_size, count - block_start);
+    for (size_t k = 0; k < waveforms.size(); ++k)
+    {
+      int32_t *block_values = values + k * stride + block_start;
+      double amplitude = amplitudes[k];
+      if (waveforms[k] != KJCWaveform::Sine)
+      {
+        for (size_t i = 0; i < samples; ++i)
+        {
+          double sample_time = std::chrono::duration<double, std::ratio<1,1>> {
+              first_time + time_step * (block_start + i) }.count();
+          block_values[i] = int32_t(amplitude * KJCSensorModel::Shape(
+              waveforms[k], frequencies[k] * sample_time + phase_turns[k]));
+        }
+        continue;
+      }
+      size_t table = table_of_channel[k];
+      const double *table_real = &rotation_real[table * block_size];
+      const double *table_imaginary = &rotation_imaginary[table * block_size];
+      double start_real = seed_real[table];
+      double start_imaginary = seed_imaginary[table];
+      double turn_real = phase_real[k];
+      double turn_imaginary = phase_imaginary[k];
+      for (size_t i = 0; i < samples; ++i)
+      {
+        double real = start_real * table_real[i]
+            - start_imaginary * table_imaginary[i];
+        double imaginary = start_real * table_imaginary[i]
+            + start_imaginary * table_real[i];
+        block_values[i] = int32_t(amplitude
+            * (turn_real * imaginary + turn_imaginary * real));
+      }
+    }
+  }
+}
+
+void KJCWindowAggregate::Reset(size_t channels)
+{
+  for (size_t k = 0; k < channels; ++k)
+  {
+    min[k] = std::numeric_limits<int32_t>::max();
+    max[k] = std::numeric_limits<int32_t>::min();
+    sum[k] = 0;
+    sum_squares[k] = 0;
+  }
+  count = 0;
+}
+
+void KJCWindowAggregate::Add(size_t channels, size_t samples)
+{
+  for (size_t k = 0; k < channels; ++k)
+  {
+    AddRow(k, samples);
+  }
+  count += samples;
+}
+
+void KJCWindowAggregate::AddRow(size_t channel, size_t samples)
+{
+  const int32_t *values = rows[channel];
+  int32_t low = min[channel];
+  int32_t high = max[channel];
+  int64_t total = 0;
+  double squares[lanes] = { };
+  size_t i = 0;
+  /* Loops of a fixed length vectorize at -O2; the tail is done one by one */
+  for (; i + block <= samples; i += block)
+  {
+    const int32_t *block_values = values + i;
+    for (size_t j = 0; j < block; ++j)
+    {
+      low = std::min(low, block_values[j]);
+      high = std::max(high, block_values[j]);
+      total += block_values[j];
+    }
+    for (size_t j = 0; j < block; j += lanes)
+    {
+      for (size_t lane = 0; lane < lanes; ++lane)
+      {
+        double value = block_values[j + lane];
+        squares[lane] += value * value;
+      }
+    }
+  }
+  for (; i < samples; ++i)
+  {
+    low = std::min(low, values[i]);
+    high = std::max(high, values[i]);
+    total += values[i];
+    squares[0] += double(values[i]) * double(values[i]);
+  }
+  min[channel] = low;
+  max[channel] = high;
+  sum[channel] += total;
+  for (size_t lane = 0; lane < lanes; ++lane)
+  {
+    sum_squares[channel] += squares[lane];
+  }
+}
+
+int32_t KJCWindowAggregate::Mean(size_t channel) const
+{
+  return int32_t(llround(double(sum[channel]) / double(count)));
+}
+
+uint32_t KJCWindowAggregate::Rms(size_t channel) const
+{
+  return uint32_t(llround(sqrt(sum_squares[channel] / double(count))));
+}
+
+bool KJCTrace::ValidName(std::string_view name)
+{
+  if (name.empty() || name.size() > sizeof(KJCTrace::name) - 1)
+  {
+    return false;
+  }
+  for (char c : name)
+  {
+    if (!isalnum((unsigned char) c) && c != '_' && c != '.' && c != '-')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static uint64_t ReadLittleEndian(const char *bytes, size_t size)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; ++i)
+  {
+    value |= uint64_t((unsigned char) bytes[i]) << (8 * i);
+  }
+  return value;
+}
+
+std::unique_ptr<KJCTrace> KJCTrace::Open(const char *name, const char *path)
+{
+  if (!ValidName(name))
+  {
+    fprintf(stderr, "Bad trace name: %s\n", name);
+    return nullptr;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Can't open trace %s. (%d)\n", path, errno);
+    return nullptr;
+  }
+  struct stat status;
+  if (fstat(fd, &status) < 0 || size_t(status.st_size) < header_size)
+  {
+    fprintf(stderr, "Trace %s is too short to have a header.\n", path);
+    close(fd);
+    return nullptr;
+  }
+  void *mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  /* The mapping keeps the file open */
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "mmap() of trace %s failed. (%d)\n", path, errno);
+    return nullptr;
+  }
+
+  std::unique_ptr<KJCTrace> trace { new KJCTrace };
+  trace->mapping = (const char*) mapping;
+  trace->mapping_size = status.st_size;
+  snprintf(trace->name, sizeof(trace->name), "%s", name);
+  const char *header = trace->mapping;
+  uint64_t trace_version = ReadLittleEndian(header + 8, 4);
+  trace->channel_count = ReadLittleEndian(header + 12, 4);
+  uint64_t period_ns = ReadLittleEndian(header + 16, 8);
+  trace->sample_count = ReadLittleEndian(header + 24, 8);
+  trace->period = std::chrono::nanoseconds { period_ns };
+  trace->data_offset = header_size + name_size * trace->channel_count;
+  trace->row_size = sizeof(int32_t) * trace->channel_count;
+  const char *problem = nullptr;
+  if (memcmp(header, "KJCTRACE", 8) != 0)
+  {
+    problem = "no KJCTRACE magic";
+  }
+  else if (trace_version != version)
+  {
+    problem = "unsupported version";
+  }
+  else if (trace->channel_count == 0
+      || trace->channel_count > KJCChannelLabels::max_channels)
+  {
+    problem = "bad channel count";
+  }
+  else if (period_ns == 0 || period_ns > uint64_t(INT64_MAX))
+  {
+    problem = "bad sample period";
+  }
+  else if (trace->data_offset > trace->mapping_size || trace->sample_count == 0
+      || trace->sample_count > (trace->mapping_size - trace->data_offset)
+          / trace->row_size)
+  {
+    problem = "sample count doesn't match the file size";
+  }
+  if (problem != nullptr)
+  {
+    fprintf(stderr, "Trace %s is unusable: %s.\n", path, problem);
+    return nullptr;
+  }
+  for (size_t channel = 0; channel < trace->channel_count; ++channel)
+  {
+    const char *channel_name = header + header_size + name_size * channel;
+    size_t size = strnlen(channel_name, name_size);
+    if (size == 0)
+    {
+      char fallback[KJCChannelLabels::max_size];
+      snprintf(fallback, sizeof(fallback), "CH%u", unsigned(channel));
+      trace->labels.Set(channel, fallback, strlen(fallback));
+    }
+    else
+    {
+      trace->labels.Set(channel, channel_name, size);
+    }
+  }
+  if (madvise(mapping, trace->mapping_size, MADV_SEQUENTIAL) < 0)
+  {
+    fprintf(stderr, "madvise() of trace %s failed. (%d)\n", path, errno);
+  }
+  printf("Trace %s: %zu channels, %" PRIu64 " samples every %" PRIu64 " ns from %s\n",
+         trace->name, trace->channel_count, trace->sample_count, period_ns, path);
+  return trace;
+}
+
+KJCTrace::~KJCTrace()
+{
+  if (mapping != nullptr)
+  {
+    munmap((void*) mapping, mapping_size);
+  }
+}
+
+void KJCTrace::Prefetch(uint64_t sample, uint64_t &prefetched_until) const
+{
+  uint64_t readahead_samples = std::max<uint64_t>(1, readahead_bytes / row_size);
+  /* Ask again once the reader is half way into what was asked for last */
+  if (sample + readahead_samples / 2 < prefetched_until)
+  {
+    return;
+  }
+  uint64_t from = std::max(sample, prefetched_until);
+  uint64_t to = std::min(sample_count, sample + readahead_samples);
+  if (from < to)
+  {
+    static const uintptr_t page_mask = uintptr_t(sysconf(_SC_PAGESIZE)) - 1;
+    uintptr_t begin = uintptr_t(Row(from)) & ~page_mask;
+    uintptr_t end = uintptr_t(Row(to));
+    if (madvise((void*) begin, end - begin, MADV_WILLNEED) < 0)
+    {
+      fprintf(stderr, "madvise() of trace %s failed. (%d)\n", name, errno);
+    }
+  }
+  prefetched_until = to;
+}
+
+KJCRecordRing::KJCRecordRing(size_t slot_count) :
+    slots(std::bit_ceil(std::max<size_t>(slot_count, 2))), mask(slots.size() - 1)
+{
+}
+
+KJCRecord* KJCRecordRing::Reserve(size_t index)
+{
+  uint64_t position = head.load(std::memory_order_relaxed) + index;
+  if (position - cached_tail >= slots.size())
+  {
+    cached_tail = tail.load(std::memory_order_acquire);
+    if (position - cached_tail >= slots.size())
+    {
+      return nullptr;
+    }
+  }
+  return &slots[position & mask];
+}
+
+void KJCRecordRing::Publish(size_t count)
+{
+  head.store(head.load(std::memory_order_relaxed) + count,
+             std::memory_order_release);
+}
+
+size_t KJCRecordRing::Readable() const
+{
+  return head.load(std::memory_order_acquire)
+      - tail.load(std::memory_order_relaxed);
+}
+
+const KJCRecord& KJCRecordRing::Peek(size_t index) const
+{
+  return slots[(tail.load(std::memory_order_relaxed) + index) & mask];
+}
+
+void KJCRecordRing::Release(size_t count)
+{
+  tail.store(tail.load(std::memory_order_relaxed) + count,
+             std::memory_order_release);
+}
+
+std::unique_ptr<KJCRecorder> KJCRecorder::Open(const char *path)
+{
+  std::unique_ptr<KJCRecorder> recorder { new KJCRecorder };
+  snprintf(recorder->path, sizeof(recorder->path), "%s", path);
+  recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (recorder->fd < 0)
+  {
+    fprintf(stderr, "Can't create recording %s. (%d)\n", path, errno);
+    return nullptr;
+  }
+  recorder->chunk = (char*) aligned_alloc(4096, chunk_size);
+  if (recorder->chunk == nullptr)
+  {
+    fprintf(stderr, "Can't allocate the recorder's buffer.\n");
+    return nullptr;
+  }
+  static const char magic[8] = { 'K', 'J', 'C', 'R', 'E', 'C', 0, 1 };
+  recorder->Append(magic, sizeof(magic));
+  recorder->writer = std::thread { &KJCRecorder::Run, recorder.get() };
+  return recorder;
+}
+
+KJCRecorder::~KJCRecorder()
+{
+  Close();
+  free(chunk);
+}
+
+void KJCRecorder::Close()
+{
+  if (writer.joinable())
+  {
+    running = false;
+    writer.join();
+  }
+  if (fd >= 0)
+  {
+    WriteOut(chunk, chunk_used);
+    close(fd);
+    fd = -1;
+    printf("Recorded %" PRIu64 " samples of %" PRIu64 " streams, %" PRIu64
+           " bytes, to %s; dropped %" PRIu64 "\n", samples_written.load(),
+           streams_written.load(), bytes_written.load(), path, Dropped());
+  }
+}
+
+KJCRecordRing* KJCRecorder::AddRing()
+{
+  std::lock_guard<std::mutex> lock { rings_mutex };
+  rings.push_back(std::make_unique<KJCRecordRing>(ring_slots));
+  return rings.back().get();
+}
+
+uint64_t KJCRecorder::Dropped()
+{
+  std::lock_guard<std::mutex> lock { rings_mutex };
+  uint64_t dropped = 0;
+  for (std::unique_ptr<KJCRecordRing> &ring : rings)
+  {
+    dropped += ring->Dropped();
+  }
+  return dropped;
+}
+
+/* Empties the rings until told to stop, and once more after that so nothing
+   published before the loops ended is lost. Waits a little whenever they are
+   all empty: the rings are large, so this costs latency, not records. */
+void KJCRecorder::Run()
+{
+  std::vector<KJCRecordRing*> current_rings;
+  bool last_pass = false;
+  while (true)
+  {
+    if (!running)
+    {
+      last_pass = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock { rings_mutex };
+      current_rings.clear();
+      for (std::unique_ptr<KJCRecordRing> &ring : rings)
+      {
+        current_rings.push_back(ring.get());
+      }
+    }
+    size_t records = 0;
+    for (KJCRecordRing *ring : current_rings)
+    {
+      size_t written;
+      while ((written = WriteBlock(*ring)) > 0)
+      {
+        records += written;
+      }
+    }
+    if (last_pass)
+    {
+      return;
+    }
+    if (records == 0)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
+    }
+  }
+}
+
+static void PutLittleEndian(std::vector<char> &out, uint64_t value, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; ++i)
+  {
+    out.push_back(char(value >> (8 * i)));
+  }
+}
+
+/* Small deltas of either sign take a byte or two */
+static void PutZigZagVarint(std::vector<char> &out, int64_t value)
+{
+  uint64_t zigzag = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+  while (zigzag >= 0x80)
+  {
+    out.push_back(char(zigzag | 0x80));
+    zigzag >>= 7;
+  }
+  out.push_back(char(zigzag));
+}
+
+size_t KJCRecorder::WriteBlock(KJCRecordRing &ring)
+{
+  size_t readable = ring.Readable();
+  if (readable == 0)
+  {
+    return 0;
+  }
+  /* Kind and body size come first; the size is filled in at the end */
+  block.clear();
+  size_t count = 0;
+  const KJCRecord &first = ring.Peek(0);
+  if (first.channel_count == 0)
+  {
+    /* Stream description; the producer publishes all of its slots at once */
+    size_t text_size = first.time_ms;
+    count = std::max<size_t>(1, (text_size + KJCRecord::text_capacity - 1)
+        / KJCRecord::text_capacity);
+    PutLittleEndian(block, 2, 8);
+    PutLittleEndian(block, first.stream, 4);
+    for (size_t i = 0; i < count; ++i)
+    {
+      size_t piece = std::min(text_size - i * KJCRecord::text_capacity,
+                              KJCRecord::text_capacity);
+      const char *text = ring.Peek(i).text;
+      block.insert(block.end(), text, text + piece);
+    }
+    streams_written++;
+  }
+  else
+  {
+    while (count < std::min(readable, max_block_records)
+        && ring.Peek(count).channel_count != 0)
+    {
+      count++;
+    }
+    PutLittleEndian(block, 1, 8);
+    PutLittleEndian(block, count, 4);
+    PutLittleEndian(block, ring.Dropped(), 8);
+    PutLittleEndian(block, first.sent_ns, 8);
+    int64_t previous_sent = first.sent_ns;
+    uint64_t previous_time = 0;
+    size_t most_channels = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+      const KJCRecord &record = ring.Peek(i);
+      PutZigZagVarint(block, record.sent_ns - previous_sent);
+      previous_sent = record.sent_ns;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+      PutLittleEndian(block, ring.Peek(i).stream, 4);
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+      const KJCRecord &record = ring.Peek(i);
+      PutZigZagVarint(block, int64_t(record.time_ms - previous_time));
+      previous_time = record.time_ms;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+      block.push_back(char(ring.Peek(i).channel_count));
+      most_channels = std::max<size_t>(most_channels, ring.Peek(i).channel_count);
+    }
+    for (size_t k = 0; k < most_channels; ++k)
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+        const KJCRecord &record = ring.Peek(i);
+        if (k < record.channel_count)
+        {
+          PutLittleEndian(block, uint32_t(record.values[k]), 4);
+        }
+      }
+    }
+    samples_written += count;
+  }
+  ring.Release(count);
+  uint32_t body_size = block.size() - 8;
+  for (size_t i = 0; i < 4; ++i)
+  {
+    block[4 + i] = char(body_size >> (8 * i));
+  }
+  Append(block.data(), block.size());
+  return count;
+}
+
+void KJCRecorder::Append(const char *bytes, size_t size)
+{
+  while (size > 0)
+  {
+    size_t piece = std::min(size, chunk_size - chunk_used);
+    memcpy(chunk + chunk_used, bytes, piece);
+    chunk_used += piece;
+    bytes += piece;
+    size -= piece;
+    if (chunk_used == chunk_size)
+    {
+      WriteOut(chunk, chunk_size);
+      chunk_used = 0;
+    }
+  }
+}
+
+void KJCRecorder::WriteOut(const char *bytes, size_t size)
+{
+  while (size > 0 && !failed)
+  {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (written < 0)
+    {
+      /* Keep draining the rings so the loops carry on; the rest is lost */
+      fprintf(stderr, "Error writing recording %s. Errno (%d)\n", path, errno);
+      failed = true;
+      return;
+    }
+    bytes += written;
+    size -= written;
+    bytes_written += written;
+  }
+}
+
+std::unique_ptr<KJCStreamFile> KJCStreamFile::Open(const char *path)
+{
+  std::unique_ptr<KJCStreamFile> file { new KJCStreamFile };
+  snprintf(file->path, sizeof(file->path), "%s", path);
+  file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (file->fd < 0)
+  {
+    fprintf(stderr, "Can't create output %s. (%d)\n", path, errno);
+    return nullptr;
+  }
+  file->chunk.resize(chunk_size);
+  return file;
+}
+
+KJCStreamFile::~KJCStreamFile()
+{
+  Close();
+}
+
+bool KJCStreamFile::Close()
+{
+  if (fd >= 0)
+  {
+    WriteOut(chunk.data(), chunk_used);
+    chunk_used = 0;
+    if (close(fd) < 0 && !failed)
+    {
+      fprintf(stderr, "Error closing output %s. Errno (%d)\n", path, errno);
+      failed = true;
+    }
+    fd = -1;
+    printf("Wrote %" PRIu64 " messages, %" PRIu64 " bytes, to %s\n",
+           messages_written, bytes_written, path);
+  }
+  return !failed;
+}
+
+bool KJCStreamFile::Write(const char *bytes, size_t size, bool text)
+{
+  if (!text)
+  {
+    char length[sizeof(uint32_t)];
+    for (size_t i = 0; i < sizeof(length); ++i)
+    {
+      length[i] = char(size >> (8 * i));
+    }
+    Append(length, sizeof(length));
+  }
+  Append(bytes, size);
+  if (text)
+  {
+    Append("\n", 1);
+  }
+  messages_written++;
+  return !failed;
+}
+
+void KJCStreamFile::Append(const char *bytes, size_t size)
+{
+  while (size > 0)
+  {
+    size_t piece = std::min(size, chunk_size - chunk_used);
+    memcpy(chunk.data() + chunk_used, bytes, piece);
+    chunk_used += piece;
+    bytes += piece;
+    size -= piece;
+    if (chunk_used == chunk_size)
+    {
+      WriteOut(chunk.data(), chunk_size);
+      chunk_used = 0;
+    }
+  }
+}
+
+void KJCStreamFile::WriteOut(const char *bytes, size_t size)
+{
+  while (size > 0 && !failed)
+  {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (written < 0)
+    {
+      fprintf(stderr, "Error writing output %s. Errno (%d)\n", path, errno);
+      failed = true;
+      return;
+    }
+    bytes += written;
+    size -= written;
+    bytes_written += written;
+  }
+}
+
+KJCSamplePipeline::KJCSamplePipeline(size_t depth, KJCPacingMode mode) :
+    pacer(mode), slots(std::bit_ceil(std::clamp<size_t>(depth, 1, max_depth))),
+    mask(slots.size() - 1)
+{
+  generator_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  transmitter_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (generator_fd < 0 || transmitter_fd < 0)
+  {
+    fprintf(stderr, "eventfd() failed. (%d)\n", errno);
+    exit(1);
+  }
+}
+
+KJCSamplePipeline::~KJCSamplePipeline()
+{
+  close(generator_fd);
+  close(transmitter_fd);
+}
+
+void KJCSamplePipeline::Signal(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0)
+  {
+    /* Only fails if the counter is full, and then it is readable anyway */
+  }
+}
+
+void KJCSamplePipeline::Drain(int fd)
+{
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+  {
+    fprintf(stderr, "Error on read() of eventfd. Errno (%d)\n", errno);
+  }
+}
+
+KJCPipelineSlot* KJCSamplePipeline::Reserve()
+{
+  uint64_t position = head.load(std::memory_order_relaxed);
+  if (position - reclaimed < slots.size())
+  {
+    return &slots[position & mask];
+  }
+  /* The loop reclaims before it generates, so the ring really is full. Ask
+     for a wakeup, then look at tail once more: if the transmitter freed half
+     the ring before it could see the request, wake ourselves. */
+  ring_full.store(ring_full.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  generator_waiting.store(true);
+  if (position - tail.load() <= slots.size() / 2
+      && generator_waiting.exchange(false))
+  {
+    Signal(generator_fd);
+  }
+  return nullptr;
+}
+
+void KJCSamplePipeline::Publish()
+{
+  head.store(head.load(std::memory_order_relaxed) + 1);
+  if (transmitter_waiting.load() && transmitter_waiting.exchange(false))
+  {
+    Signal(transmitter_fd);
+  }
+}
+
+KJCPipelineSlot* KJCSamplePipeline::Reclaim()
+{
+  if (reclaimed == tail.load(std::memory_order_acquire))
+  {
+    return nullptr;
+  }
+  return &slots[reclaimed++ & mask];
+}
+
+void KJCSamplePipeline::GeneratorWoken()
+{
+  Drain(generator_fd);
+}
+
+KJCPipelineSlot* KJCSamplePipeline::Front()
+{
+  uint64_t position = tail.load(std::memory_order_relaxed);
+  if (position == head.load())
+  {
+    return nullptr;
+  }
+  return &slots[position & mask];
+}
+
+void KJCSamplePipeline::Release(bool wake_generator)
+{
+  uint64_t position = tail.load(std::memory_order_relaxed) + 1;
+  tail.store(position);
+  /* A loop waiting for space gets half a ring at once, not a slot per wakeup */
+  bool half_free = head.load(std::memory_order_relaxed) - position
+      <= slots.size() / 2;
+  if (wake_generator)
+  {
+    generator_waiting.store(false);
+    Signal(generator_fd);
+  }
+  else if (half_free && generator_waiting.load()
+      && generator_waiting.exchange(false))
+  {
+    Signal(generator_fd);
+  }
+}
+
+void KJCSamplePipeline::WantPublish(bool want)
+{
+  transmitter_waiting.store(want);
+}
+
+void KJCSamplePipeline::TransmitterWoken()
+{
+  Drain(transmitter_fd);
+}
+
+void KJCSamplePipeline::Stop()
+{
+  Signal(transmitter_fd);
+}
+
+void KJCSensorServer::SetupSocket(int *socket_listen, const char *name,
+                                  const char *service, bool reuse_port)
+{
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo *bind_address;
+  int result = getaddrinfo(name, service, &hints, &bind_address);
+  if (result != 0)
+  {
+    fprintf(stderr, "getaddrinfo() failed. (%s)\n", gai_strerror(result));
+    exit(1);
+  }
+
+  /* Create the socket */
+  *socket_listen = socket(bind_address->ai_family, bind_address->ai_socktype,
+                          bind_address->ai_protocol);
+  if (*socket_listen < 0)
+  {
+    fprintf(stderr, "socket() failed. (%d)\n", errno);
+    exit(1);
+  }
+
+  int enable = 1;
+  if (reuse_port
+      && setsockopt(*socket_listen, SOL_SOCKET, SO_REUSEPORT, &enable,
+                    sizeof(enable)) < 0)
+  {
+    fprintf(stderr, "setsockopt(SO_REUSEPORT) failed. (%d)\n", errno);
+    exit(1);
+  }
+
+  printf("Binding socket to local address...\n");
+  if (bind(*socket_listen, bind_address->ai_addr, bind_address->ai_addrlen))
+  {
+    fprintf(stderr, "bind() failed. (%d)\n", errno);
+    exit(1);
+  }
+  freeaddrinfo(bind_address);
+}
+
+void KJCSensorServer::Cleanup(int socket)
+{
+  printf("Closing listening socket...\n");
+  close(socket);
+  printf("Finished.\n");
+}
+
+void KJCLatencyHistogram::Record(clk::duration latency)
+{
+  uint64_t nanoseconds = latency.count() < 0 ? 0 :
+      std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+  /* Values below sub_buckets get a bucket each; above that, the exponent
+     picks the group and the next bits below the leading one the step in it */
+  int bucket;
+  if (nanoseconds < uint64_t(sub_buckets))
+  {
+    bucket = int(nanoseconds);
+  }
+  else
+  {
+    int exponent = 63 - __builtin_clzll(nanoseconds);
+    bucket = (exponent - sub_bucket_bits + 1) * sub_buckets
+        + int((nanoseconds >> (exponent - sub_bucket_bits)) & (sub_buckets - 1));
+  }
+  buckets[bucket < bucket_count ? bucket : bucket_count - 1]++;
+  count++;
+  total_nanoseconds += nanoseconds;
+  if (nanoseconds > max_nanoseconds)
+  {
+    max_nanoseconds = nanoseconds;
+  }
+}
+
+void KJCLatencyHistogram::Add(const KJCLatencyHistogram &other)
+{
+  for (int b = 0; b < bucket_count; ++b)
+  {
+    buckets[b] += other.buckets[b];
+  }
+  count += other.count;
+  total_nanoseconds += other.total_nanoseconds;
+  max_nanoseconds = std::max(max_nanoseconds, other.max_nanoseconds);
+}
+
+uint64_t KJCLatencyHistogram::PercentileNanoseconds(double percentile) const
+{
+  uint64_t wanted = uint64_t(ceil(double(count) * percentile / 100.0));
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < bucket_count; ++bucket)
+  {
+    seen += buckets[bucket];
+    if (seen >= wanted && seen > 0)
+    {
+      /* Largest value that lands in this bucket; don't report more than we've seen */
+      uint64_t bound;
+      if (bucket < sub_buckets)
+      {
+        bound = bucket;
+      }
+      else
+      {
+        int shift = bucket / sub_buckets - 1;
+        bound = ((uint64_t(sub_buckets + bucket % sub_buckets) + 1) << shift) - 1;
+      }
+      return bound < max_nanoseconds ? bound : max_nanoseconds;
+    }
+  }
+  return max_nanoseconds;
+}
+
+double KJCLatencyHistogram::MeanNanoseconds() const
+{
+  return count == 0 ? 0.0 : double(total_nanoseconds) / double(count);
+}
+
+bool KJCTxTimestamps::Enable(int socket)
+{
+  /* Software timestamps as the datagram leaves for the device, by number and
+     without the datagram itself */
+  unsigned flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+      | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+  if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+  {
+    fprintf(stderr, "setsockopt(SO_TIMESTAMPING) failed. (%d)\n", errno);
+    return false;
+  }
+  /* Sends before this, e.g. the reply to a START, weren't numbered */
+  next_key = 0;
+  return true;
+}
+
+void KJCTxTimestamps::Expect(KJCSession &session, uint32_t first_key,
+                             clk::time_point scheduled)
+{
+  for (uint32_t key = first_key; key != next_key; ++key)
+  {
+    Pending &entry = pending[key % capacity];
+    if (entry.session != nullptr)
+    {
+      lost++;
+    }
+    entry = Pending { key, &session, session.start_timepoint, scheduled };
+  }
+}
+
+void KJCTxTimestamps::Forget(const KJCSession &session)
+{
+  for (Pending &entry : pending)
+  {
+    if (entry.session == &session)
+    {
+      entry.session = nullptr;
+    }
+  }
+}
+
+void KJCTxTimestamps::Drain(int socket)
+{
+  /* The kernel stamps with CLOCK_REALTIME, the schedule is on the steady clock */
+  struct timespec realtime;
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  clk::duration realtime_offset = std::chrono::seconds { realtime.tv_sec }
+      + std::chrono::nanoseconds { realtime.tv_nsec } - clk::now().time_since_epoch();
+  int received;
+  do
+  {
+    for (size_t i = 0; i < max_messages; ++i)
+    {
+      memset(&headers[i], 0, sizeof(headers[i]));
+      headers[i].msg_hdr.msg_control = controls[i];
+      headers[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+    received = recvmmsg(socket, headers, max_messages, MSG_ERRQUEUE | MSG_DONTWAIT,
+                        nullptr);
+    if (received < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        fprintf(stderr, "Error on recvmmsg(MSG_ERRQUEUE). Errno (%d)\n", errno);
+      }
+      return;
+    }
+    for (int i = 0; i < received; ++i)
+    {
+      /* A timestamp comes as two control messages: the time, and the number
+         in an extended error of origin SO_EE_ORIGIN_TIMESTAMPING */
+      bool stamped = false;
+      bool numbered = false;
+      struct scm_timestamping stamp;
+      struct sock_extended_err error;
+      for (struct cmsghdr *header = CMSG_FIRSTHDR(&headers[i].msg_hdr);
+          header != nullptr; header = CMSG_NXTHDR(&headers[i].msg_hdr, header))
+      {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPING)
+        {
+          memcpy(&stamp, CMSG_DATA(header), sizeof(stamp));
+          stamped = true;
+        }
+        else if ((header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+            || (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
+        {
+          memcpy(&error, CMSG_DATA(header), sizeof(error));
+          numbered = error.ee_errno == ENOMSG
+              && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+        }
+      }
+      Pending &entry = pending[numbered ? error.ee_data % capacity : 0];
+      if (!stamped || !numbered || entry.session == nullptr
+          || entry.key != error.ee_data)
+      {
+        /* Not a send of samples, or one we've given up on */
+        continue;
+      }
+      clk::time_point departed { std::chrono::seconds { stamp.ts[0].tv_sec }
+          + std::chrono::nanoseconds { stamp.ts[0].tv_nsec } - realtime_offset };
+      departure.Record(departed - entry.scheduled);
+#if KJC_ENABLE_STATS
+      if (entry.session->start_timepoint == entry.stream_start)
+      {
+        entry.session->stats.departure.Record(departed - entry.scheduled);
+      }
+#endif
+      entry.session = nullptr;
+    }
+  }
+  while (received == int(max_messages));
+}
+
+void KJCResendRing::Allocate(size_t size)
+{
+  if (size != capacity)
+  {
+    bytes.reset(size > 0 ? new char[size] : nullptr);
+    capacity = size;
+    /* The smallest messages are a couple of dozen bytes */
+    messages.assign(size > 0 ? size / 32 + 1 : 0, Message { });
+  }
+  Clear();
+}
+
+void KJCResendRing::Store(uint64_t first, uint32_t count, const char *data,
+                          size_t size)
+{
+  if (size > capacity)
+  {
+    return;
+  }
+  /* A message never wraps around; the space at the end is left unused */
+  if (capacity - head < size)
+  {
+    head = 0;
+  }
+  /* Messages lie in the ring in the order they were stored, so the ones in
+     the way are always the oldest */
+  while (oldest != next)
+  {
+    const Message &message = messages[oldest % messages.size()];
+    bool overlaps = message.offset < head + size && head < message.offset + message.size;
+    if (!overlaps && next - oldest < messages.size())
+    {
+      break;
+    }
+    oldest++;
+  }
+  memcpy(bytes.get() + head, data, size);
+  messages[next % messages.size()] = Message { first, count, uint32_t(size), head };
+  next++;
+  head += size;
+}
+
+const KJCResendRing::Message* KJCResendRing::Find(uint64_t sample) const
+{
+  /* The first message that ends after sample; first only grows */
+  uint64_t low = oldest;
+  uint64_t high = next;
+  while (low < high)
+  {
+    uint64_t middle = low + (high - low) / 2;
+    const Message &message = messages[middle % messages.size()];
+    if (message.first + message.count <= sample)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low == next ? nullptr : &messages[low % messages.size()];
+}
+
+static struct timespec ToTimespec(const clk::time_point &timepoint)
+{
+  /* steady_clock is CLOCK_MONOTONIC, so its epoch is the one the kernel timers use */
+  auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      timepoint.time_since_epoch()).count();
+  struct timespec result;
+  result.tv_sec = nanoseconds / 1000000000;
+  result.tv_nsec = nanoseconds % 1000000000;
+  return result;
+}
+
+static std::chrono::nanoseconds ThreadCpuTime()
+{
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  return std::chrono::seconds { cpu.tv_sec } + std::chrono::nanoseconds {
+      cpu.tv_nsec };
+}
+
+KJCPacer::KJCPacer(KJCPacingMode mode) :
+    mode(mode)
+{
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (timer_fd < 0)
+  {
+    fprintf(stderr, "timerfd_create() failed. (%d)\n", errno);
+    exit(1);
+  }
+  switch (mode)
+  {
+  case KJCPacingMode::Hybrid:
+    {
+      /* We get the linux kernel tick rate from HZ (included in <asm/param.h>), turn it into a duration,
+       and multiply by 2 to get a duration that we're pretty sure will be larger than our sleep time */
+      std::chrono::duration<double> tick_interval { 1.0 / double(HZ) };
+      margin = std::chrono::duration_cast<clk::duration>(2.0 * tick_interval);
+    }
+    break;
+  case KJCPacingMode::Nanosleep:
+    /* Enough for the timer slack, so the final sleep is a short one */
+    margin = std::chrono::microseconds { 100 };
+    break;
+  default:
+    break;
+  }
+  ResetReport();
+}
+
+KJCPacer::~KJCPacer()
+{
+  close(timer_fd);
+}
+
+void KJCPacer::SetTimer(const struct timespec &value)
+{
+  struct itimerspec timer;
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value = value;
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, nullptr) < 0)
+  {
+    fprintf(stderr, "timerfd_settime() failed. (%d)\n", errno);
+  }
+}
+
+void KJCPacer::Arm(const clk::time_point &deadline)
+{
+  if (deadline == armed_for)
+  {
+    return;
+  }
+  armed_for = deadline;
+  struct timespec value = ToTimespec(deadline - margin);
+  if (value.tv_sec <= 0 && value.tv_nsec <= 0)
+  {
+    /* A zero value would disarm the timer instead */
+    value.tv_sec = 0;
+    value.tv_nsec = 1;
+  }
+  SetTimer(value);
+}
+
+void KJCPacer::UseRealTimeMargin()
+{
+  if (mode == KJCPacingMode::Hybrid)
+  {
+    margin = std::chrono::microseconds { 50 };
+  }
+}
+
+void KJCPacer::Disarm()
+{
+  if (armed_for == clk::time_point::min())
+  {
+    return;
+  }
+  armed_for = clk::time_point::min();
+  SetTimer(timespec { 0, 0 });
+}
+
+void KJCPacer::Acknowledge()
+{
+  uint64_t expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+  {
+    fprintf(stderr, "Error on read() of timerfd. Errno (%d)\n", errno);
+  }
+}
+
+bool KJCPacer::FinishWait(const clk::time_point &deadline)
+{
+  if (mode == KJCPacingMode::Nanosleep)
+  {
+    struct timespec wakeup = ToTimespec(deadline);
+    int result;
+    while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup,
+                                     nullptr)) == EINTR)
+    {
+    }
+    if (result != 0)
+    {
+      fprintf(stderr, "clock_nanosleep() failed. (%d)\n", result);
+    }
+  }
+  clk::time_point now = clk::now();
+  if (now < deadline)
+  {
+    return false;
+  }
+  lateness.Record(now - deadline);
+  run_lateness.Record(now - deadline);
+  return true;
+}
+
+void KJCPacer::ReportAndReset(FILE *out)
+{
+  Report(out);
+  ResetReport();
+}
+
+void KJCPacer::ResetReport()
+{
+  lateness = KJCLatencyHistogram { };
+  report_wall_start = clk::now();
+  report_cpu_start = ThreadCpuTime();
+}
+
+void KJCPacer::Report(FILE *out)
+{
+  double wall_seconds = std::chrono::duration<double> { clk::now()
+      - report_wall_start }.count();
+  double cpu_seconds = std::chrono::duration<double> { ThreadCpuTime()
+      - report_cpu_start }.count();
+  fprintf(out,
+          "Pacing (%s): %" PRIu64 " wakeups, lateness mean %.1f us, p50 %.1f us, "
+          "p99 %.1f us, max %.1f us, CPU %.1f%%\n",
+          ModeName(mode), lateness.count, lateness.MeanNanoseconds() / 1e3,
+          double(lateness.PercentileNanoseconds(50)) / 1e3,
+          double(lateness.PercentileNanoseconds(99)) / 1e3,
+          double(lateness.max_nanoseconds) / 1e3,
+          wall_seconds > 0 ? 100.0 * cpu_seconds / wall_seconds : 0.0);
+}
+
+const char* KJCPacer::ModeName(KJCPacingMode mode)
+{
+  switch (mode)
+  {
+  case KJCPacingMode::Nanosleep:
+    return "nanosleep";
+  case KJCPacingMode::Timerfd:
+    return "timerfd";
+  default:
+    return "hybrid";
+  }
+}
+
+bool KJCPacer::ParseMode(const char *name, KJCPacingMode &mode)
+{
+  for (KJCPacingMode candidate : { KJCPacingMode::Hybrid,
+      KJCPacingMode::Nanosleep, KJCPacingMode::Timerfd })
+  {
+    if (strcmp(name, ModeName(candidate)) == 0)
+    {
+      mode = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+KJCSessionClock::KJCSessionClock(double speed) :
+    speed(speed),
+    origin(std::chrono::floor<std::chrono::seconds>(clk::now())),
+    virtual_now(origin)
+{
+}
+
+/* Consumes segment if the message continues with it */
+template<size_t N>
+bool KJCCommandParser::Match(const char *&current, const char *end,
+                             const char (&segment)[N])
+{
+  /* N counts the null terminator, which isn't on the wire */
+  if (size_t(end - current) < N - 1 || memcmp(current, segment, N - 1) != 0)
+  {
+    return false;
+  }
+  current += N - 1;
+  return true;
+}
+
+/*
+ Every command starts with either "ID;" or "TEST;CMD=", so one look at the
+ prefix says which parser to run, and the rest of the message is read once:
+ - "ID;" discovery; in response a message is sent back like: "ID;MODEL=m;SERIAL=n;"
+ - "STATS;" timing statistics of the sender's session
+ - "TEST;CMD=STOP;"
+ - "TEST;CMD=START;DURATION=s;RATE=ms;" optionally followed by "KEY=VALUE;"
+   fields, see ParseStartOption
+ - "TEST;CMD=RESEND;FROM=n;TO=n;" send samples n to n again
+ - "TEST;CMD=RANGE;FROM=ms;TO=ms;RATE=ms;" optionally followed by FORMAT,
+   TSRES and CHANNELS: the samples for those times at once, see ParseRange
+ - "TEST;CMD=SUBSCRIBE;" and "TEST;CMD=UNSUBSCRIBE;" take or leave the
+   published stream
+ Anything else, including junk after an otherwise correct command, is Unknown.
+ */
+KJCCommand KJCCommandParser::Parse(const char *read, size_t bytes_received)
+{
+  const char *current = read;
+  const char *end = read + bytes_received;
+  if (Match(current, end, "ID;"))
+  {
+    return current == end ? KJCCommand { KJCIdCommand { } } : KJCCommand { };
+  }
+  if (Match(current, end, "STATS;"))
+  {
+    return current == end ? KJCCommand { KJCStatsCommand { } } : KJCCommand { };
+  }
+  if (!Match(current, end, "TEST;CMD="))
+  {
+    return KJCUnknownCommand { };
+  }
+  if (Match(current, end, "STOP;"))
+  {
+    return current == end ? KJCCommand { KJCStopCommand { } } : KJCCommand { };
+  }
+  if (Match(current, end, "SUBSCRIBE;"))
+  {
+    return current == end ? KJCCommand { KJCSubscribeCommand { } } : KJCCommand { };
+  }
+  if (Match(current, end, "UNSUBSCRIBE;"))
+  {
+    return current == end ? KJCCommand { KJCUnsubscribeCommand { } } : KJCCommand { };
+  }
+  KJCStartCommand start;
+  if (Match(current, end, "START;") && ParseStart(current, end, start))
+  {
+    return start;
+  }
+  KJCResendCommand resend;
+  if (Match(current, end, "RESEND;") && ParseResend(current, end, resend))
+  {
+    return resend;
+  }
+  KJCRangeCommand range;
+  if (Match(current, end, "RANGE;") && ParseRange(current, end, range))
+  {
+    return range;
+  }
+  return KJCUnknownCommand { };
+}
+
+/* The part of a resend command after "RESEND;"; FROM can't be after TO */
+bool KJCCommandParser::ParseResend(const char *current, const char *end,
+                                   KJCResendCommand &command)
+{
+  if (!Match(current, end, "FROM="))
+  {
+    return false;
+  }
+  std::from_chars_result result = std::from_chars(current, end, command.from);
+  if (result.ec != std::errc { } || !Match(result.ptr, end, ";TO="))
+  {
+    return false;
+  }
+  result = std::from_chars(result.ptr, end, command.to);
+  current = result.ptr;
+  return result.ec == std::errc { } && Match(current, end, ";") && current == end
+      && command.from <= command.to;
+}
+
+/* The part of a range command after "RANGE;". FROM and TO are in milliseconds
+   like RATE, which can't be 0, and TO can't be before FROM. The samples come
+   from the model, each in its own record, so there is no BATCH, WINDOW,
+   OVERRUN or TRACE. */
+bool KJCCommandParser::ParseRange(const char *current, const char *end,
+                                  KJCRangeCommand &command)
+{
+  int64_t whole, fraction;
+  if (!Match(current, end, "FROM=")
+      || !ParseDecimal(current, end, 3, whole, fraction))
+  {
+    return false;
+  }
+  command.from = std::chrono::milliseconds { whole }
+      + std::chrono::microseconds { fraction };
+  if (!Match(current, end, "TO=")
+      || !ParseDecimal(current, end, 3, whole, fraction))
+  {
+    return false;
+  }
+  command.to = std::chrono::milliseconds { whole }
+      + std::chrono::microseconds { fraction };
+  const KJCStartOptions &options = command.options;
+  return ParseStream(current, end, command.rate, command.options)
+      && command.rate > clk::duration { 0 } && command.from <= command.to
+      && options.batch_window == clk::duration { 0 } && options.window == 0
+      && options.overrun == KJCOverrunPolicy::Burst && options.trace.empty();
+}
+
+/* The part of a start command after "START;". DURATION is in seconds and RATE
+   in milliseconds; both may have a fractional part, which is kept to the
+   microsecond. */
+bool KJCCommandParser::ParseStart(const char *current, const char *end,
+                                  KJCStartCommand &command)
+{
+  int64_t whole, fraction;
+  if (!Match(current, end, "DURATION=")
+      || !ParseDecimal(current, end, 6, whole, fraction))
+  {
+    return false;
+  }
+  command.duration = std::chrono::seconds { whole }
+      + std::chrono::microseconds { fraction };
+  return ParseStream(current, end, command.rate, command.options);
+}
+
+bool KJCCommandParser::ParseStream(const char *current, const char *end,
+                                   clk::duration &rate, KJCStartOptions &options)
+{
+  int64_t whole, fraction;
+  if (!Match(current, end, "RATE=")
+      || !ParseDecimal(current, end, 3, whole, fraction))
+  {
+    return false;
+  }
+  rate = std::chrono::milliseconds { whole } + std::chrono::microseconds { fraction };
+
+  /* Anything after the rate field has to be a well formed optional field, so
+     junk characters at the end still ruin an otherwise correct message */
+  options = KJCStartOptions { };
+  while (current < end)
+  {
+    if (!ParseStartOption(current, end, options))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Parses "digits[.digits];" in place and steps past the ';'. Either side of
+   the decimal point may be empty, but not both. The fraction is truncated to
+   fraction_digits, so "1.2345678" with 6 digits gives 1 and 234567. */
+bool KJCCommandParser::ParseDecimal(const char *&current, const char *end,
+                                    int fraction_digits, int64_t &whole,
+                                    int64_t &fraction)
+{
+  const char *digit = current;
+  whole = 0;
+  fraction = 0;
+  /* from_chars would take a minus sign, so only hand it digits */
+  if (digit < end && isdigit((unsigned char) *digit))
+  {
+    std::from_chars_result result = std::from_chars(digit, end, whole);
+    if (result.ec != std::errc { } || whole > max_field_value)
+    {
+      return false;
+    }
+    digit = result.ptr;
+  }
+  bool has_digits = digit != current;
+  if (digit < end && *digit == '.')
+  {
+    ++digit;
+    int scale = fraction_digits;
+    for (; digit < end && isdigit((unsigned char) *digit); ++digit)
+    {
+      has_digits = true;
+      if (scale > 0)
+      {
+        fraction = fraction * 10 + (*digit - '0');
+        scale--;
+      }
+    }
+    for (; scale > 0; --scale)
+    {
+      fraction *= 10;
+    }
+  }
+  if (!has_digits || digit == end || *digit != ';')
+  {
+    return false;
+  }
+  current = digit + 1;
+  return true;
+}
+
+/* Parses one optional start field of the form "KEY=VALUE;" and steps past it. Known fields:
+   - "BATCH=us;" send samples due within us microseconds of each other in one batch
+   - "FORMAT=ASCII;", "FORMAT=BIN;" or "FORMAT=FRAME;" encoding of the sample messages
+   - "TSRES=MS;", "TSRES=US;" or "TSRES=NS;" unit of the samples' TIME
+   - "WINDOW=n;" send aggregates of every n samples, see binary_aggregate_version
+   - "CHANNELS=list;" channels to stream, see ParseChannelList
+   - "TRACE=name;" replay the named trace, see KJCTrace::ValidName */
+bool KJCCommandParser::ParseStartOption(const char *&current, const char *end,
+                                        KJCStartOptions &options)
+{
+  if (Match(current, end, "BATCH="))
+  {
+    uint64_t microseconds;
+    std::from_chars_result result = std::from_chars(current, end, microseconds);
+    /* Anything over a second is pointless */
+    if (result.ec != std::errc { } || microseconds > 1000000
+        || !Match(result.ptr, end, ";"))
+    {
+      return false;
+    }
+    options.batch_window = std::chrono::microseconds { microseconds };
+    current = result.ptr;
+    return true;
+  }
+  if (Match(current, end, "FORMAT="))
+  {
+    if (Match(current, end, "ASCII;"))
+    {
+      options.format = KJCWireFormat::Ascii;
+      return true;
+    }
+    if (Match(current, end, "BIN;"))
+    {
+      options.format = KJCWireFormat::Binary;
+      return true;
+    }
+    if (Match(current, end, "FRAME;"))
+    {
+      options.format = KJCWireFormat::Frame;
+      return true;
+    }
+    return false;
+  }
+  if (Match(current, end, "TSRES="))
+  {
+    if (Match(current, end, "MS;"))
+    {
+      options.resolution = KJCTimeResolution::Milliseconds;
+      return true;
+    }
+    if (Match(current, end, "US;"))
+    {
+      options.resolution = KJCTimeResolution::Microseconds;
+      return true;
+    }
+    if (Match(current, end, "NS;"))
+    {
+      options.resolution = KJCTimeResolution::Nanoseconds;
+      return true;
+    }
+    return false;
+  }
+  if (Match(current, end, "WINDOW="))
+  {
+    uint32_t window;
+    std::from_chars_result result = std::from_chars(current, end, window);
+    if (result.ec != std::errc { } || window == 0
+        || window > KJCWindowAggregate::max_window || !Match(result.ptr, end, ";"))
+    {
+      return false;
+    }
+    options.window = window;
+    current = result.ptr;
+    return true;
+  }
+  if (Match(current, end, "CHANNELS="))
+  {
+    return ParseChannelList(current, end, options.channel_mask);
+  }
+  if (Match(current, end, "OVERRUN="))
+  {
+    if (Match(current, end, "BURST;"))
+    {
+      options.overrun = KJCOverrunPolicy::Burst;
+      return true;
+    }
+    if (Match(current, end, "SKIP;"))
+    {
+      options.overrun = KJCOverrunPolicy::Skip;
+      return true;
+    }
+    if (Match(current, end, "COALESCE;"))
+    {
+      options.overrun = KJCOverrunPolicy::Coalesce;
+      return true;
+    }
+    return false;
+  }
+  if (Match(current, end, "TRACE="))
+  {
+    const char *name_end = (const char*) memchr(current, ';', end - current);
+    if (name_end == nullptr
+        || !KJCTrace::ValidName(std::string_view { current, size_t(name_end - current) }))
+    {
+      return false;
+    }
+    options.trace = std::string_view { current, size_t(name_end - current) };
+    current = name_end + 1;
+    return true;
+  }
+  /* Unknown field */
+  return false;
+}
+
+/* Comma separated channel indices or inclusive ranges, then ';', e.g.
+   "0,2-5,63;". Whether the channels exist is up to the server's model. */
+bool KJCCommandParser::ParseChannelList(const char *&current, const char *end,
+                                        uint64_t &mask)
+{
+  uint64_t selected = 0;
+  do
+  {
+    unsigned first, last;
+    std::from_chars_result result = std::from_chars(current, end, first);
+    if (result.ec != std::errc { } || first >= KJCSensorModel::max_channels)
+    {
+      return false;
+    }
+    current = result.ptr;
+    last = first;
+    if (Match(current, end, "-"))
+    {
+      result = std::from_chars(current, end, last);
+      if (result.ec != std::errc { } || last >= KJCSensorModel::max_channels
+          || last < first)
+      {
+        return false;
+      }
+      current = result.ptr;
+    }
+    for (unsigned channel = first; channel <= last; ++channel)
+    {
+      selected |= uint64_t(1) << channel;
+    }
+  }
+  while (Match(current, end, ","));
+  if (!Match(current, end, ";"))
+  {
+    return false;
+  }
+  mask = selected;
+  return true;
+}
+
+KJCMessageEncoder KJCSensorServer::OutgoingMessage()
+{
+  static thread_local KJCMessageBuffer buffer;
+  return KJCMessageEncoder { buffer.bytes, KJCMessageBuffer::capacity };
+}
+
+bool KJCSensorServer::SendMessage(int socket, struct sockaddr *peer_address,
+                                  socklen_t peer_len,
+                                  const KJCMessageEncoder &encoder)
+{
+  if (encoder.Overflowed())
+  {
+    fprintf(stderr, "Can't send message, too long for the buffer.\n");
+    return false;
+  }
+  // TODO KJC handle errors on the socket
+  ssize_t bytes_sent = sendto(socket, encoder.Data(), encoder.Size(), 0,
+                              peer_address, peer_len);
+  if(bytes_sent < 0){
+    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+    return false;
+  }
+  if (tx_timestamps != nullptr)
+  {
+    tx_timestamps->Sent(1);
+  }
+  return true;
+}
+
+/* Sensor value messages are formatted like: "STATUS;TIME=ms;MV=mv;MA=ma;" */
+/* We are choosing to send time as a function of beginning of measurement */
+bool KJCSensorServer::SendSensorValue(int socket, KJCSession &session,
+                                      const int32_t *values,
+                                      clk::time_point current)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  if (session.format == KJCWireFormat::Binary)
+  {
+    FormatSensorValueBinary(encoder, session.channels, values, 1, current,
+                            session.start_timepoint, session.resolution);
+  }
+  else if (session.format == KJCWireFormat::Frame)
+  {
+    FormatFrame(encoder, session, values, 1, 1, current);
+  }
+  else
+  {
+    FormatSensorValue(encoder, *session.labels, session.channels, values, 1,
+                      current, session.start_timepoint, session.resolution);
+  }
+  KeepForResend(session, session.samples_sent, 1, encoder);
+  return SendStreamMessage(socket, session, encoder);
+}
+
+bool KJCSensorServer::SendStreamMessage(int socket, KJCSession &session,
+                                        const KJCMessageEncoder &encoder)
+{
+  if (session.output != nullptr)
+  {
+    return session.output->Write(encoder.Data(), encoder.Size(),
+                                 session.format == KJCWireFormat::Ascii);
+  }
+  if (session.subscribers != nullptr)
+  {
+    return FanOut(socket, session, encoder);
+  }
+  return SendMessage(socket, (struct sockaddr*) &session.peer_address,
+                     session.peer_len, encoder);
+}
+
+/* The TIME field of a sample: both times are truncated to the unit first, so
+   millisecond TIME is what it always was */
+template<typename Unit>
+static uint64_t ElapsedIn(clk::time_point current, clk::time_point start)
+{
+  return (std::chrono::time_point_cast<Unit>(current)
+      - std::chrono::time_point_cast<Unit>(start)).count();
+}
+
+static uint64_t ElapsedTime(clk::time_point current, clk::time_point start,
+                            KJCTimeResolution resolution)
+{
+  switch (resolution)
+  {
+  case KJCTimeResolution::Microseconds:
+    return ElapsedIn<std::chrono::microseconds>(current, start);
+  case KJCTimeResolution::Nanoseconds:
+    return ElapsedIn<std::chrono::nanoseconds>(current, start);
+  default:
+    return ElapsedIn<std::chrono::milliseconds>(current, start);
+  }
+}
+
+void KJCSensorServer::FormatSensorValue(KJCMessageEncoder &encoder,
+                                        const KJCChannelLabels &labels,
+                                        const KJCChannelSelection &selection,
+                                        const int32_t *values, size_t stride,
+                                        clk::time_point current,
+                                        clk::time_point start,
+                                        KJCTimeResolution resolution)
+{
+  encoder.Literal("STATUS;TIME=").Number(ElapsedTime(current, start, resolution));
+  for (size_t k = 0; k < selection.count; ++k)
+  {
+    size_t channel = selection.channels[k];
+    encoder.Literal(";").Text(labels.text[channel], labels.size[channel]).Number(
+        values[k * stride]);
+  }
+  encoder.Literal(";");
+}
+
+/* Binary sensor value: the same TIME and values as the ASCII message, see KJCWireFormat */
+void KJCSensorServer::FormatSensorValueBinary(KJCMessageEncoder &encoder,
+                                              const KJCChannelSelection &selection,
+                                              const int32_t *values,
+                                              size_t stride,
+                                              clk::time_point current,
+                                              clk::time_point start,
+                                              KJCTimeResolution resolution)
+{
+  encoder.LittleEndian(binary_record_version, 1).LittleEndian(selection.count, 1);
+  encoder.LittleEndian(ElapsedTime(current, start, resolution), sizeof(uint64_t));
+  for (size_t k = 0; k < selection.count; ++k)
+  {
+    encoder.LittleEndian(uint32_t(values[k * stride]), sizeof(int32_t));
+  }
+}
+
+/* Frame of samples, see frame_version */
+size_t KJCSensorServer::FormatFrame(KJCMessageEncoder &encoder,
+                                    const KJCSession &session,
+                                    const int32_t *values, size_t stride,
+                                    size_t count, clk::time_point first,
+                                    size_t limit)
+{
+  size_t channels = session.channels.count;
+  uint64_t time = ElapsedTime(first, session.start_timepoint, session.resolution);
+  size_t header = encoder.Size();
+  encoder.LittleEndian(frame_version, 1).LittleEndian(channels, 1).LittleEndian(
+      count, sizeof(uint16_t));
+  encoder.LittleEndian(session.samples_sent, sizeof(uint64_t)).LittleEndian(
+      time, sizeof(uint64_t));
+  int32_t previous[KJCSensorModel::max_channels] { };
+  for (size_t i = 0; i < count; ++i)
+  {
+    if (i > 0 && encoder.Size() + FrameSampleSizeBound(channels) > limit)
+    {
+      encoder.Patch(header + 2, i, sizeof(uint16_t));
+      return i;
+    }
+    if (i > 0)
+    {
+      uint64_t current = ElapsedTime(first + int64_t(i) * session.rate,
+                                     session.start_timepoint, session.resolution);
+      encoder.ZigZagVarint(int64_t(current - time));
+      time = current;
+    }
+    for (size_t k = 0; k < channels; ++k)
+    {
+      int32_t value = values[k * stride + i];
+      encoder.ZigZagVarint(int64_t(value) - previous[k]);
+      previous[k] = value;
+    }
+  }
+  return count;
+}
+
+/* Lowest byte first; false if the frame ends first */
+static bool ReadLittleEndian(const char *&current, const char *end,
+                             size_t bytes, uint64_t &value)
+{
+  if (size_t(end - current) < bytes)
+  {
+    return false;
+  }
+  value = 0;
+  for (size_t i = 0; i < bytes; ++i)
+  {
+    value |= uint64_t(uint8_t(current[i])) << (8 * i);
+  }
+  current += bytes;
+  return true;
+}
+
+/* The other half of KJCMessageEncoder::ZigZagVarint(); false if the frame
+   ends first or the varint is longer than 64 bits can be */
+static bool ReadZigZagVarint(const char *&current, const char *end,
+                             int64_t &value)
+{
+  uint64_t zigzag = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7)
+  {
+    if (current == end)
+    {
+      return false;
+    }
+    uint8_t byte = *current++;
+    zigzag |= uint64_t(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      value = int64_t(zigzag >> 1) ^ -int64_t(zigzag & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool KJCFrameDecoder::Decode(const char *data, size_t size)
+{
+  const char *current = data;
+  const char *end = data + size;
+  uint64_t version, frame_channels, frame_count, frame_sequence, time;
+  if (!ReadLittleEndian(current, end, 1, version) || version != frame_version
+      || !ReadLittleEndian(current, end, 1, frame_channels)
+      || !ReadLittleEndian(current, end, sizeof(uint16_t), frame_count)
+      || !ReadLittleEndian(current, end, sizeof(uint64_t), frame_sequence)
+      || !ReadLittleEndian(current, end, sizeof(uint64_t), time)
+      || frame_channels > KJCSensorModel::max_channels || frame_count == 0
+      || frame_count > max_samples)
+  {
+    return false;
+  }
+  int64_t previous[KJCSensorModel::max_channels] { };
+  for (size_t i = 0; i < frame_count; ++i)
+  {
+    int64_t delta;
+    if (i > 0)
+    {
+      if (!ReadZigZagVarint(current, end, delta))
+      {
+        return false;
+      }
+      time += delta;
+    }
+    times[i] = time;
+    for (size_t k = 0; k < frame_channels; ++k)
+    {
+      if (!ReadZigZagVarint(current, end, delta))
+      {
+        return false;
+      }
+      previous[k] += delta;
+      values[i][k] = int32_t(previous[k]);
+    }
+  }
+  if (current != end)
+  {
+    return false;
+  }
+
+  channels = frame_channels;
+  count = frame_count;
+  sequence = frame_sequence;
+  frames++;
+  if (sequence >= expected)
+  {
+    missing += sequence - expected;
+    expected = sequence + count;
+  }
+  else
+  {
+    /* Fills in part of a gap counted before */
+    late++;
+    missing -= std::min<uint64_t>(missing, count);
+  }
+  return true;
+}
+
+void KJCSensorServer::FormatAggregate(KJCMessageEncoder &encoder,
+                                      KJCSession &session,
+                                      clk::time_point deadline)
+{
+  clk::time_point first = deadline - int64_t(session.window - 1) * session.rate;
+  size_t channels = session.channels.count;
+  window_aggregate.Reset(channels);
+  int32_t scratch[KJCSensorModel::max_channels];
+  for (size_t done = 0; done < session.window; done += KJCWindowAggregate::chunk)
+  {
+    size_t count = std::min(KJCWindowAggregate::chunk, session.window - done);
+    if (session.trace == nullptr)
+    {
+      session.generator.Generate(first - session.start_timepoint
+                                     + int64_t(done) * session.rate, count,
+                                 &window_aggregate.rows[0][0],
+                                 KJCWindowAggregate::chunk);
+    }
+    else
+    {
+      /* The trace has samples one after the other; the rows want channels */
+      for (size_t i = 0; i < count; ++i)
+      {
+        const int32_t *values = TraceValues(session, session.samples_sent + done + i,
+                                            scratch);
+        for (size_t k = 0; k < channels; ++k)
+        {
+          window_aggregate.rows[k][i] = values[k];
+        }
+      }
+    }
+    window_aggregate.Add(channels, count);
+  }
+
+  uint64_t time = ElapsedTime(first, session.start_timepoint, session.resolution);
+  /* A frame session's aggregates are binary too; they are one per datagram anyway */
+  if (session.format != KJCWireFormat::Ascii)
+  {
+    encoder.LittleEndian(binary_aggregate_version, 1).LittleEndian(channels, 1);
+    encoder.LittleEndian(time, sizeof(uint64_t)).LittleEndian(session.window,
+                                                              sizeof(uint32_t));
+    for (size_t k = 0; k < channels; ++k)
+    {
+      encoder.LittleEndian(uint32_t(window_aggregate.min[k]), sizeof(int32_t));
+      encoder.LittleEndian(uint32_t(window_aggregate.max[k]), sizeof(int32_t));
+      encoder.LittleEndian(uint32_t(window_aggregate.Mean(k)), sizeof(int32_t));
+      encoder.LittleEndian(window_aggregate.Rms(k), sizeof(uint32_t));
+    }
+    return;
+  }
+  encoder.Literal("AGGREGATE;TIME=").Number(time).Literal(";COUNT=").Number(
+      session.window);
+  for (size_t k = 0; k < channels; ++k)
+  {
+    size_t channel = session.channels.channels[k];
+    encoder.Literal(";").Text(session.labels->text[channel],
+                              session.labels->size[channel]);
+    encoder.Number(window_aggregate.min[k]).Literal(",").Number(
+        window_aggregate.max[k]).Literal(",").Number(window_aggregate.Mean(k)).Literal(
+        ",").Number(window_aggregate.Rms(k));
+  }
+  encoder.Literal(";");
+}
+
+void KJCSensorServer::SendStartedMessage(int socket,
+                                         struct sockaddr *peer_address,
+                                         socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=STARTED;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendStoppedMessage(int socket,
+                                         struct sockaddr *peer_address,
+                                         socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=STOPPED;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendErrorAlreadyStartedMessage(
+    int socket, struct sockaddr *peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=error;MSG=already_started;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendErrorAlreadyStoppedMessage(
+    int socket, struct sockaddr *peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=error;MSG=already_stopped;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendErrorUnknownChannelMessage(
+    int socket, struct sockaddr *peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=error;MSG=unknown_channel;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendErrorUnknownTraceMessage(
+    int socket, struct sockaddr *peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=error;MSG=unknown_trace;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendErrorBadRateMessage(
+    int socket, struct sockaddr *peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=error;MSG=bad_rate;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendDiscoveryMessage(int socket,
+                                           struct sockaddr *peer_address,
+                                           socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("ID;MODEL=1531;SERIAL=4643;");
+  if (publish != nullptr)
+  {
+    encoder.Literal("GROUP=").Text(publish->name.data(), publish->name.size()).Literal(";");
+  }
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+void KJCSensorServer::SendIdleStatusMessage(int socket,
+                                            struct sockaddr *peer_address,
+                                            socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("STATUS;STATE=IDLE;");
+  SendMessage(socket, peer_address, peer_len, encoder);
+}
+
+
+KJCPeerKey KJCPeerKey::FromAddress(const struct sockaddr_storage &address)
+{
+  KJCPeerKey key { 0, 0, uint32_t(address.ss_family) << 16 };
+  if (address.ss_family == AF_INET)
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in*) &address;
+    key.address_low = in->sin_addr.s_addr;
+    key.port_family |= in->sin_port;
+  }
+  else if (address.ss_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*) &address;
+    memcpy(&key.address_high, &in6->sin6_addr.s6_addr[0], 8);
+    memcpy(&key.address_low, &in6->sin6_addr.s6_addr[8], 8);
+    key.port_family |= in6->sin6_port;
+  }
+  return key;
+}
+
+bool KJCSensorServer::StartSession(int socket,
+                                   const struct sockaddr_storage &peer_address,
+                                   socklen_t peer_len, clk::duration duration,
+                                   clk::duration rate,
+                                   const KJCStartOptions &options)
+{
+  KJCSession &session = sessions[KJCPeerKey::FromAddress(peer_address)];
+  if (session.state == KJCSessionState::Started)
+  {
+    return false;
+  }
+  UnlistIdle(session);
+  session.peer_address = peer_address;
+  session.peer_len = peer_len;
+  session.state = KJCSessionState::Started;
+  session.start_timepoint = clock.Now();
+  session.end_timepoint = session.start_timepoint + duration;
+  ConfigureSession(session, rate, options);
+  /* Only reallocates the first time, or if the size changed */
+  session.resend.Allocate(resend_buffer);
+  session.resend_count = 0;
+  session.generation++;
+  RecordStream(session);
+  /* The reply goes out before the first sample, which the loop sends later */
+  SendStartedMessage(socket, (struct sockaddr*) &session.peer_address,
+                     session.peer_len);
+  /* A window goes out once its last sample is due */
+  clk::time_point first_deadline = session.start_timepoint;
+  if (session.window > 0)
+  {
+    first_deadline += int64_t(session.window - 1) * session.rate;
+  }
+  Schedule(first_deadline, session, session.generation);
+  return true;
+}
+
+void KJCSensorServer::ConfigureSession(KJCSession &session, clk::duration rate,
+                                       const KJCStartOptions &options)
+{
+  session.trace = options.trace.empty() ? nullptr : FindTrace(options.trace);
+  session.prefetched_until = 0;
+  session.labels = session.trace != nullptr ? &session.trace->labels : &model.labels;
+  /* RATE=0 replays a trace as fast as it was captured */
+  session.rate = session.trace != nullptr && rate == clk::duration { 0 } ?
+      session.trace->period : rate;
+  /* An aggregate is one message per window, so there is nothing to batch */
+  session.window = options.window;
+  session.batch_window = session.window > 0 ? clk::duration { 0 } : options.batch_window;
+  session.format = options.format;
+  session.resolution = options.resolution;
+  /* The caller has checked the trace and channels exist */
+  uint64_t all_channels = session.trace != nullptr ?
+      KJCChannelSelection::AllOf(session.trace->channel_count) : model.AllChannels();
+  session.channels = KJCChannelSelection::FromMask(
+      options.channel_mask != 0 ? options.channel_mask : all_channels);
+  session.sample_size_bound = binary_record_header_size
+      + sizeof(int32_t) * session.channels.count;
+  if (session.format == KJCWireFormat::Frame)
+  {
+    /* Per sample; the frame's header comes on top */
+    session.sample_size_bound = FrameSampleSizeBound(session.channels.count);
+  }
+  if (session.format == KJCWireFormat::Ascii)
+  {
+    session.sample_size_bound = 12 + 20 + 1;
+    for (size_t k = 0; k < session.channels.count; ++k)
+    {
+      session.sample_size_bound += session.labels->size[session.channels.channels[k]] + 11 + 1;
+    }
+  }
+  session.overrun = options.overrun;
+  if ((session.batch_window > clk::duration { 0 } || session.window > 0
+       || session.overrun == KJCOverrunPolicy::Coalesce) && session.trace == nullptr)
+  {
+    session.generator.Configure(model, session.channels, session.rate);
+  }
+  session.samples_sent = 0;
+  session.sends = 0;
+#if KJC_ENABLE_STATS
+  session.stats = KJCSessionStats { };
+#endif
+}
+
+bool KJCSensorServer::StopSession(int socket,
+                                  const struct sockaddr_storage &peer_address)
+{
+  auto found = sessions.find(KJCPeerKey::FromAddress(peer_address));
+  if (found == sessions.end()
+      || found->second.state != KJCSessionState::Started)
+  {
+    return false;
+  }
+  KJCSession &session = found->second;
+  ReportSession(session);
+  session.state = KJCSessionState::Stopped;
+  /* The entry left in the schedule is now stale and will be dropped */
+  session.generation++;
+  SendStoppedMessage(socket, (struct sockaddr*) &session.peer_address,
+                     session.peer_len);
+  SendIdleStatusMessage(socket, (struct sockaddr*) &session.peer_address,
+                        session.peer_len);
+  return true;
+}
+
+/* The published stream's samples lie on the grid epoch + n * rate, and it
+   starts at the first slot not yet past, so its TIMEs and FRAME sequence
+   agree with those of any other worker, or of an earlier start. It runs
+   until the server stops, or with --publish=local the last subscriber
+   leaves. RESEND doesn't cover it. */
+void KJCSensorServer::StartPublishing()
+{
+  KJCSession &session = publisher;
+  if (publish->mode == KJCPublishMode::Multicast)
+  {
+    session.peer_address = publish->group;
+    session.peer_len = publish->group_len;
+  }
+  else
+  {
+    /* Described to the recorder without a peer */
+    memset(&session.peer_address, 0, sizeof(session.peer_address));
+    session.peer_len = 0;
+  }
+  session.state = KJCSessionState::Started;
+  session.start_timepoint = publish->epoch;
+  session.end_timepoint = clk::time_point::max();
+  ConfigureSession(session, publish->rate, publish->stream);
+  clk::duration since = clk::now() - publish->epoch;
+  uint64_t slot = since <= clk::duration { 0 } ? 0 :
+      uint64_t((since + publish->rate - clk::duration { 1 }) / publish->rate);
+  session.samples_sent = slot;
+  session.generation++;
+  RecordStream(session);
+  Schedule(publish->epoch + int64_t(slot) * publish->rate, session,
+           session.generation);
+}
+
+void KJCSensorServer::StartGenerating()
+{
+  KJCSession &session = generated;
+  /* Described to the recorder without a peer when it goes to a file */
+  session.peer_address = generate->address;
+  session.peer_len = generate->address_len;
+  session.state = KJCSessionState::Started;
+  session.start_timepoint = clock.Now();
+  session.end_timepoint = session.start_timepoint + generate->duration;
+  ConfigureSession(session, generate->rate, generate->stream);
+  session.generation++;
+  RecordStream(session);
+  clk::time_point first_deadline = session.start_timepoint;
+  if (session.window > 0)
+  {
+    first_deadline += int64_t(session.window - 1) * session.rate;
+  }
+  Schedule(first_deadline, session, session.generation);
+}
+
+void KJCSensorServer::StopPublishing()
+{
+  publisher.state = KJCSessionState::Stopped;
+  /* The entry left in the schedule is now stale and will be dropped */
+  publisher.generation++;
+}
+
+/*
+ SUBSCRIBE replies "TEST;RESULT=SUBSCRIBED;GROUP=g;RATE=ms;..." with the
+ group and the fields the published stream is made with; a multicast
+ subscriber then joins the group itself. With --publish=local the peer goes
+ on this worker's fan-out list, the first one starting the stream, and
+ UNSUBSCRIBE ("TEST;RESULT=UNSUBSCRIBED;") takes it off, the last one
+ stopping it. Errors: "MSG=not_publishing" without --publish,
+ "MSG=too_many_subscribers" and "MSG=not_subscribed".
+ */
+void KJCSensorServer::HandleSubscribe(int socket,
+                                      const struct sockaddr_storage &peer_address,
+                                      socklen_t peer_len, bool subscribe)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  struct sockaddr *peer = (struct sockaddr*) &peer_address;
+  if (publish == nullptr)
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=not_publishing;");
+    SendMessage(socket, peer, peer_len, encoder);
+    return;
+  }
+  if (publish->mode == KJCPublishMode::Local)
+  {
+    KJCPeerKey key = KJCPeerKey::FromAddress(peer_address);
+    auto found = std::find_if(subscribers.begin(), subscribers.end(),
+                              [&key](const KJCSubscriber &subscriber)
+                              { return KJCPeerKey::FromAddress(subscriber.address) == key; });
+    if (subscribe && found == subscribers.end())
+    {
+      if (subscribers.size() >= max_subscribers)
+      {
+        encoder.Literal("TEST;RESULT=error;MSG=too_many_subscribers;");
+        SendMessage(socket, peer, peer_len, encoder);
+        return;
+      }
+      subscribers.push_back( { peer_address, peer_len });
+      if (subscribers.size() == 1)
+      {
+        StartPublishing();
+      }
+    }
+    else if (!subscribe)
+    {
+      if (found == subscribers.end())
+      {
+        encoder.Literal("TEST;RESULT=error;MSG=not_subscribed;");
+        SendMessage(socket, peer, peer_len, encoder);
+        return;
+      }
+      *found = subscribers.back();
+      subscribers.pop_back();
+      if (subscribers.empty())
+      {
+        StopPublishing();
+      }
+    }
+  }
+  if (subscribe)
+  {
+    encoder.Literal("TEST;RESULT=SUBSCRIBED;GROUP=").Text(
+        publish->name.data(), publish->name.size()).Literal(";").Text(
+        publish->fields.data(), publish->fields.size());
+  }
+  else
+  {
+    encoder.Literal("TEST;RESULT=UNSUBSCRIBED;");
+  }
+  SendMessage(socket, peer, peer_len, encoder);
+}
+
+/* The same datagram to every subscriber, up to a batch of them per
+   sendmmsg(). A peer the kernel refuses is skipped, not retried. */
+bool KJCSensorServer::FanOut(int socket, const KJCSession &session,
+                             const KJCMessageEncoder &encoder)
+{
+  if (encoder.Overflowed())
+  {
+    fprintf(stderr, "Can't send message, too long for the buffer.\n");
+    return false;
+  }
+  struct iovec vector { (void*) encoder.Data(), encoder.Size() };
+  const std::vector<KJCSubscriber> &peers = *session.subscribers;
+  bool all_sent = true;
+  size_t next = 0;
+  while (next < peers.size())
+  {
+    size_t count = std::min(peers.size() - next, KJCSendBatch::max_messages);
+    for (size_t i = 0; i < count; ++i)
+    {
+      memset(&fanout_headers[i], 0, sizeof(fanout_headers[i]));
+      fanout_headers[i].msg_hdr.msg_name = (void*) &peers[next + i].address;
+      fanout_headers[i].msg_hdr.msg_namelen = peers[next + i].address_len;
+      fanout_headers[i].msg_hdr.msg_iov = &vector;
+      fanout_headers[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(socket, fanout_headers, count, 0);
+    if (sent <= 0)
+    {
+      fprintf(stderr, "Error on sendmmsg(). Errno (%d)\n", errno);
+      all_sent = false;
+      next++;
+      continue;
+    }
+    if (tx_timestamps != nullptr)
+    {
+      tx_timestamps->Sent(sent);
+    }
+    next += sent;
+  }
+  return all_sent;
+}
+
+/*
+ Statistics reply looks like: "STATS;STATE=s;SENT=n;FAILED=n;OVERRUN=n;SKIPPED=n;
+ BURST=n;COALESCED=n;RESEND_HITS=n;RESEND_MISSES=n;RESENT=n;LATE_P50_NS=ns;..."
+ with p50, p99, p999 and max of LATE (schedule lateness), SEND (send time) and
+ DEPART (departure, 0 without --tx-timestamps) in nanoseconds, see KJCSessionStats. They cover the peer's latest
+ stream, and stay readable after it ends until the next START.
+ */
+void KJCSensorServer::SendSessionStats(
+    int socket, const struct sockaddr_storage &peer_address, socklen_t peer_len)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+#if KJC_ENABLE_STATS
+  auto found = sessions.find(KJCPeerKey::FromAddress(peer_address));
+  if (found == sessions.end())
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=no_session;");
+    SendMessage(socket, (struct sockaddr*) &peer_address, peer_len, encoder);
+    return;
+  }
+  const KJCSession &session = found->second;
+  const KJCSessionStats &stats = session.stats;
+  encoder.Literal("STATS;STATE=");
+  switch (session.state)
+  {
+  case KJCSessionState::Started:
+    encoder.Literal("STARTED");
+    break;
+  case KJCSessionState::Stopped:
+    encoder.Literal("STOPPED");
+    break;
+  default:
+    encoder.Literal("IDLE");
+    break;
+  }
+  encoder.Literal(";SENT=").Number(stats.sent).Literal(";FAILED=").Number(
+      stats.failed).Literal(";OVERRUN=").Number(stats.overrun);
+  encoder.Literal(";SKIPPED=").Number(stats.skipped).Literal(";BURST=").Number(
+      stats.burst).Literal(";COALESCED=").Number(stats.coalesced);
+  encoder.Literal(";RESEND_HITS=").Number(stats.resend_hits).Literal(
+      ";RESEND_MISSES=").Number(stats.resend_misses).Literal(";RESENT=").Number(
+      stats.resent);
+  encoder.Literal(";LATE_P50_NS=").Number(
+      stats.lateness.PercentileNanoseconds(50)).Literal(";LATE_P99_NS=").Number(
+      stats.lateness.PercentileNanoseconds(99)).Literal(";LATE_P999_NS=").Number(
+      stats.lateness.PercentileNanoseconds(99.9)).Literal(";LATE_MAX_NS=").Number(
+      stats.lateness.max_nanoseconds);
+  encoder.Literal(";SEND_P50_NS=").Number(
+      stats.send_time.PercentileNanoseconds(50)).Literal(";SEND_P99_NS=").Number(
+      stats.send_time.PercentileNanoseconds(99)).Literal(";SEND_P999_NS=").Number(
+      stats.send_time.PercentileNanoseconds(99.9)).Literal(";SEND_MAX_NS=").Number(
+      stats.send_time.max_nanoseconds);
+  encoder.Literal(";DEPART_P50_NS=").Number(
+      stats.departure.PercentileNanoseconds(50)).Literal(";DEPART_P99_NS=").Number(
+      stats.departure.PercentileNanoseconds(99)).Literal(";DEPART_P999_NS=").Number(
+      stats.departure.PercentileNanoseconds(99.9)).Literal(";DEPART_MAX_NS=").Number(
+      stats.departure.max_nanoseconds).Literal(";");
+#else
+  encoder.Literal("TEST;RESULT=error;MSG=stats_disabled;");
+#endif
+  SendMessage(socket, (struct sockaddr*) &peer_address, peer_len, encoder);
+}
+
+/*
+ RESEND errors: "MSG=no_session" before the peer's first sample,
+ "MSG=resend_disabled" without --resend-buffer, "MSG=not_sent" if none of the
+ samples has been sent yet, and "MSG=resend_busy" if the session already has
+ max_resend_ranges ranges waiting. Otherwise there is no reply besides the
+ messages.
+ */
+void KJCSensorServer::HandleResend(int socket,
+                                   const struct sockaddr_storage &peer_address,
+                                   socklen_t peer_len,
+                                   const KJCResendCommand &resend)
+{
+  KJCMessageEncoder encoder = OutgoingMessage();
+  auto found = sessions.find(KJCPeerKey::FromAddress(peer_address));
+  if (found == sessions.end() || found->second.samples_sent == 0)
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=no_session;");
+    SendMessage(socket, (struct sockaddr*) &peer_address, peer_len, encoder);
+    return;
+  }
+  KJCSession &session = found->second;
+  /* Samples not sent yet are left out */
+  uint64_t to = std::min(resend.to, session.samples_sent - 1);
+  if (!session.resend.Enabled())
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=resend_disabled;");
+  }
+  else if (resend.from > to)
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=not_sent;");
+  }
+  else
+  {
+    KJCSession::ResendRange *last = session.resend_count == 0 ? nullptr :
+        &session.resend_ranges[(session.resend_first + session.resend_count - 1)
+            % KJCSession::max_resend_ranges];
+    if (last != nullptr && resend.from <= last->to + 1 && to + 1 >= last->from)
+    {
+      /* Overlaps or adjoins the last range, so it just extends it */
+      last->from = std::min(last->from, resend.from);
+      last->to = std::max(last->to, to);
+    }
+    else if (session.resend_count == KJCSession::max_resend_ranges)
+    {
+      encoder.Literal("TEST;RESULT=error;MSG=resend_busy;");
+    }
+    else
+    {
+      session.resend_ranges[(session.resend_first + session.resend_count++)
+          % KJCSession::max_resend_ranges] = { resend.from, to };
+    }
+  }
+  if (encoder.Size() > 0)
+  {
+    SendMessage(socket, (struct sockaddr*) &peer_address, peer_len, encoder);
+    return;
+  }
+  if (!session.resend_queued)
+  {
+    UnlistIdle(session);
+    session.resend_queued = true;
+    resend_queue.push_back(&session);
+  }
+}
+
+/* Each turn sends one message of the session at the front, which then goes
+   to the back, so a long range doesn't keep the others waiting. A message
+   goes out whole even if only some of its samples were asked for. */
+void KJCSensorServer::ServeResends(int socket, clk::duration lead)
+{
+  clk::time_point now = clk::now();
+  resend_tokens = std::min(std::max(1.0, resend_rate / 100.0), resend_tokens
+      + std::chrono::duration<double> { now - resend_refilled }.count() * resend_rate);
+  resend_refilled = now;
+  for (size_t sent = 0; sent < max_resends_per_turn && !resend_queue.empty()
+      && resend_tokens >= 1.0; ++sent)
+  {
+    if (!schedule.empty() && clock.Now() + resend_slack > schedule.top().deadline - lead)
+    {
+      return;
+    }
+    KJCSession &session = *resend_queue.front();
+    resend_queue.pop_front();
+    session.resend_queued = false;
+    if (session.resend_count == 0)
+    {
+      /* Restarted since */
+      ListIdle(session);
+      continue;
+    }
+    KJCSession::ResendRange &range = session.resend_ranges[session.resend_first];
+    uint64_t from = range.from;
+    uint64_t to = range.to;
+    const KJCResendRing::Message *message = session.resend.Find(from);
+    bool done = message == nullptr || message->first > to;
+    if (done)
+    {
+      /* None of the rest is kept any more */
+#if KJC_ENABLE_STATS
+      session.stats.resend_misses += to - from + 1;
+#endif
+    }
+    else
+    {
+      uint64_t last = std::min<uint64_t>(message->first + message->count - 1, to);
+      KJCMessageEncoder encoder = OutgoingMessage();
+      encoder.Text(session.resend.Payload(*message), message->size);
+      bool resent = SendMessage(socket, (struct sockaddr*) &session.peer_address,
+                                session.peer_len, encoder);
+      resend_tokens -= 1.0;
+#if KJC_ENABLE_STATS
+      /* Samples before the message weren't kept */
+      session.stats.resend_misses += message->first > from ? message->first - from : 0;
+      session.stats.resend_hits += last + 1 - std::max(message->first, from);
+      session.stats.resent += resent;
+#else
+      (void) resent;
+#endif
+      range.from = last + 1;
+      done = last == to;
+    }
+    if (done)
+    {
+      session.resend_first = (session.resend_first + 1) % KJCSession::max_resend_ranges;
+      session.resend_count--;
+    }
+    if (session.resend_count > 0)
+    {
+      session.resend_queued = true;
+      resend_queue.push_back(&session);
+    }
+    else
+    {
+      ListIdle(session);
+    }
+  }
+}
+
+/*
+ RANGE errors: "MSG=unknown_channel" as with START, "MSG=range_busy" while
+ the peer's last range is still going out, "MSG=too_many_ranges" with
+ max_ranges going out already, and "MSG=range_too_large" for more than
+ max_range_samples samples. Otherwise the reply is
+ "TEST;RESULT=RANGE;SAMPLES=n;", then the samples, then
+ "TEST;RESULT=RANGE_DONE;SAMPLES=n;" with how many of them were sent.
+ */
+void KJCSensorServer::HandleRange(int socket,
+                                  const struct sockaddr_storage &peer_address,
+                                  socklen_t peer_len, const KJCRangeCommand &range)
+{
+  struct sockaddr *peer = (struct sockaddr*) &peer_address;
+  if (range.options.channel_mask & ~model.AllChannels())
+  {
+    SendErrorUnknownChannelMessage(socket, peer, peer_len);
+    return;
+  }
+  /* Samples n with FROM <= n * RATE < TO */
+  uint64_t first = uint64_t((range.from + range.rate - clk::duration { 1 }) / range.rate);
+  uint64_t end = uint64_t((range.to + range.rate - clk::duration { 1 }) / range.rate);
+  KJCPeerKey key = KJCPeerKey::FromAddress(peer_address);
+  KJCMessageEncoder encoder = OutgoingMessage();
+  if (std::any_of(range_queue.begin(), range_queue.end(),
+                  [&key](const std::unique_ptr<KJCRangeJob> &job)
+                  {
+                    return KJCPeerKey::FromAddress(job->session.peer_address) == key;
+                  }))
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=range_busy;");
+  }
+  else if (range_queue.size() == max_ranges)
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=too_many_ranges;");
+  }
+  else if (end - first > max_range_samples)
+  {
+    encoder.Literal("TEST;RESULT=error;MSG=range_too_large;");
+  }
+  if (encoder.Size() > 0)
+  {
+    SendMessage(socket, peer, peer_len, encoder);
+    return;
+  }
+  if (send_buffer == 0)
+  {
+    /* Room for a burst of ranges on top of the live streams; the kernel caps
+       it at net.core.wmem_max */
+    int size = 0;
+    socklen_t size_len = sizeof(size);
+    if (getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, &size_len) == 0
+        && size < range_send_buffer
+        && (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &range_send_buffer,
+                       sizeof(range_send_buffer)) < 0
+            || getsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, &size_len) < 0))
+    {
+      fprintf(stderr, "Can't enlarge the send buffer for ranges. (%d)\n", errno);
+    }
+    send_buffer = size > 0 ? size_t(size) : size_t(range_send_buffer);
+  }
+
+  std::unique_ptr<KJCRangeJob> job = std::make_unique<KJCRangeJob>();
+  KJCSession &session = job->session;
+  session.peer_address = peer_address;
+  session.peer_len = peer_len;
+  session.state = KJCSessionState::Started;
+  session.start_timepoint = clk::time_point { };
+  ConfigureSession(session, range.rate, range.options);
+  session.generator.Configure(model, session.channels, session.rate);
+  session.samples_sent = first;
+  job->end = end;
+  job->requested = end - first;
+  if (session.format == KJCWireFormat::Frame)
+  {
+    /* A byte of TIME and of each channel at the least */
+    job->per_datagram = (max_frame_size - frame_header_size)
+        / (1 + session.channels.count);
+  }
+  else if (session.format == KJCWireFormat::Binary)
+  {
+    job->per_datagram = max_frame_size / session.sample_size_bound;
+  }
+  else
+  {
+    /* "STATUS;TIME=0;\n" and "X=0;" per channel, at the shortest */
+    job->per_datagram = max_frame_size / (15 + 4 * session.channels.count);
+  }
+  /* A block starting up to a generator block before the datagram's first
+     sample still holds all of them */
+  job->per_datagram = std::min(job->per_datagram,
+                               KJCRangeJob::block - KJCSensorBlockGenerator::block_size);
+  job->values = std::make_unique<int32_t[]>(KJCRangeJob::block * session.channels.count);
+  job->started = clk::now();
+  encoder.Literal("TEST;RESULT=RANGE;SAMPLES=").Number(job->requested).Literal(";");
+  SendMessage(socket, peer, peer_len, encoder);
+  if (job->requested == 0)
+  {
+    FinishRange(socket, *job);
+    return;
+  }
+  range_queue.push_back(std::move(job));
+}
+
+/* Each turn sends datagrams of the job at the front, which then goes to the
+   back, so a long range doesn't keep the others waiting. Like resends they
+   only go out while no sample is about to be due. Nor do they go out while
+   half the send buffer is queued, where EPOLLOUT tells the socket writable
+   again: the other half is left to the live streams, which then never see
+   EAGAIN because of a range. */
+bool KJCSensorServer::ServeRanges(int socket, clk::duration lead)
+{
+  for (size_t sent = 0; sent < max_range_sends_per_turn && !range_queue.empty();
+      ++sent)
+  {
+    if (!schedule.empty() && clock.Now() + resend_slack > schedule.top().deadline - lead)
+    {
+      return true;
+    }
+    int queued = 0;
+    if (ioctl(socket, SIOCOUTQ, &queued) == 0 && size_t(queued) > send_buffer / 2)
+    {
+      return false;
+    }
+    KJCRangeJob &job = *range_queue.front();
+    KJCSession &session = job.session;
+    KJCMessageEncoder encoder { range_datagram, sizeof(range_datagram) };
+    size_t count = FormatRange(encoder, job);
+    ssize_t bytes_sent = sendto(socket, encoder.Data(), encoder.Size(), 0,
+                                (struct sockaddr*) &session.peer_address,
+                                session.peer_len);
+    if (bytes_sent < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+      {
+        /* Sent again once there is room */
+        return false;
+      }
+      fprintf(stderr, "Error on sendto() of a range. Errno (%d)\n", errno);
+    }
+    else
+    {
+      if (tx_timestamps != nullptr)
+      {
+        tx_timestamps->Sent(1);
+      }
+      session.samples_sent += count;
+      session.sends++;
+    }
+    std::unique_ptr<KJCRangeJob> front = std::move(range_queue.front());
+    range_queue.pop_front();
+    if (bytes_sent < 0 || session.samples_sent == job.end)
+    {
+      FinishRange(socket, job);
+    }
+    else
+    {
+      range_queue.push_back(std::move(front));
+    }
+  }
+  return true;
+}
+
+size_t KJCSensorServer::FormatRange(KJCMessageEncoder &encoder, KJCRangeJob &job)
+{
+  KJCSession &session = job.session;
+  uint64_t next = session.samples_sent;
+  size_t count = size_t(std::min<uint64_t>(job.end - next, job.per_datagram));
+  if (next < job.buffered_first || next + count > job.buffered_first + job.buffered_count)
+  {
+    /* What is left of the block is generated again with the next one. The
+       generator reseeds every block_size samples from the first, so starting
+       on a multiple of it gives the same values whatever the format. */
+    job.buffered_first = next - next % KJCSensorBlockGenerator::block_size;
+    job.buffered_count = size_t(std::min<uint64_t>(job.end - job.buffered_first,
+                                                   KJCRangeJob::block));
+    session.generator.Generate(int64_t(job.buffered_first) * session.rate,
+                               job.buffered_count,
+                               job.values.get(), KJCRangeJob::block);
+  }
+  const int32_t *values = job.values.get() + (next - job.buffered_first);
+  clk::time_point first = session.start_timepoint + int64_t(next) * session.rate;
+  if (session.format == KJCWireFormat::Frame)
+  {
+    return FormatFrame(encoder, session, values, KJCRangeJob::block, count, first,
+                       sizeof(range_datagram));
+  }
+  /* A record can take up to sample_size_bound bytes, a line one more */
+  size_t packed = 0;
+  for (; packed < count
+      && encoder.Size() + session.sample_size_bound + 1 <= sizeof(range_datagram);
+      ++packed)
+  {
+    clk::time_point current = first + int64_t(packed) * session.rate;
+    if (session.format == KJCWireFormat::Binary)
+    {
+      FormatSensorValueBinary(encoder, session.channels, values + packed,
+                              KJCRangeJob::block, current,
+                              session.start_timepoint, session.resolution);
+    }
+    else
+    {
+      FormatSensorValue(encoder, *session.labels, session.channels,
+                        values + packed, KJCRangeJob::block, current,
+                        session.start_timepoint, session.resolution);
+      encoder.Literal("\n");
+    }
+  }
+  return packed;
+}
+
+void KJCSensorServer::FinishRange(int socket, const KJCRangeJob &job)
+{
+  const KJCSession &session = job.session;
+  uint64_t sent = session.samples_sent - (job.end - job.requested);
+  double seconds = std::chrono::duration<double> { clk::now() - job.started }.count();
+  printf("Range finished: %" PRIu64 " of %" PRIu64 " samples in %" PRIu64
+         " datagrams over %.3f s, %.0f samples/s\n", sent, job.requested,
+         session.sends, seconds, seconds > 0 ? double(sent) / seconds : 0.0);
+  KJCMessageEncoder encoder = OutgoingMessage();
+  encoder.Literal("TEST;RESULT=RANGE_DONE;SAMPLES=").Number(sent).Literal(";");
+  SendMessage(socket, (struct sockaddr*) &session.peer_address, session.peer_len,
+              encoder);
+}
+
+bool KJCSensorServer::CancelRange(int socket,
+                                  const struct sockaddr_storage &peer_address)
+{
+  KJCPeerKey key = KJCPeerKey::FromAddress(peer_address);
+  for (auto job = range_queue.begin(); job != range_queue.end(); ++job)
+  {
+    if (KJCPeerKey::FromAddress((*job)->session.peer_address) == key)
+    {
+      FinishRange(socket, **job);
+      range_queue.erase(job);
+      return true;
+    }
+  }
+  return false;
+}
+
+KJCSensorServer::KJCSensorServer(const KJCServerOptions &options) :
+    pacer(options.pipeline_depth > 0 ? KJCPacingMode::Timerfd : options.pacing_mode),
+    clock(options.speed), model(options.model), traces(options.traces), recorder(options.recorder),
+    realtime(options.realtime), resend_buffer(options.resend_buffer),
+    resend_rate(options.resend_rate), max_idle_sessions(options.idle_sessions),
+    publish(options.publish),
+    generate(options.generate)
+{
+  if (publish != nullptr && publish->mode == KJCPublishMode::Local)
+  {
+    publisher.subscribers = &subscribers;
+  }
+  if (generate != nullptr)
+  {
+    generated.output = generate->file.get();
+  }
+  if (options.pipeline_depth > 0)
+  {
+    pipeline = std::make_unique<KJCSamplePipeline>(options.pipeline_depth,
+                                                   options.pacing_mode);
+  }
+  if (recorder != nullptr)
+  {
+    record_ring = recorder->AddRing();
+  }
+  if (options.tx_timestamps)
+  {
+    tx_timestamps = std::make_unique<KJCTxTimestamps>();
+  }
+  shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (shutdown_fd < 0)
+  {
+    fprintf(stderr, "eventfd() failed. (%d)\n", errno);
+    exit(1);
+  }
+}
+
+KJCSensorServer::~KJCSensorServer()
+{
+  close(shutdown_fd);
+}
+
+void KJCSensorServer::Shutdown()
+{
+  running = false;
+  /* Only write() here, so this stays async-signal-safe */
+  uint64_t one = 1;
+  if (write(shutdown_fd, &one, sizeof(one)) < 0)
+  {
+    /* The counter can only be full if we've been told many times already */
+  }
+}
+
+void KJCSensorServer::DropStaleEntries()
+{
+  while (!schedule.empty()
+      && schedule.top().generation != schedule.top().session->generation)
+  {
+    ListIdle(*Unschedule().session);
+  }
+}
+
+void KJCSensorServer::Schedule(clk::time_point deadline, KJCSession &session,
+                               uint64_t generation)
+{
+  session.references++;
+  schedule.push( { deadline, &session, generation });
+}
+
+KJCScheduleEntry KJCSensorServer::Unschedule()
+{
+  KJCScheduleEntry entry = schedule.top();
+  schedule.pop();
+  entry.session->references--;
+  return entry;
+}
+
+/* The published and the generated stream aren't in the table */
+void KJCSensorServer::ListIdle(KJCSession &session)
+{
+  if (session.idle_listed || session.state == KJCSessionState::Started
+      || session.references > 0 || session.resend_queued
+      || &session == &publisher || &session == &generated)
+  {
+    return;
+  }
+  session.idle_position = idle_sessions.insert(idle_sessions.end(), &session);
+  session.idle_listed = true;
+}
+
+void KJCSensorServer::UnlistIdle(KJCSession &session)
+{
+  if (session.idle_listed)
+  {
+    idle_sessions.erase(session.idle_position);
+    session.idle_listed = false;
+  }
+}
+
+/* Nothing points at a listed session, so it can go; only its TX timestamps
+   may still come, and those are forgotten */
+void KJCSensorServer::EvictIdleSessions()
+{
+  while (idle_sessions.size() > max_idle_sessions)
+  {
+    KJCSession &session = *idle_sessions.front();
+    idle_sessions.pop_front();
+    if (tx_timestamps != nullptr)
+    {
+      tx_timestamps->Forget(session);
+    }
+    sessions.erase(KJCPeerKey::FromAddress(session.peer_address));
+  }
+}
+
+/* Send every sample that is due, oldest deadline first. Each session gets at
+   most about one sample per call, and no more than max_sends_per_turn go out
+   before the loop looks at the socket again, so a backlog can't keep us here
+   or hold up a STOP. */
+void KJCSensorServer::ServeDueSessions(int socket)
+{
+  clk::time_point now = clock.Now();
+  /* On the unlimited clock every turn is a full one */
+  size_t budget = clock.Unlimited() ? max_sends_per_turn :
+      std::min(schedule.size(), max_sends_per_turn);
+  while (budget-- > 0 && !schedule.empty())
+  {
+    if (clock.Unlimited())
+    {
+      /* Nothing waits: time moves straight on to the next deadline */
+      clock.AdvanceTo(schedule.top().deadline);
+      now = clock.Now();
+    }
+    if (schedule.top().deadline > now)
+    {
+      break;
+    }
+    KJCScheduleEntry entry = Unschedule();
+    KJCSession &session = *entry.session;
+    if (entry.generation != session.generation)
+    {
+      /* Stopped or restarted since this entry was queued */
+      ListIdle(session);
+      continue;
+    }
+    if ((session.samples_sent > 0 && session.Ended(entry.deadline, now))
+        || (session.trace != nullptr && session.samples_sent
+            + std::max<uint64_t>(session.window, 1) > session.trace->sample_count))
+    {
+      /* Survey finished, or the trace has no whole window left. The slot's
+         own time decides, not when we got to it: DURATION/RATE samples. */
+      ReportSession(session);
+      session.state = KJCSessionState::Idle;
+      session.generation++;
+      if (session.output == nullptr)
+      {
+        SendIdleStatusMessage(socket, (struct sockaddr*) &session.peer_address,
+                              session.peer_len);
+      }
+      if (&session == &generated)
+      {
+        /* --generate has done its job */
+        Shutdown();
+      }
+      ListIdle(session);
+      continue;
+    }
+    clk::duration lateness = now - entry.deadline;
+    total_lateness += lateness;
+    entry.deadline = SkipMissedSlots(session, entry.deadline, now);
+    /* Aggregates always go one window at a time */
+    uint64_t coalesce = session.overrun == KJCOverrunPolicy::Coalesce
+        && session.window == 0 ? MissedSlots(session, entry.deadline, now) : 0;
+    uint64_t samples_before = session.samples_sent;
+    uint32_t first_key = tx_timestamps != nullptr ? tx_timestamps->NextKey() : 0;
+    size_t delivered;
+    clk::time_point next_timepoint;
+    if (session.window > 0)
+    {
+      KJCMessageEncoder encoder = OutgoingMessage();
+      FormatAggregate(encoder, session, entry.deadline);
+      KeepForResend(session, session.samples_sent, session.window, encoder);
+      delivered = SendStreamMessage(socket, session, encoder) ? 1 : 0;
+      session.samples_sent += session.window;
+      session.sends++;
+      total_samples_sent++;
+      next_timepoint = entry.deadline + session.Period();
+    }
+    else if (session.batch_window > clk::duration { 0 } || coalesce > 0)
+    {
+      /* Coalesced, the batch reaches at least to the last slot that is due */
+      next_timepoint = SendBatchedSamples(socket, session, entry.deadline,
+          entry.deadline + std::max(session.batch_window,
+                                    int64_t(coalesce) * session.rate), delivered);
+    }
+    else
+    {
+      int32_t values[KJCSensorModel::max_channels];
+      const int32_t *sample_values = SampleValues(session, entry.deadline, values);
+      StageRecord(session, sample_values, 1, entry.deadline);
+      delivered = SendSensorValue(socket, session, sample_values, entry.deadline) ? 1 : 0;
+      session.samples_sent++;
+      session.sends++;
+      total_samples_sent++;
+      next_timepoint = entry.deadline + session.rate;
+    }
+
+    Schedule(next_timepoint, session, entry.generation);
+    clk::time_point sent = clock.Now();
+    /* Aggregates aren't recorded */
+    CommitRecords(session.window > 0 ? 0 : delivered, sent);
+    if (tx_timestamps != nullptr)
+    {
+      tx_timestamps->Expect(session, first_key, entry.deadline);
+    }
+#if KJC_ENABLE_STATS
+    /* Reuses the clock reads the loop makes anyway */
+    KJCSessionStats &stats = session.stats;
+    stats.lateness.Record(lateness);
+    stats.send_time.Record(sent - now);
+    stats.sent += delivered;
+    uint64_t samples = session.window > 0 ? session.window :
+        session.samples_sent - samples_before;
+    stats.failed += (session.window > 0 ? 1 : samples) - delivered;
+    if (session.rate > clk::duration { 0 } && lateness >= session.Period())
+    {
+      stats.overrun++;
+    }
+    if (coalesce > 0)
+    {
+      stats.coalesced += std::min(coalesce, samples - 1);
+    }
+    else if (session.rate > clk::duration { 0 } && now - entry.deadline >= session.Period())
+    {
+      stats.burst += samples;
+    }
+#else
+    (void) samples_before;
+#endif
+    now = sent;
+  }
+}
+
+uint64_t KJCSensorServer::MissedSlots(const KJCSession &session,
+                                      clk::time_point deadline,
+                                      clk::time_point now)
+{
+  clk::duration period = session.Period();
+  clk::duration left = session.end_timepoint - deadline;
+  if (period <= clk::duration { 0 } || now - deadline < period
+      || left <= clk::duration { 0 })
+  {
+    return 0;
+  }
+  /* The last slot before the end of the survey is as far as it goes */
+  uint64_t missed = std::min(uint64_t((now - deadline) / period),
+                             uint64_t((left - clk::duration { 1 }) / period));
+  if (session.trace != nullptr)
+  {
+    /* The caller has checked a whole window is left */
+    uint64_t samples = std::max<uint64_t>(session.window, 1);
+    missed = std::min(missed, (session.trace->sample_count - session.samples_sent)
+        / samples - 1);
+  }
+  return missed;
+}
+
+clk::time_point KJCSensorServer::SkipMissedSlots(KJCSession &session,
+                                                 clk::time_point deadline,
+                                                 clk::time_point now)
+{
+  if (session.overrun != KJCOverrunPolicy::Skip)
+  {
+    return deadline;
+  }
+  uint64_t missed = MissedSlots(session, deadline, now);
+  /* The samples keep their numbers, so FRAME and RESEND see the gap */
+  uint64_t samples = missed * std::max<uint64_t>(session.window, 1);
+  session.samples_sent += samples;
+#if KJC_ENABLE_STATS
+  session.stats.skipped += samples;
+#endif
+  return deadline + int64_t(missed) * session.Period();
+}
+
+/* Samples go out ahead of their deadlines, but each carries its own TIME. The
+   first is always sent (it is due); later ones only if inside the window, not
+   past the end of the survey, and sure to fit in the batch's payloads, or for
+   a frame session in one frame. */
+clk::time_point KJCSensorServer::SendBatchedSamples(int socket,
+                                                    KJCSession &session,
+                                                    clk::time_point deadline,
+                                                    clk::time_point window_end,
+                                                    size_t &delivered)
+{
+  bool frame = session.format == KJCWireFormat::Frame;
+  size_t capacity = frame ? max_frame_size - frame_header_size :
+      KJCSendBatch::payload_capacity;
+  clk::time_point first_deadline = deadline;
+  size_t count = 0;
+  do
+  {
+    count++;
+    deadline += session.rate;
+  }
+  while (count < KJCSendBatch::max_messages && deadline <= window_end
+      && deadline < session.end_timepoint && session.rate > clk::duration { 0 }
+      && (count + 1) * session.sample_size_bound <= capacity
+      && (session.trace == nullptr
+          || session.samples_sent + count < session.trace->sample_count));
+
+  /* Values for the whole batch in one go, a row per channel; a trace has
+     them already */
+  if (session.trace == nullptr)
+  {
+    session.generator.Generate(first_deadline - session.start_timepoint, count,
+                               &batch.values[0][0], KJCSendBatch::max_messages);
+  }
+
+  deadline = first_deadline;
+  char *payload = batch.payloads;
+  int32_t scratch[KJCSensorModel::max_channels];
+  for (batch.count = 0; batch.count < count; ++batch.count)
+  {
+    const int32_t *values = &batch.values[0][batch.count];
+    size_t stride = KJCSendBatch::max_messages;
+    if (session.trace != nullptr)
+    {
+      values = TraceValues(session, session.samples_sent + batch.count, scratch);
+      stride = 1;
+    }
+    StageRecord(session, values, stride, deadline);
+    if (frame)
+    {
+      /* The frame is encoded from rows, as the generator writes them */
+      for (size_t k = 0; session.trace != nullptr && k < session.channels.count; ++k)
+      {
+        batch.values[k][batch.count] = values[k];
+      }
+      deadline += session.rate;
+      continue;
+    }
+    KJCMessageEncoder encoder { payload, session.sample_size_bound };
+    if (session.format == KJCWireFormat::Binary)
+    {
+      FormatSensorValueBinary(encoder, session.channels, values, stride,
+                              deadline, session.start_timepoint, session.resolution);
+    }
+    else
+    {
+      FormatSensorValue(encoder, *session.labels, session.channels, values,
+                        stride, deadline, session.start_timepoint, session.resolution);
+    }
+    batch.vectors[batch.count].iov_base = payload;
+    batch.vectors[batch.count].iov_len = encoder.Size();
+    KeepForResend(session, session.samples_sent + batch.count, 1, encoder);
+    payload += encoder.Size();
+    deadline += session.rate;
+  }
+
+  if (frame)
+  {
+    KJCMessageEncoder encoder { batch.payloads, max_frame_size };
+    FormatFrame(encoder, session, &batch.values[0][0], KJCSendBatch::max_messages,
+                count, first_deadline);
+    KeepForResend(session, session.samples_sent, count, encoder);
+    batch.vectors[0].iov_base = batch.payloads;
+    batch.vectors[0].iov_len = encoder.Size();
+    batch.count = 1;
+    /* Every sample in the frame or none */
+    delivered = SendBatch(socket, session) * count;
+  }
+  else
+  {
+    delivered = SendBatch(socket, session);
+  }
+  session.samples_sent += count;
+  total_samples_sent += count;
+  return deadline;
+}
+
+size_t KJCSensorServer::SendBatch(int socket, KJCSession &session)
+{
+  session.sends++;
+  if (session.output != nullptr)
+  {
+    size_t written = 0;
+    while (written < batch.count && session.output->Write(
+        (const char*) batch.vectors[written].iov_base, batch.vectors[written].iov_len,
+        session.format == KJCWireFormat::Ascii))
+    {
+      written++;
+    }
+    return written;
+  }
+  if (session.subscribers == nullptr)
+  {
+    return SendBatchTo(socket, session.peer_address, session.peer_len);
+  }
+  size_t delivered = batch.count;
+  for (const KJCSubscriber &subscriber : *session.subscribers)
+  {
+    delivered = std::min(delivered, SendBatchTo(socket, subscriber.address,
+                                                subscriber.address_len));
+  }
+  return delivered;
+}
+
+size_t KJCSensorServer::SendBatchTo(int socket,
+                                    const struct sockaddr_storage &address,
+                                    socklen_t address_len)
+{
+  bool same_length = true;
+  for (size_t i = 1; i < batch.count; ++i)
+  {
+    same_length = same_length
+        && batch.vectors[i].iov_len == batch.vectors[0].iov_len;
+  }
+  if (gso_supported && same_length && batch.count > 1)
+  {
+    /* The kernel splits the concatenated payloads into datagrams of gso_size */
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void*) &address;
+    message.msg_namelen = address_len;
+    message.msg_iov = batch.vectors;
+    message.msg_iovlen = batch.count;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_UDP;
+    header->cmsg_type = UDP_SEGMENT;
+    header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gso_size = batch.vectors[0].iov_len;
+    memcpy(CMSG_DATA(header), &gso_size, sizeof(gso_size));
+    if (sendmsg(socket, &message, 0) >= 0)
+    {
+      if (tx_timestamps != nullptr)
+      {
+        tx_timestamps->Sent(1);
+      }
+      return batch.count;
+    }
+    if (errno != EINVAL && errno != EIO && errno != ENOPROTOOPT)
+    {
+      fprintf(stderr, "Error on sendmsg(). Errno (%d)\n", errno);
+      return 0;
+    }
+    /* Kernel or device without UDP GSO; don't try again */
+    fprintf(stderr, "UDP_SEGMENT not supported (%d), using sendmmsg()\n", errno);
+    gso_supported = false;
+  }
+
+  for (size_t i = 0; i < batch.count; ++i)
+  {
+    memset(&batch.headers[i], 0, sizeof(batch.headers[i]));
+    batch.headers[i].msg_hdr.msg_name = (void*) &address;
+    batch.headers[i].msg_hdr.msg_namelen = address_len;
+    batch.headers[i].msg_hdr.msg_iov = &batch.vectors[i];
+    batch.headers[i].msg_hdr.msg_iovlen = 1;
+  }
+  int messages_sent = sendmmsg(socket, batch.headers, batch.count, 0);
+  if (messages_sent < 0)
+  {
+    fprintf(stderr, "Error on sendmmsg(). Errno (%d)\n", errno);
+    return 0;
+  }
+  if (tx_timestamps != nullptr)
+  {
+    tx_timestamps->Sent(messages_sent);
+  }
+  if (size_t(messages_sent) < batch.count)
+  {
+    fprintf(stderr, "sendmmsg() sent %d of %zu messages\n", messages_sent,
+            batch.count);
+  }
+  return messages_sent;
+}
+
+const int32_t* KJCSensorServer::SampleValues(KJCSession &session,
+                                             clk::time_point deadline,
+                                             int32_t *scratch)
+{
+  if (session.trace != nullptr)
+  {
+    return TraceValues(session, session.samples_sent, scratch);
+  }
+  if (session.batch_window > clk::duration { 0 }
+      || session.overrun == KJCOverrunPolicy::Coalesce)
+  {
+    /* The same values the batch would have had */
+    session.generator.Generate(deadline - session.start_timepoint, 1, scratch, 1);
+    return scratch;
+  }
+  double time_seconds = (std::chrono::duration<double, std::ratio<1,1>> { deadline
+      - session.start_timepoint }).count();
+  for (size_t k = 0; k < session.channels.count; ++k)
+  {
+    scratch[k] = model.Value(session.channels.channels[k], time_seconds);
+  }
+  return scratch;
+}
+
+/* The loop's half of --pipeline. Samples are encoded here exactly as
+   ServeDueSessions() would send them, except that each goes out on its own at
+   its own deadline, batched session or not. */
+void KJCSensorServer::GenerateDueSamples()
+{
+  clk::time_point horizon = clk::now() + pipeline_lookahead;
+  size_t budget = std::min(schedule.size(), max_sends_per_turn);
+  while (budget-- > 0 && schedule.top().deadline <= horizon)
+  {
+    KJCScheduleEntry entry = schedule.top();
+    KJCSession &session = *entry.session;
+    if (entry.generation != session.generation)
+    {
+      Unschedule();
+      ListIdle(session);
+      continue;
+    }
+    KJCPipelineSlot *slot = pipeline->Reserve();
+    if (slot == nullptr)
+    {
+      pipeline_full = true;
+      return;
+    }
+    /* A reference until ReclaimPipelineSlots() has the slot back */
+    slot->session = &session;
+    session.references++;
+    slot->generation = entry.generation;
+    slot->peer_address = session.peer_address;
+    slot->peer_len = session.peer_len;
+    slot->send_at = entry.deadline;
+    slot->first = session.samples_sent == 0;
+    slot->skipped = false;
+    KJCMessageEncoder encoder { slot->payload, sizeof(slot->payload) };
+    if (session.describe_stream)
+    {
+      /* Ahead of the first sample, which keeps its place in the schedule */
+      slot->kind = KJCPipelineSlot::Kind::Stream;
+      slot->record.stream = session.record_stream;
+      DescribeStream(session, encoder);
+      session.describe_stream = false;
+    }
+    else if ((session.samples_sent > 0
+              && session.Ended(entry.deadline, clk::now()))
+        || (session.trace != nullptr && session.samples_sent
+            + std::max<uint64_t>(session.window, 1) > session.trace->sample_count))
+    {
+      /* Survey finished; the session ends when the transmit thread has sent this */
+      Unschedule();
+      slot->kind = KJCPipelineSlot::Kind::Idle;
+      encoder.Literal("STATUS;STATE=IDLE;");
+    }
+    else if (session.window > 0)
+    {
+      Unschedule();
+      entry.deadline = SkipMissedSlots(session, entry.deadline, clk::now());
+      slot->send_at = entry.deadline;
+      FormatAggregate(encoder, session, entry.deadline);
+      KeepForResend(session, session.samples_sent, session.window, encoder);
+      slot->kind = KJCPipelineSlot::Kind::Aggregate;
+      session.samples_sent += session.window;
+      Schedule(entry.deadline + session.Period(), session, entry.generation);
+    }
+    else
+    {
+      Unschedule();
+      entry.deadline = SkipMissedSlots(session, entry.deadline, clk::now());
+      slot->send_at = entry.deadline;
+      int32_t scratch[KJCSensorModel::max_channels];
+      const int32_t *values = SampleValues(session, entry.deadline, scratch);
+      if (session.format == KJCWireFormat::Binary)
+      {
+        FormatSensorValueBinary(encoder, session.channels, values, 1,
+                                entry.deadline, session.start_timepoint,
+                                session.resolution);
+      }
+      else if (session.format == KJCWireFormat::Frame)
+      {
+        FormatFrame(encoder, session, values, 1, 1, entry.deadline);
+      }
+      else
+      {
+        FormatSensorValue(encoder, *session.labels, session.channels, values, 1,
+                          entry.deadline, session.start_timepoint, session.resolution);
+      }
+      if (record_ring != nullptr)
+      {
+        FillRecord(slot->record, session, values, 1, entry.deadline);
+      }
+      KeepForResend(session, session.samples_sent, 1, encoder);
+      slot->kind = KJCPipelineSlot::Kind::Sample;
+      session.samples_sent++;
+      Schedule(entry.deadline + session.rate, session, entry.generation);
+    }
+    slot->size = encoder.Size();
+    slot->published_at = clk::now();
+    pipeline->Publish();
+  }
+}
+
+void KJCSensorServer::ReclaimPipelineSlots()
+{
+  KJCPipelineSlot *slot;
+  while ((slot = pipeline->Reclaim()) != nullptr)
+  {
+    KJCSession &session = *slot->session;
+    session.references--;
+    if (slot->skipped || slot->generation != session.generation)
+    {
+      ListIdle(session);
+      continue;
+    }
+    if (slot->kind == KJCPipelineSlot::Kind::Idle)
+    {
+      ReportSession(session);
+      session.state = KJCSessionState::Idle;
+      session.generation++;
+      ListIdle(session);
+      continue;
+    }
+    if (slot->kind != KJCPipelineSlot::Kind::Sample
+        && slot->kind != KJCPipelineSlot::Kind::Aggregate)
+    {
+      continue;
+    }
+    session.sends++;
+    total_samples_sent++;
+    total_lateness += slot->lateness;
+#if KJC_ENABLE_STATS
+    KJCSessionStats &stats = session.stats;
+    stats.lateness.Record(slot->lateness);
+    stats.send_time.Record(slot->send_time);
+    stats.sent += slot->delivered;
+    stats.failed += !slot->delivered;
+    if (session.rate > clk::duration { 0 } && slot->lateness >= session.Period())
+    {
+      stats.overrun++;
+      stats.burst += slot->kind == KJCPipelineSlot::Kind::Aggregate ? session.window : 1;
+    }
+#endif
+  }
+}
+
+/* The transmit thread's half of --pipeline: it waits for each slot's time in
+   the chosen pacing mode and sends it, nothing else. It only reads the
+   sessions' generations; everything it learns goes back in the slot. */
+void KJCSensorServer::Transmit(int socket)
+{
+  KJCSamplePipeline &ring = *pipeline;
+  KJCPacer &transmit_pacer = ring.pacer;
+  if (realtime.ConfigureThread("transmit", transmit_cpu)
+      && KJCRealTimeProfile::Throttled())
+  {
+    transmit_pacer.UseRealTimeMargin();
+  }
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+  {
+    fprintf(stderr, "epoll_create1() failed. (%d)\n", errno);
+    exit(1);
+  }
+  for (int fd : { transmit_pacer.TimerFd(), ring.TransmitterFd() })
+  {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      fprintf(stderr, "epoll_ctl() failed. (%d)\n", errno);
+      exit(1);
+    }
+  }
+
+  transmit_pacer.ResetReport();
+  bool stream_ended = false;
+  while (running)
+  {
+    KJCPipelineSlot *slot = ring.Front();
+    if (slot == nullptr)
+    {
+      ring.WantPublish(true);
+      slot = ring.Front();
+      if (slot != nullptr)
+      {
+        ring.WantPublish(false);
+      }
+    }
+    if (slot == nullptr || !transmit_pacer.Near(slot->send_at))
+    {
+      if (slot == nullptr)
+      {
+        if (stream_ended && transmit_pacer.lateness.count > 0)
+        {
+          transmit_pacer.ReportAndReset(stdout);
+        }
+        stream_ended = false;
+        transmit_pacer.Disarm();
+      }
+      else
+      {
+        transmit_pacer.Arm(slot->send_at);
+      }
+      struct epoll_event events[2];
+      int ready = epoll_wait(epoll_fd, events, 2, -1);
+      if (ready < 0 && errno != EINTR)
+      {
+        fprintf(stderr, "epoll_wait() failed. (%d)\n", errno);
+        break;
+      }
+      for (int i = 0; i < ready; ++i)
+      {
+        if (events[i].data.fd == transmit_pacer.TimerFd())
+        {
+          transmit_pacer.Acknowledge();
+        }
+        else
+        {
+          ring.TransmitterWoken();
+        }
+      }
+      continue;
+    }
+
+    if (slot->generation != slot->session->generation.load(std::memory_order_acquire))
+    {
+      slot->skipped = true;
+      ring.Release(false);
+      continue;
+    }
+    if (slot->kind == KJCPipelineSlot::Kind::Stream)
+    {
+      PublishStreamDescription(*record_ring, slot->record.stream, slot->payload,
+                               slot->size);
+      ring.Release(false);
+      continue;
+    }
+    while (!transmit_pacer.FinishWait(slot->send_at))
+    {
+      /* Hybrid spins the last stretch; the other modes have slept through it */
+    }
+    if (!slot->first && slot->published_at > slot->send_at)
+    {
+      ring.ring_empty.store(ring.ring_empty.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+    }
+    clk::time_point begin = clk::now();
+    ssize_t bytes_sent = sendto(socket, slot->payload, slot->size, 0,
+                                (struct sockaddr*) &slot->peer_address,
+                                slot->peer_len);
+    clk::time_point sent = clk::now();
+    if (bytes_sent < 0)
+    {
+      fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+    }
+    slot->delivered = bytes_sent >= 0;
+    slot->lateness = begin - slot->send_at;
+    slot->send_time = sent - begin;
+    if (slot->kind == KJCPipelineSlot::Kind::Sample && slot->delivered
+        && record_ring != nullptr)
+    {
+      KJCRecord *record = record_ring->Reserve(0);
+      if (record == nullptr)
+      {
+        record_ring->CountDropped(1);
+      }
+      else
+      {
+        *record = slot->record;
+        record->sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            sent.time_since_epoch()).count();
+        record_ring->Publish(1);
+      }
+    }
+    stream_ended = slot->kind == KJCPipelineSlot::Kind::Idle;
+    /* The loop learns a stream has ended as soon as its last message is out */
+    ring.Release(stream_ended);
+  }
+  if (transmit_pacer.lateness.count > 0)
+  {
+    transmit_pacer.Report(stdout);
+  }
+  close(epoll_fd);
+}
+
+const int32_t* KJCSensorServer::TraceValues(KJCSession &session,
+                                            uint64_t sample, int32_t *scratch)
+{
+  const KJCTrace &trace = *session.trace;
+  trace.Prefetch(sample, session.prefetched_until);
+  const int32_t *row = trace.Row(sample);
+  if (std::endian::native == std::endian::little
+      && session.channels.count == trace.channel_count)
+  {
+    /* Every channel, in file order: send straight from the mapping */
+    return row;
+  }
+  for (size_t k = 0; k < session.channels.count; ++k)
+  {
+    uint32_t value;
+    memcpy(&value, row + session.channels.channels[k], sizeof(value));
+    if (std::endian::native != std::endian::little)
+    {
+      value = __builtin_bswap32(value);
+    }
+    scratch[k] = int32_t(value);
+  }
+  return scratch;
+}
+
+/* The stream's description goes through the ring ahead of its samples, in as
+   many slots as its text needs */
+void KJCSensorServer::RecordStream(KJCSession &session)
+{
+  if (record_ring == nullptr)
+  {
+    return;
+  }
+  session.record_stream = recorder->NextStream();
+  if (pipeline != nullptr)
+  {
+    /* The transmit thread publishes to the ring; the description goes to it
+       through the pipeline, ahead of the first sample */
+    session.describe_stream = true;
+    return;
+  }
+  char text[KJCMessageBuffer::capacity];
+  KJCMessageEncoder encoder { text, sizeof(text) };
+  DescribeStream(session, encoder);
+  PublishStreamDescription(*record_ring, session.record_stream, text,
+                           encoder.Size());
+}
+
+void KJCSensorServer::DescribeStream(const KJCSession &session,
+                                     KJCMessageEncoder &encoder)
+{
+  char host[NI_MAXHOST];
+  char service[NI_MAXSERV];
+  if (getnameinfo((struct sockaddr*) &session.peer_address, session.peer_len,
+                  host, sizeof(host), service, sizeof(service),
+                  NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+  {
+    snprintf(host, sizeof(host), "?");
+    snprintf(service, sizeof(service), "?");
+  }
+  encoder.Literal("peer=").Text(host, strlen(host)).Literal(":").Text(
+      service, strlen(service)).Literal(";source=");
+  if (session.trace != nullptr)
+  {
+    encoder.Literal("trace:").Text(session.trace->name, strlen(session.trace->name));
+  }
+  else
+  {
+    encoder.Literal("model");
+  }
+  if (session.format == KJCWireFormat::Binary)
+  {
+    encoder.Literal(";format=BIN;channels=");
+  }
+  else if (session.format == KJCWireFormat::Frame)
+  {
+    encoder.Literal(";format=FRAME;channels=");
+  }
+  else
+  {
+    encoder.Literal(";format=ASCII;channels=");
+  }
+  for (size_t k = 0; k < session.channels.count; ++k)
+  {
+    size_t channel = session.channels.channels[k];
+    /* Without the '=' the label ends in */
+    encoder.Text(session.labels->text[channel], session.labels->size[channel] - 1);
+    encoder.Text(k + 1 < session.channels.count ? "," : ";", 1);
+  }
+  if (session.window > 0)
+  {
+    encoder.Literal("window=").Number(session.window).Literal(";");
+  }
+}
+
+void KJCSensorServer::PublishStreamDescription(KJCRecordRing &ring,
+                                               uint32_t stream,
+                                               const char *text, size_t size)
+{
+  size_t slots = (size + KJCRecord::text_capacity - 1) / KJCRecord::text_capacity;
+  for (size_t i = 0; i < slots; ++i)
+  {
+    KJCRecord *record = ring.Reserve(i);
+    if (record == nullptr)
+    {
+      ring.CountDropped(1);
+      return;
+    }
+    record->stream = stream;
+    record->channel_count = 0;
+    record->time_ms = size;
+    memcpy(record->text, text + i * KJCRecord::text_capacity,
+           std::min(size - i * KJCRecord::text_capacity, KJCRecord::text_capacity));
+  }
+  ring.Publish(slots);
+}
+
+void KJCSensorServer::FillRecord(KJCRecord &record, const KJCSession &session,
+                                 const int32_t *values, size_t stride,
+                                 clk::time_point current)
+{
+  record.stream = session.record_stream;
+  record.channel_count = session.channels.count;
+  record.time_ms = ElapsedTime(current, session.start_timepoint,
+                               KJCTimeResolution::Milliseconds);
+  for (size_t k = 0; k < session.channels.count; ++k)
+  {
+    record.values[k] = values[k * stride];
+  }
+}
+
+void KJCSensorServer::StageRecord(const KJCSession &session,
+                                  const int32_t *values, size_t stride,
+                                  clk::time_point current)
+{
+  if (record_ring == nullptr)
+  {
+    return;
+  }
+  /* Once the ring is full, the rest of this send is dropped too, so a slot
+     freed meanwhile can't put a later sample ahead of an earlier one */
+  KJCRecord *record = unstaged_records == 0 ?
+      record_ring->Reserve(staged_records) : nullptr;
+  if (record == nullptr)
+  {
+    unstaged_records++;
+    return;
+  }
+  staged_records++;
+  FillRecord(*record, session, values, stride, current);
+}
+
+void KJCSensorServer::CommitRecords(size_t delivered, clk::time_point sent)
+{
+  if (record_ring == nullptr)
+  {
+    return;
+  }
+  size_t published = std::min(delivered, staged_records);
+  int64_t sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      sent.time_since_epoch()).count();
+  for (size_t i = 0; i < published; ++i)
+  {
+    record_ring->Reserve(i)->sent_ns = sent_ns;
+  }
+  record_ring->Publish(published);
+  if (delivered > published)
+  {
+    record_ring->CountDropped(delivered - published);
+  }
+  staged_records = 0;
+  unstaged_records = 0;
+}
+
+const KJCTrace* KJCSensorServer::FindTrace(std::string_view name) const
+{
+  for (const std::shared_ptr<const KJCTrace> &trace : traces)
+  {
+    if (name == trace->name)
+    {
+      return trace.get();
+    }
+  }
+  return nullptr;
+}
+
+/* Achieved rate of a finished session; compare batched and unbatched streams by samples per send */
+void KJCSensorServer::ReportSession(const KJCSession &session)
+{
+  double seconds = std::chrono::duration<double> { clock.Now()
+      - session.start_timepoint }.count();
+  printf("Session finished: %" PRIu64 " samples in %" PRIu64
+         " sends over %.3f s, %.0f samples/s, %.1f samples/send (%s)\n",
+         session.samples_sent, session.sends, seconds,
+         seconds > 0 ? double(session.samples_sent) / seconds : 0.0,
+         session.sends > 0 ? double(session.samples_sent) / double(session.sends) : 0.0,
+         session.window > 0 ? "aggregated" :
+             session.batch_window > clk::duration { 0 } ? "batched" : "unbatched");
+}
+
+void KJCSensorServer::ReceiveCommands(int socket)
+{
+  for (size_t i = 0; i < KJCReceiveBatch::max_messages; ++i)
+  {
+    commands.vectors[i].iov_base = commands.payloads[i];
+    commands.vectors[i].iov_len = KJCReceiveBatch::max_message_size;
+    memset(&commands.headers[i], 0, sizeof(commands.headers[i]));
+    commands.headers[i].msg_hdr.msg_name = &commands.peer_addresses[i];
+    commands.headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    commands.headers[i].msg_hdr.msg_iov = &commands.vectors[i];
+    commands.headers[i].msg_hdr.msg_iovlen = 1;
+  }
+  int received = recvmmsg(socket, commands.headers, KJCReceiveBatch::max_messages,
+                          0, nullptr);
+  if (received < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+      fprintf(stderr, "Error on recvmmsg(). Errno (%d)\n", errno);
+    }
+    return;
+  }
+  for (int i = 0; i < received; ++i)
+  {
+    HandleCommand(socket, commands.peer_addresses[i],
+                  commands.headers[i].msg_hdr.msg_namelen, commands.payloads[i],
+                  commands.headers[i].msg_len);
+  }
+}
+
+void KJCSensorServer::HandleCommand(int socket,
+                                    const struct sockaddr_storage &peer_address,
+                                    socklen_t peer_len, const char *read,
+                                    size_t bytes_received)
+{
+  struct sockaddr *peer = (struct sockaddr*) &peer_address;
+  KJCCommand command = KJCCommandParser::Parse(read, bytes_received);
+  if (const KJCStartCommand *start = std::get_if<KJCStartCommand>(&command))
+  {
+    printf("Got a hit on a start command: %.*s\n", (int) bytes_received, read);
+    const KJCTrace *trace = nullptr;
+    if (!start->options.trace.empty()
+        && (trace = FindTrace(start->options.trace)) == nullptr)
+    {
+      SendErrorUnknownTraceMessage(socket, peer, peer_len);
+    }
+    else if (start->options.channel_mask & ~(trace != nullptr ?
+        KJCChannelSelection::AllOf(trace->channel_count) : model.AllChannels()))
+    {
+      SendErrorUnknownChannelMessage(socket, peer, peer_len);
+    }
+    /* Every slot of a model stream with RATE=0 has the first one's time, and
+       the unlimited clock only ever moves on to the next slot */
+    else if (start->rate == clk::duration { 0 } && trace == nullptr
+        && clock.Unlimited())
+    {
+      SendErrorBadRateMessage(socket, peer, peer_len);
+    }
+    /* Replies with a starting message unless this peer is already streaming */
+    else if (!StartSession(socket, peer_address, peer_len, start->duration,
+                      start->rate, start->options))
+    {
+      SendErrorAlreadyStartedMessage(socket, peer, peer_len);
+    }
+  }
+  else if (std::holds_alternative<KJCStopCommand>(command))
+  {
+    printf("Got a hit on the stop command: %.*s\n", (int) bytes_received, read);
+    /* Ends the peer's range as well; STOPPED comes from StopSession() if
+       there is a session to stop */
+    bool cancelled = CancelRange(socket, peer_address);
+    if (!StopSession(socket, peer_address))
+    {
+      if (cancelled)
+      {
+        SendStoppedMessage(socket, peer, peer_len);
+      }
+      else
+      {
+        SendErrorAlreadyStoppedMessage(socket, peer, peer_len);
+      }
+    }
+  }
+  else if (std::holds_alternative<KJCStatsCommand>(command))
+  {
+    printf("Got a hit on the stats command: %.*s\n", (int) bytes_received, read);
+    SendSessionStats(socket, peer_address, peer_len);
+  }
+  else if (const KJCResendCommand *resend = std::get_if<KJCResendCommand>(&command))
+  {
+    printf("Got a hit on the resend command: %.*s\n", (int) bytes_received, read);
+    HandleResend(socket, peer_address, peer_len, *resend);
+  }
+  else if (const KJCRangeCommand *range = std::get_if<KJCRangeCommand>(&command))
+  {
+    printf("Got a hit on the range command: %.*s\n", (int) bytes_received, read);
+    HandleRange(socket, peer_address, peer_len, *range);
+  }
+  else if (std::holds_alternative<KJCSubscribeCommand>(command)
+      || std::holds_alternative<KJCUnsubscribeCommand>(command))
+  {
+    printf("Got a hit on the subscribe command: %.*s\n", (int) bytes_received, read);
+    HandleSubscribe(socket, peer_address, peer_len,
+                    std::holds_alternative<KJCSubscribeCommand>(command));
+  }
+  else if (std::holds_alternative<KJCIdCommand>(command))
+  {
+    printf("Got a hit on the id command: %.*s\n", (int) bytes_received, read);
+    /* Send identification message back */
+    SendDiscoveryMessage(socket, peer, peer_len);
+  }
+  else
+  {
+    // TODO debug out the printf
+    printf("Got something that didn't recognize: %.*s\n",
+           (int) bytes_received, read);
+    /* Don't recognize this message so just ignore it */
+  }
+}
+
+/* Adds EPOLLOUT to the socket's events while ranges wait for room */
+static void WatchWritable(int epoll_fd, int socket, bool writable)
+{
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | (writable ? uint32_t(EPOLLOUT) : 0u);
+  event.data.fd = socket;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &event) < 0)
+  {
+    fprintf(stderr, "epoll_ctl() failed. (%d)\n", errno);
+  }
+}
+
+bool KJCSensorServer::ReachDeadline(clk::duration lead)
+{
+  if (clock.Unlimited())
+  {
+    /* ServeDueSessions() moves the clock on */
+    return true;
+  }
+  clk::time_point wakeup = NextWakeup(lead);
+  return pacer.Near(wakeup) && pacer.FinishWait(wakeup);
+}
+
+/* One thread does everything: it waits in epoll for a command, the pacing
+   timer or shutdown, handles every command that came in, then sends whatever
+   samples are due. Both halves are bounded, so neither can starve the other. */
+void KJCSensorServer::Serve(int socket)
+{
+  int flags = fcntl(socket, F_GETFL);
+  if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    fprintf(stderr, "Can't make the socket nonblocking. (%d)\n", errno);
+    return;
+  }
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+  {
+    fprintf(stderr, "epoll_create1() failed. (%d)\n", errno);
+    return;
+  }
+  if (tx_timestamps != nullptr && !tx_timestamps->Enable(socket))
+  {
+    tx_timestamps.reset();
+  }
+  if (realtime.ConfigureThread("worker", loop_cpu) && KJCRealTimeProfile::Throttled())
+  {
+    pacer.UseRealTimeMargin();
+  }
+  if (realtime.enabled)
+  {
+    /* Fault in the send and receive buffers before the first deadline */
+    memset(batch.headers, 0, sizeof(batch.headers));
+    memset(batch.vectors, 0, sizeof(batch.vectors));
+    memset(batch.payloads, 0, sizeof(batch.payloads));
+    memset(batch.values, 0, sizeof(batch.values));
+    memset(&commands, 0, sizeof(commands));
+    KJCMessageEncoder message = OutgoingMessage();
+    memset((void*) message.Data(), 0, KJCMessageBuffer::capacity);
+  }
+  std::vector<int> fds { socket, pacer.TimerFd(), shutdown_fd };
+  if (pipeline != nullptr)
+  {
+    fds.push_back(pipeline->GeneratorFd());
+  }
+  for (int fd : fds)
+  {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      fprintf(stderr, "epoll_ctl() failed. (%d)\n", errno);
+      close(epoll_fd);
+      return;
+    }
+  }
+
+  /* With a pipeline, samples are due for encoding a little before they are
+     due to be sent */
+  clk::duration lead = pipeline != nullptr ? pipeline_lookahead : clk::duration { 0 };
+  std::thread transmitter;
+  if (pipeline != nullptr)
+  {
+    transmitter = std::thread { &KJCSensorServer::Transmit, this, socket };
+  }
+  if (publish != nullptr && publish->mode == KJCPublishMode::Multicast
+      && publish_sender)
+  {
+    /* Bound to one address, the group goes out of its interface, so a
+       server bound to loopback publishes on loopback; else the route decides */
+    struct sockaddr_in bound;
+    socklen_t bound_len = sizeof(bound);
+    if (getsockname(socket, (struct sockaddr*) &bound, &bound_len) == 0
+        && bound.sin_addr.s_addr != htonl(INADDR_ANY)
+        && setsockopt(socket, IPPROTO_IP, IP_MULTICAST_IF, &bound.sin_addr,
+                      sizeof(bound.sin_addr)) < 0)
+    {
+      fprintf(stderr, "setsockopt(IP_MULTICAST_IF) failed. (%d)\n", errno);
+    }
+    StartPublishing();
+  }
+  if (generate != nullptr)
+  {
+    StartGenerating();
+  }
+  pacer.ResetReport();
+  while (running)
+  {
+    DropStaleEntries();
+    int timeout = -1;
+    if (schedule.empty() || pipeline_full)
+    {
+      /* Nothing to send; report how the pacing did and wait for a command */
+      if (schedule.empty() && pacer.lateness.count > 0)
+      {
+        pacer.ReportAndReset(stdout);
+        if (pipeline != nullptr)
+        {
+          printf("Pipeline (%zu slots): ring full %" PRIu64 ", ring empty %" PRIu64 "\n",
+                 pipeline->Depth(), pipeline->ring_full.load(),
+                 pipeline->ring_empty.load());
+        }
+      }
+      pacer.Disarm();
+    }
+    else if (clock.Unlimited() || pacer.Near(NextWakeup(lead)))
+    {
+      /* Close enough that we only check for commands before finishing the wait */
+      timeout = 0;
+    }
+    else
+    {
+      pacer.Arm(NextWakeup(lead));
+    }
+    if (!range_queue.empty() && !range_blocked)
+    {
+      /* More to send as soon as the commands are in */
+      timeout = 0;
+    }
+    if (!resend_queue.empty() && timeout != 0)
+    {
+      /* Back as soon as the rate allows another resend */
+      timeout = resend_tokens >= 1.0 ? 0 : 1;
+    }
+
+    struct epoll_event events[4];
+    int ready = epoll_wait(epoll_fd, events, 4, timeout);
+    if (ready < 0 && errno != EINTR)
+    {
+      fprintf(stderr, "epoll_wait() failed. (%d)\n", errno);
+      break;
+    }
+    if (pipeline != nullptr)
+    {
+      /* Before the commands, so STATS and START see sessions up to date */
+      ReclaimPipelineSlots();
+    }
+    for (int i = 0; i < ready; ++i)
+    {
+      if (events[i].data.fd == socket)
+      {
+        if (range_blocked && (events[i].events & EPOLLOUT))
+        {
+          range_blocked = false;
+          WatchWritable(epoll_fd, socket, false);
+        }
+        if (tx_timestamps != nullptr && (events[i].events & EPOLLERR))
+        {
+          /* Departures, often with no command waiting */
+          tx_timestamps->Drain(socket);
+        }
+        if (tx_timestamps == nullptr || (events[i].events & EPOLLIN))
+        {
+          ReceiveCommands(socket);
+        }
+      }
+      else if (events[i].data.fd == pacer.TimerFd())
+      {
+        pacer.Acknowledge();
+      }
+      else if (events[i].data.fd == shutdown_fd)
+      {
+        running = false;
+      }
+      else
+      {
+        pipeline->GeneratorWoken();
+        pipeline_full = false;
+      }
+    }
+
+    /* Commands may have started or stopped sessions, so look again */
+    DropStaleEntries();
+    if (running && !pipeline_full && !schedule.empty() && ReachDeadline(lead))
+    {
+      if (pipeline != nullptr)
+      {
+        GenerateDueSamples();
+      }
+      else
+      {
+        ServeDueSessions(socket);
+      }
+    }
+    if (running && !resend_queue.empty())
+    {
+      ServeResends(socket, lead);
+    }
+    if (running && !range_queue.empty() && !range_blocked
+        && !ServeRanges(socket, lead))
+    {
+      range_blocked = true;
+      WatchWritable(epoll_fd, socket, true);
+    }
+    EvictIdleSessions();
+  }
+  if (pipeline != nullptr)
+  {
+    pipeline->Stop();
+    transmitter.join();
+    ReclaimPipelineSlots();
   }
-
-  printf("Binding socket to local address...\n");
-  if (bind(*socket_listen, bind_address->ai_addr, bind_address->ai_addrlen))
+  if (pacer.lateness.count > 0)
   {
-    fprintf(stderr, "bind() failed. (%d)\n", errno);
-    exit(1);
+    pacer.Report(stdout);
   }
+  close(epoll_fd);
 }
 
-void KJCSensorServer::Cleanup(int socket)
-{
-  printf("Closing listening socket...\n");
-  close(socket);
-  printf("Finished.\n");
-}
-
-void KJCSensorServer::SleepSpecial(const clk::time_point &end_timepoint,
-                                   std::binary_semaphore &stop_signal)
+void KJCRealTimeProfile::LockMemory() const
 {
-  /* We get the linux kernel tick rate from HZ (included in <asm/param.h>), turn it into a duration,
-   and multiply by 2 to get a duration that we're pretty sure will be larger than our sleep time */
-  static std::chrono::duration<double> tick_interval { 1.0 / double(HZ) };
-  static std::chrono::duration<double> safe_tick_interval = 2.0 * tick_interval;
-
-
-  std::chrono::duration<double> sleep_time = ((end_timepoint
-      - safe_tick_interval) - clk::now());
-      
-  bool acquired = false;
-  if (sleep_time > std::chrono::duration<double> { 0 })
+  /* Locking future allocations too is only safe when the limit can't make
+     them fail later, e.g. a thread's stack */
+  struct rlimit limit;
+  bool unlimited = geteuid() == 0 || (getrlimit(RLIMIT_MEMLOCK, &limit) == 0
+      && limit.rlim_cur == RLIM_INFINITY);
+  if (mlockall(MCL_CURRENT | (unlimited ? MCL_FUTURE : 0)) < 0)
   {
-    //std::cout << std::string{"Before try_acquire_for() in main thread"} << std::endl;
-    acquired = stop_signal.try_acquire_for(sleep_time);
-    //std::cout << std::string{"After try_acquire_for() in main thread()"} << std::endl;
-    //std::cout << std::string{"Was it acquired? Return value of try_acquire_for() "} << acquired << std::endl;
-
+    fprintf(stderr, "Warning: can't lock memory, page faults may delay samples."
+            " Raise RLIMIT_MEMLOCK or run with CAP_IPC_LOCK. (%d)\n", errno);
   }
-  /* If unblocked by acquiring semaphore then end sleep immediately */
-  if (acquired)
+  else if (!unlimited)
   {
-    return;
+    fprintf(stderr, "Warning: memory locked, but not what is allocated from now on;"
+            " RLIMIT_MEMLOCK is limited.\n");
   }
-  /* Otherwise spin lock the rest of the time left */
-  while (clk::now() < end_timepoint);
-}
-
-constexpr std::size_t constexpr_strlen(const char *s)
-{
-  return std::char_traits<char>::length(s);
 }
 
-/* Stop command looks like following: "TEST;CMD=STOP;" */
-bool KJCSensorServer::ParseStopCommand(char *read, size_t bytes_received)
+bool KJCRealTimeProfile::ConfigureThread(const char *role, int cpu) const
 {
-  constexpr const char *stop_command = "TEST;CMD=STOP;";
-  constexpr size_t stop_command_length = constexpr_strlen(stop_command);
-  if (bytes_received != stop_command_length)
+  if (cpu >= 0)
   {
-    return false;
-  }
-  for (size_t i = 0; i < stop_command_length; ++i)
-  {
-    if (read[i] != stop_command[i])
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+    if (result != 0)
     {
-      return false;
+      fprintf(stderr, "Can't pin the %s thread to CPU %d. (%d)\n", role, cpu,
+              result);
     }
   }
-  return true;
-}
-
-/*
- Discovery message looks like following: "ID;"
- In response a message is sent back like: "ID;MODEL=m;SERIAL=n;"
- */
-bool KJCSensorServer::ParseIdCommand(char *read, size_t bytes_received)
-{
-  constexpr const char *id_command = "ID;";
-  constexpr size_t id_command_length = constexpr_strlen(id_command);
-  if (bytes_received != id_command_length)
+  if (!enabled)
   {
     return false;
   }
-  for (size_t i = 0; i < id_command_length; ++i)
+  struct sched_param parameters;
+  memset(&parameters, 0, sizeof(parameters));
+  parameters.sched_priority = priority;
+  int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+  if (result != 0)
   {
-    if (read[i] != id_command[i])
+    /* Once is enough; every thread would fail the same way */
+    static std::atomic<bool> warned { false };
+    if (!warned.exchange(true))
     {
-      return false;
+      fprintf(stderr, "Warning: can't use SCHED_FIFO, running as an ordinary task."
+              " Needs CAP_SYS_NICE or an rtprio limit of %d. (%d)\n", priority,
+              result);
     }
   }
-  return true;
+  PrefaultStack();
+  return result == 0;
 }
 
-/* 
- A start command looks like the following: "TEST;CMD=START;DURATION=s;RATE=ms;"
- We parse this as 5 segments, which are:
- - "TEST;CMD=START;DURATION=" also called the first constant segment
- - the duration field, signified by the s
- - ";RATE=" also called the second constant segment
- - the rate field, signified by the ms
- - ";" also called the third constant segment
-
- If the function returns false, then the character string in read does not match this format.
- If it returns true, we write the seconds and microseconds of the duration into the 3rd and 4th reference parameters,
- and the milliseconds and microseconds of the rate into the 5th and 6th reference parameters.
- */
-
-/* TODO KJC This is too complicated; would better with regular expression parsing, e.g.
-   Also parses floating point durations and rates which is unnecessary for the requirements */
-bool KJCSensorServer::ParseStartCommand(
-    char *read, size_t bytes_received, std::chrono::seconds &duration_seconds,
-    std::chrono::microseconds &duration_microseconds,
-    std::chrono::milliseconds &rate_milliseconds,
-    std::chrono::microseconds &rate_microseconds)
-{
-
-  constexpr const char *first_constant_segment = "TEST;CMD=START;DURATION=";
-  constexpr const char *second_constant_segment = ";RATE=";
-  constexpr const char *separator = ";";
-  constexpr const char *decimal_point = ".";
-  /* Assigning to a constexpr variable guarantees evaluation at compile time of a constexpr function */
-  /* Compute sizes minus the null termination byte */
-  constexpr size_t first_constant_segment_size = constexpr_strlen(
-      first_constant_segment);
-  constexpr size_t second_constant_segment_size = constexpr_strlen(
-      second_constant_segment);
-  constexpr size_t third_constant_segment_size = constexpr_strlen(separator);
-
-  if (bytes_received < first_constant_segment_size)
+void KJCRealTimeProfile::PrefaultStack()
+{
+  /* Well past what the loop uses, but far from the default 8 MB */
+  volatile char stack[256 * 1024];
+  for (size_t i = 0; i < sizeof(stack); i += 4096)
   {
-    return false;
+    stack[i] = 0;
   }
+}
 
-  /* We know we have a sufficient number of bytes for the first constant section, so we check if they're right */
-  size_t current_index;
-  for (current_index = 0; current_index < first_constant_segment_size;
-      ++current_index)
+bool KJCRealTimeProfile::Throttled()
+{
+  FILE *file = fopen("/proc/sys/kernel/sched_rt_runtime_us", "r");
+  if (file == nullptr)
   {
-    if (first_constant_segment[current_index] != read[current_index])
-    {
-      return false;
-    }
+    return true;
   }
-  /* After the send of the first segment */
-  /* Check that our indices are correct */
-  assert(current_index == first_constant_segment_size);
-  assert(
-      read[current_index - 1]
-          == first_constant_segment[first_constant_segment_size - 1]);
-
-  /* Parsing the duration field now. We assume it could contain a decimal point */
-  size_t last_index_duration_inclusive;
-  size_t first_index_duration_inclusive = current_index;
-  bool after_decimal_point = false;
+  long runtime = 0;
+  bool read = fscanf(file, "%ld", &runtime) == 1;
+  fclose(file);
+  return !read || runtime >= 0;
+}
 
-  while (1)
+bool KJCRealTimeProfile::ParseCpuList(const char *text, std::vector<int> &cpus)
+{
+  cpus.clear();
+  const char *current = text;
+  while (true)
   {
-    if (current_index >= bytes_received)
+    char *end;
+    unsigned long first = strtoul(current, &end, 10);
+    if (end == current || first >= CPU_SETSIZE)
     {
-      /* If parsing hasn't finished at the end of recv buffer, we have an incomplete message */
       return false;
     }
-    else if (read[current_index] == separator[0])
+    unsigned long last = first;
+    current = end;
+    if (*current == '-')
     {
-      /* Check if we're at a separator character indicating the end of the duration field */
-      if (current_index == first_constant_segment_size
-          || ((current_index == first_constant_segment_size + 1)
-              && after_decimal_point))
+      last = strtoul(current + 1, &end, 10);
+      if (end == current + 1 || last < first || last >= CPU_SETSIZE)
       {
-        /* Duration field was empty, or was just a decimal point */
         return false;
       }
-      else
-      {
-        /* Successfully parsed duration field */
-        last_index_duration_inclusive = current_index - 1;
-        break;
-      }
+      current = end;
     }
-    else if (read[current_index] == decimal_point[0])
+    for (unsigned long cpu = first; cpu <= last; ++cpu)
     {
-      if (after_decimal_point)
-      {
-        /* Second decimal point - error */
-        return false;
-      }
-      after_decimal_point = true;
+      cpus.push_back(int(cpu));
     }
-    else if (!isdigit(read[current_index]))
+    if (*current == '\0')
+    {
+      return true;
+    }
+    if (*current++ != ',')
     {
-      /* Not a digit or a separator or a decimal point - parsing error */
       return false;
     }
-    current_index++;
   }
-  size_t length_duration_string = last_index_duration_inclusive
-      - first_index_duration_inclusive + 1;
-  /* current_index is just past the end of the second section */
-  assert(read[current_index] == second_constant_segment[0]);
-  assert(
-      current_index == (first_constant_segment_size + length_duration_string));
-  
-  char *duration_string = (char*) malloc(length_duration_string + 1); /* Add spot for a null character at the end */
-  if (duration_string == nullptr)
+}
+
+KJCWorkerGroup::KJCWorkerGroup(const KJCServerOptions &options) :
+    options(options)
+{
+  cpu_set_t allowed;
+  if (this->options.workers == 0)
   {
-    fprintf(stderr, "OOM\n");
-    exit(1);
+    this->options.workers = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ?
+        CPU_COUNT(&allowed) : 1;
   }
-  memcpy(duration_string, read + first_constant_segment_size,
-         length_duration_string);
-  duration_string[length_duration_string] = '\0';
-  if (after_decimal_point)
+  for (unsigned i = 0; i < this->options.workers; ++i)
   {
-    double seconds = atof(duration_string);
-    duration_seconds = std::chrono::seconds { uint64_t(floor(seconds)) };
-    duration_microseconds = std::chrono::microseconds { uint64_t(
-        floor((seconds - floor(seconds)) * 1e6)) };
+    workers.push_back(std::make_unique<KJCSensorServer>(options));
+    /* One stream to the group; every worker answers SUBSCRIBE */
+    workers.back()->publish_sender = i == 0;
   }
-  else
+}
+
+int KJCWorkerGroup::Main()
+{
+  Bind();
+  if (options.realtime.enabled)
   {
-    int64_t seconds = atoi(duration_string);
-    duration_seconds = std::chrono::seconds { seconds };
-    duration_microseconds = std::chrono::microseconds { 0 };
+    options.realtime.LockMemory();
   }
-  free(duration_string);
-
-  /* Now we parse the second fixed part of the record */
+  Run();
+  for (int socket : sockets)
+  {
+    workers[0]->Cleanup(socket);
+  }
+  PrintJitterSummary(stdout);
+  return 0;
+}
 
-  if (bytes_received - (current_index + 1) < second_constant_segment_size)
+void KJCWorkerGroup::PrintJitterSummary(FILE *out) const
+{
+  KJCLatencyHistogram lateness;
+  for (const std::unique_ptr<KJCSensorServer> &worker : workers)
   {
-    return false;
+    lateness.Add(worker->SendPacer().run_lateness);
+  }
+  fprintf(out,
+          "Jitter summary (%s profile, %s pacing, %zu worker(s)): %" PRIu64
+          " deadlines, lateness mean %.1f us, p50 %.1f us, p99 %.1f us, "
+          "p99.9 %.1f us, max %.1f us\n",
+          options.realtime.enabled ? "rt" : "normal",
+          KJCPacer::ModeName(options.pacing_mode), workers.size(), lateness.count,
+          lateness.MeanNanoseconds() / 1e3,
+          double(lateness.PercentileNanoseconds(50)) / 1e3,
+          double(lateness.PercentileNanoseconds(99)) / 1e3,
+          double(lateness.PercentileNanoseconds(99.9)) / 1e3,
+          double(lateness.max_nanoseconds) / 1e3);
+  if (!options.tx_timestamps)
+  {
+    return;
   }
-  /* We know we have a sufficient number of bytes for the second constant section, so we check if they're right */
-  size_t beginning_second_constant_segment = current_index;
-  size_t i;
-  for (current_index = beginning_second_constant_segment, i = 0;
-      current_index
-          < beginning_second_constant_segment + second_constant_segment_size;
-      ++current_index, ++i)
+  KJCLatencyHistogram departure;
+  uint64_t lost = 0;
+  for (const std::unique_ptr<KJCSensorServer> &worker : workers)
   {
-    if (second_constant_segment[i] != read[current_index])
+    if (worker->tx_timestamps != nullptr)
     {
-      return false;
+      departure.Add(worker->tx_timestamps->departure);
+      lost += worker->tx_timestamps->lost;
     }
   }
-  /* current_index situated one index past the end of the third segment */
-  assert(
-      current_index
-          == (first_constant_segment_size + length_duration_string
-              + second_constant_segment_size));
-  assert(
-      read[current_index - 1]
-          == second_constant_segment[second_constant_segment_size - 1]);
+  fprintf(out,
+          "Departure (kernel TX timestamp after the schedule): %" PRIu64
+          " sends, mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us,"
+          " %" PRIu64 " timestamps missing\n", departure.count,
+          departure.MeanNanoseconds() / 1e3,
+          double(departure.PercentileNanoseconds(50)) / 1e3,
+          double(departure.PercentileNanoseconds(99)) / 1e3,
+          double(departure.PercentileNanoseconds(99.9)) / 1e3,
+          double(departure.max_nanoseconds) / 1e3, lost);
+}
 
-  /* Now we check the rate field. We're assuming that it could contain a decimal point, 
-     in which case we want the milliseconds and microseconds */
-  size_t first_index_rate_inclusive = current_index;
-  size_t last_index_rate_inclusive;
-  after_decimal_point = false; /* Resetting after_decimal_point variable from result of duration field parsing */
-  while (1)
+size_t KJCWorkerGroup::SessionCount() const
+{
+  size_t count = 0;
+  for (const std::unique_ptr<KJCSensorServer> &worker : workers)
   {
-    if (current_index >= bytes_received)
-    {
-      /* If parsing hasn't finished at the end of recv buffer, we have an incomplete message */
-      return false;
-    }
-    else if (read[current_index] == separator[0])
+    count += worker->sessions.size();
+  }
+  return count;
+}
+
+void KJCWorkerGroup::Bind()
+{
+  /* A single worker keeps the plain socket it always had */
+  bool reuse_port = workers.size() > 1;
+  char port[NI_MAXSERV];
+  snprintf(port, sizeof(port), "%s", options.port);
+  for (std::unique_ptr<KJCSensorServer> &worker : workers)
+  {
+    int socket_listen;
+    worker->SetupSocket(&socket_listen, options.bind_address, port, reuse_port);
+    sockets.push_back(socket_listen);
+    snprintf(port, sizeof(port), "%u", unsigned(Port()));
+  }
+  printf("Serving on port %u with %zu worker(s)\n", unsigned(Port()),
+         workers.size());
+}
+
+uint16_t KJCWorkerGroup::Port() const
+{
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  if (sockets.empty()
+      || getsockname(sockets[0], (struct sockaddr*) &address, &address_len) < 0)
+  {
+    return 0;
+  }
+  return ntohs(address.sin_port);
+}
+
+void KJCWorkerGroup::Run()
+{
+  /* Each pacing thread gets the next CPU of --cpus, or with several workers
+     the next one we may run on, wrapping around */
+  std::vector<int> cpus = options.realtime.cpus;
+  cpu_set_t allowed;
+  if (cpus.empty() && workers.size() > 1
+      && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+  {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
     {
-      /* Check if we're at a separator character indicating the end of the rate field */
-      if (current_index == second_constant_segment_size
-          || ((current_index == second_constant_segment_size + 1)
-              && after_decimal_point))
-      {
-        /* rate field was empty, or was just a decimal point */
-        return false;
-      }
-      else
+      if (CPU_ISSET(cpu, &allowed))
       {
-        /* Successfully parsed rate field */
-        last_index_rate_inclusive = current_index - 1;
-        break;
+        cpus.push_back(cpu);
       }
     }
-    else if (read[current_index] == decimal_point[0])
+  }
+  size_t next_cpu = 0;
+  for (std::unique_ptr<KJCSensorServer> &worker : workers)
+  {
+    if (cpus.empty())
     {
-      if (after_decimal_point)
-      {
-        /* Second decimal point - error */
-        return false;
-      }
-      after_decimal_point = true;
+      break;
     }
-    else if (!isdigit(read[current_index]))
+    worker->loop_cpu = cpus[next_cpu++ % cpus.size()];
+    if (worker->pipeline != nullptr)
     {
-      /* Not a digit or a separator or a decimal point - parsing error */
-      return false;
+      worker->transmit_cpu = cpus[next_cpu++ % cpus.size()];
     }
-    current_index++;
   }
-  /* current_index situated at the separator character at the end of the rate field */
-  size_t length_rate_string = (last_index_rate_inclusive
-      - first_index_rate_inclusive) + 1;
-  /* current_index is just past the end of the fourth section */
-  assert(read[current_index] == separator[0]);
-  assert(
-      current_index
-          == (first_constant_segment_size + length_duration_string
-              + second_constant_segment_size + length_rate_string));
 
-  char *rate_string = (char*) malloc(length_rate_string + 1); /* Add spot for a null character at the end */
-  if (rate_string == nullptr)
+  if (workers.size() == 1)
   {
-    fprintf(stderr, "OOM\n");
-    exit(1);
+    workers[0]->Serve(sockets[0]);
+    return;
   }
-  memcpy(
-      rate_string,
-      read + first_constant_segment_size + length_duration_string
-          + second_constant_segment_size,
-      length_rate_string);
-      
-  rate_string[length_rate_string] = '\0';
-
-  if (after_decimal_point)
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < workers.size(); ++i)
   {
-    double milliseconds = atof(rate_string);
-    rate_milliseconds = std::chrono::milliseconds { uint64_t(
-        floor(milliseconds)) };
-    rate_microseconds = std::chrono::microseconds { uint64_t(
-        floor((milliseconds - floor(milliseconds)) * 1e3)) };
+    threads.emplace_back([this, i]
+                         { workers[i]->Serve(sockets[i]); });
   }
-  else
+  for (std::thread &thread : threads)
   {
-    int64_t milliseconds = atoi(rate_string);
-    rate_milliseconds = std::chrono::milliseconds { milliseconds };
-    rate_microseconds = std::chrono::microseconds { 0 };
+    thread.join();
   }
+}
 
-  free(rate_string);
-
-  /* Now check that there aren't junk characters at the end that would ruin an otherwise correct message */
-  size_t length_entire_message = current_index + 1;
-  if (!(length_entire_message == bytes_received))
+void KJCWorkerGroup::Shutdown()
+{
+  for (std::unique_ptr<KJCSensorServer> &worker : workers)
   {
-    return false;
+    worker->Shutdown();
   }
+}
 
-  return true;
-
+#ifndef KJC_SENSOR_SERVER_NO_MAIN
+static void PrintUsage(const char *program)
+{
+  fprintf(stderr,
+          "Usage: %s [--pacing=hybrid|nanosleep|timerfd] [--bind=ADDRESS] [--port=PORT]\n"
+          "          [--workers=N (0 for one per CPU)] [--channels=N (1 to %zu)]\n"
+          "          [--channel=INDEX,sine|square|triangle|sawtooth,FREQUENCY_HZ,PHASE_DEGREES,AMPLITUDE]...\n"
+          "          [--trace=NAME=PATH]... [--record=PATH] [--pipeline=DEPTH (1 to %zu)]\n"
+          "          [--rt] [--rt-priority=1..99] [--cpus=LIST (e.g. 2,4-7)] [--tx-timestamps]\n"
+          "          [--resend-buffer=BYTES per session] [--resend-rate=MESSAGES/s per worker]\n"
+          "          [--idle-sessions=N per worker]\n"
+          "          [--publish=GROUP:PORT|local] [--publish-stream=RATE=ms;[START fields;]...]\n"
+          "          [--speed=FACTOR|max] [--generate=DURATION=s;RATE=ms;[START fields;]...\n"
+          "           --output=PATH|ADDRESS:PORT]\n",
+          program, KJCSensorModel::max_channels, KJCSamplePipeline::max_depth);
 }
 
-/* Sensor value messages are formatted like: "STATUS;TIME=ms;MV=mv;MA=ma;" */
-/* We are choosing to send time as a function of beginning of measurement */
-void KJCSensorServer::SendSensorValue(int socket, struct sockaddr *address,
-                                      std::pair<int32_t, int32_t> value, clk::time_point current,
-                                      clk::time_point start)
-{
-  constexpr const char *first_constant_segment = "STATUS;TIME=";
-  constexpr const char *second_constant_segment = ";MV=";
-  constexpr const char *third_constant_segment = ";MA=";
-  constexpr const char *fourth_constant_segment = ";";
-  constexpr int first_constant_segment_size = constexpr_strlen(
-      first_constant_segment);
-  constexpr int second_constant_segment_size = constexpr_strlen(
-      second_constant_segment);
-  constexpr int third_constant_segment_size = constexpr_strlen(
-      third_constant_segment);
-  constexpr int fourth_constant_segment_size = constexpr_strlen(
-      fourth_constant_segment);
-  uint64_t millis = (std::chrono::time_point_cast < std::chrono::milliseconds
-      > (current) - std::chrono::time_point_cast < std::chrono::milliseconds
-      > (start)).count();
-  constexpr int sensor_value_buffer_size = 100;
-  char sensor_value_millivolts[sensor_value_buffer_size];
-  char sensor_value_milliamps[sensor_value_buffer_size];
-
-  int32_t characters_written_millivolts = snprintf(sensor_value_millivolts,
-                                          sensor_value_buffer_size, "%d",
-                                          value.first);
-  int32_t characters_written_milliamps = snprintf(sensor_value_milliamps,
-                                          sensor_value_buffer_size, "%d",
-                                          value.second);
-  if (characters_written_millivolts < 1
-      || characters_written_millivolts >= sensor_value_buffer_size)
-  {
-    fprintf(stderr, "snprintf() failed on millivolts.\n");
-  }
-  if (characters_written_milliamps < 1
-      || characters_written_milliamps >= sensor_value_buffer_size)
-  {
-    fprintf(stderr, "snprintf() failed on milliamps.\n");
-  }
-  constexpr int milliseconds_time_buffer_size = 100;
-  char milliseconds_time[milliseconds_time_buffer_size];
-  /* Use cross platform macro PRIu64 for uint64_t format specifier in snprintf */
-  int characters_written_time = snprintf(milliseconds_time,
-                                         milliseconds_time_buffer_size,
-                                         "%" PRIu64, millis);
-  if (characters_written_time < 1
-      || characters_written_time >= sensor_value_buffer_size)
-  {
-    fprintf(stderr, "snprintf() failed on parse of millisecond field.\n");
-  }
-
-  constexpr uint64_t sensor_value_message_buffer_size = 1024;
-  char sensor_value_message[sensor_value_message_buffer_size];
-
-  size_t total_message_length = first_constant_segment_size
-      + characters_written_time + second_constant_segment_size
-      + characters_written_millivolts + third_constant_segment_size
-      + characters_written_milliamps + fourth_constant_segment_size
-      + 1 /* For null terminator if we printf */;
-  /* Check message is not too long */
-  if (total_message_length > sensor_value_message_buffer_size)
-  {
-    fprintf(stderr, "Can send sensor value message, too long.\n");
-    exit(1);
+static KJCWorkerGroup *volatile running_group = nullptr;
+
+/* --publish and --publish-stream; nullptr, with the reason printed, if they
+   don't make a stream we can publish */
+static std::shared_ptr<const KJCPublishOptions> MakePublishOptions(
+    const char *target, const char *fields, const KJCSensorModel &model)
+{
+  std::shared_ptr<KJCPublishOptions> publish = std::make_shared<KJCPublishOptions>();
+  if (strcmp(target, "local") == 0)
+  {
+    publish->mode = KJCPublishMode::Local;
   }
-  size_t current_index = 0;
-  /* "STATUS;TIME=" segment */
-  memcpy(&sensor_value_message[current_index], first_constant_segment,
-         first_constant_segment_size);
-  current_index += first_constant_segment_size;
-  /* ms field */
-  // TODO KJC could snprintf directly into buffer
-  memcpy(&sensor_value_message[current_index], milliseconds_time,
-         characters_written_time);
-  current_index += characters_written_time;
-  /* ";MV=" segment */
-  memcpy(&sensor_value_message[current_index], second_constant_segment,
-         second_constant_segment_size);
-  current_index += second_constant_segment_size;
-  /* mv field */
-  // TODO KJC could snprintf directly into buffer
-  memcpy(&sensor_value_message[current_index], sensor_value_millivolts,
-         characters_written_millivolts);
-  current_index += characters_written_millivolts;
-  /* ";MA=" */
-  memcpy(&sensor_value_message[current_index], third_constant_segment,
-         third_constant_segment_size);
-  current_index += third_constant_segment_size;
-  /* ma field */
-  // TODO KJC could snprintf directly into buffer
-  memcpy(&sensor_value_message[current_index], sensor_value_milliamps,
-         characters_written_milliamps);
-  current_index += characters_written_milliamps;
-  /* ";" segment */
-  memcpy(&sensor_value_message[current_index], fourth_constant_segment,
-         fourth_constant_segment_size);
-  current_index += fourth_constant_segment_size;
-  /* We set the index after this last one to zero, which isn't included in the
-     UDP message we send out but is useful if we add a debug printf */
-  sensor_value_message[current_index + 1] = '\0';
-  /* This doesn't include the null terminator character */
-  int sensor_value_message_size = current_index /* + 1*/;
-
-  /* TODO KJC pass in the size as a parameter rather than sizeof sockaddr_storage 
-     in case a different sockaddr type is used in the future */
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, sensor_value_message, sensor_value_message_size, 0, address,
-         sizeof(sockaddr_storage));
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  else
+  {
+    /* The server's sockets are IPv4, so the group is too */
+    const char *separator = strrchr(target, ':');
+    std::string host { target, separator != nullptr ? size_t(separator - target) : 0 };
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    struct addrinfo *group;
+    if (separator == nullptr
+        || getaddrinfo(host.c_str(), separator + 1, &hints, &group) != 0)
+    {
+      fprintf(stderr, "Bad publish group, expected ADDRESS:PORT or local: %s\n", target);
+      return nullptr;
+    }
+    memcpy(&publish->group, group->ai_addr, group->ai_addrlen);
+    publish->group_len = group->ai_addrlen;
+    freeaddrinfo(group);
+    const struct sockaddr_in *in = (const struct sockaddr_in*) &publish->group;
+    if (!IN_MULTICAST(ntohl(in->sin_addr.s_addr)))
+    {
+      fprintf(stderr, "Not a multicast group: %s\n", target);
+      return nullptr;
+    }
+    publish->mode = KJCPublishMode::Multicast;
   }
-}
+  publish->name = target;
 
-void KJCSensorServer::SendStartedMessage(int socket,
-                                         struct sockaddr *peer_address,
-                                         socklen_t peer_len)
-{
-  constexpr const char *started_message = "TEST;RESULT=STARTED;";
-  constexpr size_t started_message_size = constexpr_strlen(started_message);
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, started_message, started_message_size, 0, peer_address,
-         peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  /* Samples of the model on a fixed grid; a trace replay or aggregates
+     belong to one client's run */
+  publish->fields = fields;
+  if (!KJCCommandParser::ParseStream(fields, fields + strlen(fields), publish->rate,
+                                     publish->stream)
+      || publish->rate <= clk::duration { 0 } || !publish->stream.trace.empty()
+      || publish->stream.window > 0
+      || (publish->stream.channel_mask & ~model.AllChannels()) != 0)
+  {
+    fprintf(stderr, "Bad publish stream, expected RATE=ms; and BATCH, FORMAT, TSRES "
+            "or CHANNELS fields: %s\n", fields);
+    return nullptr;
   }
+  publish->epoch = clk::now();
+  return publish;
 }
-void KJCSensorServer::SendStoppedMessage(int socket,
-                                         struct sockaddr *peer_address,
-                                         socklen_t peer_len)
+
+/* --generate and --output; nullptr, with the reason printed, if they don't
+   make a stream we can generate */
+static std::shared_ptr<const KJCGenerateOptions> MakeGenerateOptions(
+    const char *fields, const char *output, const KJCServerOptions &options)
 {
-  constexpr const char *stopped_message = "TEST;RESULT=STOPPED;";
-  constexpr size_t stopped_message_size = constexpr_strlen(stopped_message);
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, stopped_message, stopped_message_size, 0, peer_address,
-         peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  std::shared_ptr<KJCGenerateOptions> generate = std::make_shared<KJCGenerateOptions>();
+  generate->command = std::string { "TEST;CMD=START;" } + fields;
+  KJCCommand command = KJCCommandParser::Parse(generate->command.data(),
+                                               generate->command.size());
+  const KJCStartCommand *start = std::get_if<KJCStartCommand>(&command);
+  if (start == nullptr)
+  {
+    fprintf(stderr, "Bad generate stream, expected DURATION=s;RATE=ms; and START "
+            "fields: %s\n", fields);
+    return nullptr;
   }
-}
-void KJCSensorServer::SendErrorAlreadyStartedMessage(
-    int socket, struct sockaddr *peer_address, socklen_t peer_len)
-{
-  constexpr const char *error_already_started_message =
-      "TEST;RESULT=error;MSG=already_started;";
-  constexpr size_t error_already_started_message_size = constexpr_strlen(
-      error_already_started_message);
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, error_already_started_message,
-         error_already_started_message_size, 0, peer_address, peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  generate->duration = start->duration;
+  generate->rate = start->rate;
+  generate->stream = start->options;
+  uint64_t all_channels = options.model.AllChannels();
+  if (!start->options.trace.empty())
+  {
+    auto trace = std::find_if(options.traces.begin(), options.traces.end(),
+        [start](const std::shared_ptr<const KJCTrace> &candidate)
+        { return start->options.trace == candidate->name; });
+    if (trace == options.traces.end())
+    {
+      fprintf(stderr, "Unknown trace in the generate stream: %.*s\n",
+              int(start->options.trace.size()), start->options.trace.data());
+      return nullptr;
+    }
+    all_channels = KJCChannelSelection::AllOf((*trace)->channel_count);
   }
-}
-void KJCSensorServer::SendErrorAlreadyStoppedMessage(
-    int socket, struct sockaddr *peer_address, socklen_t peer_len)
-{
-  constexpr const char *error_already_stopped_message =
-      "TEST;RESULT=error;MSG=already_stopped;";
-  constexpr size_t error_already_stopped_message_size = constexpr_strlen(
-      error_already_stopped_message);
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, error_already_stopped_message,
-         error_already_stopped_message_size, 0, peer_address, peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  if ((start->options.channel_mask & ~all_channels) != 0)
+  {
+    fprintf(stderr, "Unknown channel in the generate stream: %s\n", fields);
+    return nullptr;
   }
-}
-void KJCSensorServer::SendDiscoveryMessage(int socket,
-                                           struct sockaddr *peer_address,
-                                           socklen_t peer_len)
-{
-  constexpr const char *discovery_response = "ID;MODEL=1531;SERIAL=4643;";
-  constexpr size_t discovery_response_length = constexpr_strlen(
-      discovery_response);
-  // TODO KJC handle errors on the socket
-  ssize_t bytes_sent = sendto(socket, discovery_response, discovery_response_length, 0, peer_address,
-         peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  if (start->rate == clk::duration { 0 } && start->options.trace.empty()
+      && options.speed == 0.0)
+  {
+    fprintf(stderr, "RATE=0 never ends at --speed=max without a trace: %s\n",
+            fields);
+    return nullptr;
+  }
+
+  /* An IPv4 ADDRESS:PORT gets the datagrams; anything else is a file */
+  const char *separator = strrchr(output, ':');
+  std::string host { output, separator != nullptr ? size_t(separator - output) : 0 };
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+  struct addrinfo *address;
+  if (separator != nullptr
+      && getaddrinfo(host.c_str(), separator + 1, &hints, &address) == 0)
+  {
+    memcpy(&generate->address, address->ai_addr, address->ai_addrlen);
+    generate->address_len = address->ai_addrlen;
+    freeaddrinfo(address);
+    return generate;
   }
+  memset(&generate->address, 0, sizeof(generate->address));
+  generate->file = KJCStreamFile::Open(output);
+  return generate->file != nullptr ? generate : nullptr;
 }
-void KJCSensorServer::SendIdleStatusMessage(int socket,
-                                            struct sockaddr *peer_address,
-                                            socklen_t peer_len)
+
+static void HandleTerminationSignal(int)
 {
-  constexpr const char *idle_status_message = "STATUS;STATE=IDLE;";
-  constexpr size_t idle_status_message_size = constexpr_strlen(
-      idle_status_message);
-  // TODO KJC handle errors on the socket 
-  ssize_t bytes_sent = sendto(socket, idle_status_message, idle_status_message_size, 0, peer_address,
-         peer_len);
-  if(bytes_sent < 0){
-    fprintf(stderr, "Error on sendto(). Errno (%d)\n", errno);
+  KJCWorkerGroup *group = running_group;
+  if (group != nullptr)
+  {
+    group->Shutdown();
   }
 }
 
-
-/* Listen for commands over the network, parse them, and dispatch */
-void KJCSensorServer::CommandParsingThread(
-    int socket, struct sockaddr *peer_address, socklen_t peer_len,
-    std::atomic<bool> &received_stop, std::binary_semaphore &stop_signal,
-    std::binary_semaphore &wakeup_io_thread)
+int main(int argc, char **argv)
 {
-
-
-  /* The std::chrono variables here are just placeholders because we ignore start
-     commands in the thread this function runs in, at least in this version */
-  std::chrono::seconds duration_seconds;
-  std::chrono::milliseconds rate_milliseconds;
-  std::chrono::microseconds duration_microseconds, rate_microseconds;
-  /* TODO KJC consider this and other buffers in functions to be in static memory not to pollute stack */
-  while (1)
+  KJCServerOptions options { };
+  static const struct option long_options[] = {
+      { "pacing", required_argument, nullptr, 'p' },
+      { "bind", required_argument, nullptr, 'b' },
+      { "port", required_argument, nullptr, 'P' },
+      { "workers", required_argument, nullptr, 'w' },
+      { "channels", required_argument, nullptr, 'c' },
+      { "channel", required_argument, nullptr, 'C' },
+      { "trace", required_argument, nullptr, 't' },
+      { "record", required_argument, nullptr, 'r' },
+      { "pipeline", required_argument, nullptr, 'l' },
+      { "rt", no_argument, nullptr, 'R' },
+      { "rt-priority", required_argument, nullptr, 'y' },
+      { "cpus", required_argument, nullptr, 'u' },
+      { "tx-timestamps", no_argument, nullptr, 'x' },
+      { "resend-buffer", required_argument, nullptr, 'B' },
+      { "resend-rate", required_argument, nullptr, 'S' },
+      { "idle-sessions", required_argument, nullptr, 'I' },
+      { "publish", required_argument, nullptr, 'g' },
+      { "publish-stream", required_argument, nullptr, 'G' },
+      { "speed", required_argument, nullptr, 'v' },
+      { "generate", required_argument, nullptr, 'e' },
+      { "output", required_argument, nullptr, 'o' },
+      { "help", no_argument, nullptr, 'h' },
+      { nullptr, 0, nullptr, 0 } };
+  /* Applied once the channel count is known, whatever the order */
+  std::vector<const char*> channel_specifications;
+  const char *publish_target = nullptr;
+  const char *publish_fields = "RATE=10;";
+  const char *generate_fields = nullptr;
+  const char *generate_output = nullptr;
+  bool speed_given = false;
+  bool port_given = false;
+  int option;
+  while ((option = getopt_long(argc, argv, "h", long_options, nullptr)) != -1)
   {
-    wakeup_io_thread.acquire();
-    char read[1024];
-    while (!received_stop)
+    switch (option)
     {
-      printf("Starting the recv loop in the IO thread again\n");
-      // TODO KJC check for errors from the recvfrom
-      ssize_t bytes_received = recvfrom(socket, read, 1024, 0, peer_address,
-                                        &peer_len);
-      if(bytes_received < 0){
-        fprintf(stderr, "Error on recvfrom(). Errno (%d)\n", errno);
+    case 'p':
+      if (!KJCPacer::ParseMode(optarg, options.pacing_mode))
+      {
+        fprintf(stderr, "Unknown pacing mode: %s\n", optarg);
+        PrintUsage(argv[0]);
+        return 1;
       }
-      if (ParseStartCommand(read, bytes_received, duration_seconds,
-                            duration_microseconds, rate_milliseconds,
-                            rate_microseconds))
+      break;
+    case 'b':
+      options.bind_address = optarg;
+      break;
+    case 'P':
+      options.port = optarg;
+      port_given = true;
+      break;
+    case 'w':
       {
-        printf("Got a hit on a start command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send already started message back */
-        SendErrorAlreadyStartedMessage(socket, peer_address, peer_len);
+        char *end;
+        unsigned long workers = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || workers > 1024)
+        {
+          fprintf(stderr, "Bad worker count: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.workers = unsigned(workers);
       }
-      else if (ParseStopCommand(read, bytes_received))
+      break;
+    case 'c':
       {
-        printf("Got a hit on the stop command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send already stopped message back. */
-        received_stop = true;
-        printf("Releasing the semaphore io thread\n");
-        stop_signal.release();
-        printf("Released the semaphore in the IO thread\n");
-        std::this_thread::sleep_for(std::chrono::seconds(0));
-        /* The other thread handles the cleanup messages on this path */
+        char *end;
+        unsigned long channels = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || channels == 0
+            || channels > KJCSensorModel::max_channels)
+        {
+          fprintf(stderr, "Bad channel count: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.model = KJCSensorModel::Uniform(channels);
       }
-      else if (ParseIdCommand(read, bytes_received))
+      break;
+    case 'C':
+      channel_specifications.push_back(optarg);
+      break;
+    case 't':
       {
-        printf("Got a hit on the id command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send identification message back */
-        SendDiscoveryMessage(socket, peer_address, peer_len);
+        char *separator = strchr(optarg, '=');
+        if (separator == nullptr)
+        {
+          fprintf(stderr, "Bad trace, expected NAME=PATH: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        *separator = '\0';
+        std::shared_ptr<const KJCTrace> trace = KJCTrace::Open(optarg, separator + 1);
+        if (trace == nullptr)
+        {
+          return 1;
+        }
+        options.traces.push_back(trace);
       }
-      else
+      break;
+    case 'l':
       {
-        // TODO debug out the printf
-        printf("Got something that didn't recognize: %.*s\n",
-               (int) bytes_received, read);
-        /* Don't recognize this message so just ignore it */
+        char *end;
+        unsigned long depth = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || depth == 0
+            || depth > KJCSamplePipeline::max_depth)
+        {
+          fprintf(stderr, "Bad pipeline depth: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.pipeline_depth = depth;
       }
-    }
-  }
-}
-
-int KJCSensorServer::Main()
-{
-  clk::time_point start_timepoint;
-  clk::time_point end_timepoint;
-  clk::time_point current_timepoint;
-  clk::duration rate;
-
-  std::binary_semaphore stop_signal { 0 };
-  std::binary_semaphore wakeup_io_thread { 0 };
-
-  /* Create socket */
-  int socket_listen;
-
-  SetupSocket(&socket_listen, nullptr, "8080");
-  /* Create structure for peer address storage */
-  struct sockaddr_storage peer_address;
-  socklen_t peer_len = sizeof(sockaddr_storage);
-  char read[1024];
-
-  bool send_data { false };
-
-  std::atomic<bool> received_stop { false };
-  auto thread1 = std::thread([=, this, &socket_listen, &peer_address, &peer_len, &received_stop, &stop_signal, &wakeup_io_thread]
-                              { CommandParsingThread(socket_listen,
-                                                      (struct sockaddr*) &peer_address,
-                                                      peer_len,
-                                                      std::ref(received_stop),
-                                                      std::ref(stop_signal),
-                                                      std::ref(wakeup_io_thread));});
-
-
-
-
-
-  std::chrono::seconds duration_seconds;
-  std::chrono::milliseconds rate_milliseconds;
-  std::chrono::microseconds duration_microseconds, rate_microseconds;
-
-  while (1)
-  {
-    /* Possibly re-entering from a start cmd after a stop cmd or a survey end */
-    send_data = false;
-    stop_signal.try_acquire();
-    received_stop = false;
-    while (!send_data)
-    {
-      // TODO KJC remove print
-      std::cout << "Restarting the recvfrom " << std::endl;
-      ssize_t bytes_received = recvfrom(socket_listen, read, 1024, 0,
-                                        (struct sockaddr*) &peer_address,
-                                        &peer_len);
-      if (send_data = ParseStartCommand(read, bytes_received, duration_seconds,
-                                        duration_microseconds,
-                                        rate_milliseconds, rate_microseconds))
+      break;
+    case 'R':
+      options.realtime.enabled = true;
+      break;
+    case 'y':
       {
-        printf("Got a hit on a start command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send a starting message back */
-        SendStartedMessage(socket_listen, (struct sockaddr*) &peer_address,
-                           peer_len);
-        /* Shift reading of messages to the IO thread, wake it up */
-        wakeup_io_thread.release();
+        char *end;
+        long priority = strtol(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || priority < 1 || priority > 99)
+        {
+          fprintf(stderr, "Bad real-time priority: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.realtime.priority = int(priority);
       }
-      else if (ParseStopCommand(read, bytes_received))
+      break;
+    case 'u':
+      if (!KJCRealTimeProfile::ParseCpuList(optarg, options.realtime.cpus))
       {
-        printf("Got a hit on the stop command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send already stopped message back. */
-        SendErrorAlreadyStoppedMessage(socket_listen,
-                                       (struct sockaddr*) &peer_address,
-                                       peer_len);
+        fprintf(stderr, "Bad CPU list: %s\n", optarg);
+        PrintUsage(argv[0]);
+        return 1;
       }
-      else if (ParseIdCommand(read, bytes_received))
+      break;
+    case 'x':
+      options.tx_timestamps = true;
+      break;
+    case 'B':
       {
-        printf("Got a hit on the id command: %.*s\n", (int) bytes_received,
-               read);
-        /* Send identification message back */
-        SendDiscoveryMessage(socket_listen, (struct sockaddr*) &peer_address,
-                             peer_len);
+        char *end;
+        unsigned long long bytes = strtoull(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || bytes > (1ull << 30))
+        {
+          fprintf(stderr, "Bad resend buffer size: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.resend_buffer = bytes;
       }
-      else
+      break;
+    case 'S':
+      {
+        char *end;
+        unsigned long rate = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || rate == 0 || rate > 10000000)
+        {
+          fprintf(stderr, "Bad resend rate: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.resend_rate = uint32_t(rate);
+      }
+      break;
+    case 'I':
+      {
+        char *end;
+        unsigned long count = strtoul(optarg, &end, 10);
+        if (*optarg == '\0' || *end != '\0' || count > 10000000)
+        {
+          fprintf(stderr, "Bad idle session count: %s\n", optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.idle_sessions = count;
+      }
+      break;
+    case 'g':
+      publish_target = optarg;
+      break;
+    case 'G':
+      publish_fields = optarg;
+      break;
+    case 'v':
+      {
+        char *end;
+        bool unlimited = strcmp(optarg, "max") == 0;
+        double speed = unlimited ? 0.0 : strtod(optarg, &end);
+        if (!unlimited && (*optarg == '\0' || *end != '\0' || !(speed > 0.0)
+            || speed > 1e6))
+        {
+          fprintf(stderr, "Bad speed, expected a factor up to 1000000 or max: %s\n",
+                  optarg);
+          PrintUsage(argv[0]);
+          return 1;
+        }
+        options.speed = speed;
+        speed_given = true;
+      }
+      break;
+    case 'e':
+      generate_fields = optarg;
+      break;
+    case 'o':
+      generate_output = optarg;
+      break;
+    case 'r':
+      options.recorder = KJCRecorder::Open(optarg);
+      if (options.recorder == nullptr)
       {
-        printf("Got something that didn't recognize: %.*s\n",
-               (int) bytes_received, read);
-        /* Don't recognize this message so just ignore it */
+        return 1;
       }
+      break;
+    default:
+      PrintUsage(argv[0]);
+      return option == 'h' ? 0 : 1;
     }
-
-    start_timepoint = clk::now();
-    end_timepoint = start_timepoint
-        + (duration_seconds + duration_microseconds);
-    current_timepoint = start_timepoint;
-    rate = rate_milliseconds + rate_microseconds;
-
-    
-    bool stop_iterating = false;
-
-    while (!stop_iterating)
+  }
+  if (options.tx_timestamps && options.pipeline_depth > 0)
+  {
+    /* The transmit thread sends, but the loop would get the timestamps */
+    fprintf(stderr, "--tx-timestamps can't be combined with --pipeline\n");
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  for (const char *specification : channel_specifications)
+  {
+    if (!options.model.ConfigureChannel(specification))
     {
-      double time_seconds = (std::chrono::duration<double, std::ratio<1,1>> { current_timepoint
-          - start_timepoint }).count();
-      printf("timeseconds %f\n", time_seconds);
-      std::pair<int32_t, int32_t> value = KJCSensor::SensorValue(time_seconds);
-      SendSensorValue(socket_listen, (struct sockaddr*) &peer_address, value,
-                      current_timepoint, start_timepoint);
-
-      clk::time_point next_timepoint = current_timepoint + rate;
-      SleepSpecial(next_timepoint, stop_signal);
-      current_timepoint = next_timepoint;
-      
-      stop_iterating = received_stop || (clk::now() > end_timepoint);
+      fprintf(stderr, "Bad channel: %s\n", specification);
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (publish_target != nullptr)
+  {
+    if (options.pipeline_depth > 0 && strcmp(publish_target, "local") == 0)
+    {
+      /* The subscriber list belongs to the loop, not the transmit thread */
+      fprintf(stderr, "--publish=local can't be combined with --pipeline\n");
+      PrintUsage(argv[0]);
+      return 1;
     }
-    if (received_stop)
+    options.publish = MakePublishOptions(publish_target, publish_fields, options.model);
+    if (options.publish == nullptr)
     {
-      SendStoppedMessage(socket_listen, (struct sockaddr*) &peer_address,
-                         peer_len);
+      PrintUsage(argv[0]);
+      return 1;
     }
-    SendIdleStatusMessage(socket_listen, (struct sockaddr*) &peer_address,
-                          peer_len);
   }
 
-  Cleanup(socket_listen);
-  return 0;
-}
+  if ((generate_fields == nullptr) != (generate_output == nullptr))
+  {
+    fprintf(stderr, "--generate and --output go together\n");
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  if (generate_fields != nullptr)
+  {
+    if (options.workers != 1)
+    {
+      fprintf(stderr, "--generate runs one worker\n");
+      PrintUsage(argv[0]);
+      return 1;
+    }
+    /* Nobody needs to reach it, and it shouldn't be kept waiting */
+    if (!port_given)
+    {
+      options.port = "0";
+    }
+    if (!speed_given)
+    {
+      options.speed = 0.0;
+    }
+    options.generate = MakeGenerateOptions(generate_fields, generate_output, options);
+    if (options.generate == nullptr)
+    {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.speed != 1.0
+      && (options.pipeline_depth > 0 || options.publish != nullptr || options.tx_timestamps))
+  {
+    /* Those keep to the steady clock: the transmit thread, the epoch of the
+       published stream and the kernel's timestamps */
+    fprintf(stderr, "--speed can't be combined with --pipeline, --publish or "
+            "--tx-timestamps\n");
+    PrintUsage(argv[0]);
+    return 1;
+  }
 
-int main()
-{
-  KJCSensorServer theServer{};
-  return theServer.Main();
+  KJCWorkerGroup theServer { options };
+  /* SIGINT and SIGTERM stop the loops, so the recorder can finish its file */
+  running_group = &theServer;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = HandleTerminationSignal;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGINT, &action, nullptr) < 0
+      || sigaction(SIGTERM, &action, nullptr) < 0)
+  {
+    fprintf(stderr, "Can't install the signal handlers. (%d)\n", errno);
+  }
+  int result = theServer.Main();
+  running_group = nullptr;
+  if (options.generate != nullptr && options.generate->file != nullptr
+      && !options.generate->file->Close())
+  {
+    result = 1;
+  }
+  return result;
 }
+#endif
 
 /* TEST;CMD=START;DURATION=3600;RATE=15000; */
 /* TEST;CMD=START;DURATION=3600;RATE=1000; */